@@ -0,0 +1,368 @@
+/****************************************************************************
+ File        : audit.c
+ Description : Audit mode, for returned or in-field units: every attached
+               bootloader device is read back at once, one process per
+               device, and the firmware in each is identified from a list
+               of known hex files.  A tray of boards takes about as long as
+               one (bus bandwidth allowing; see --sched).
+
+               Devices are shared out the way one process per board shares
+               them when flashing: each process opens the first device no
+               other process holds.  Processes are started one at a time,
+               each once the last has its device, until one finds none
+               left; all keep their devices until every one is claimed.
+               A device seen twice (same serial number and bus address)
+               also ends the search, for USB code that doesn't claim
+               devices exclusively.
+
+               A device's program memory, in address order, is hashed as
+               it is read (64-bit FNV-1a), never held in full.  Each known
+               image is laid out the same way for that device's memory map,
+               unwritten bytes reading as erased (0xff), and hashed to
+               compare: by the first process, once for each distinct map
+               (deviceMapText()) among the devices, not once per device.  Configuration words and EEPROM are left out: they
+               vary from unit to unit, and unimplemented bits read back
+               differently from what hex files hold.
+
+               Results (status, hash and map) come back to the first
+               process by pipe and are printed one line per device, in the order devices were
+               found.  Needs fork(); not in the Windows build.
+
+ License     : This file is part of 'mphidflash' program.
+
+               'mphidflash' is free software: you can redistribute it and/or
+               modify it under the terms of the GNU General Public License
+               as published by the Free Software Foundation, either version
+               3 of the License, or (at your option) any later version.
+
+               'mphidflash' is distributed in the hope that it will be useful,
+               but WITHOUT ANY WARRANTY; without even the implied warranty
+               of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+               See the GNU General Public License for more details.
+
+               You should have received a copy of the GNU General Public
+               License along with 'mphidflash' source code.  If not,
+               see <http://www.gnu.org/licenses/>.
+
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "mphidflash.h"
+
+#define AUDIT_DEVICES  128   /* Most devices audited at once            */
+#define AUDIT_IMAGES   256   /* Most known images                       */
+#define AUDIT_ID       96    /* Longest device identity                 */
+#define HASH_START     0xcbf29ce484222325ULL
+
+extern unsigned char *usbBuf;  /* In usb.c */
+
+/* What a device's process sends back, in one write */
+typedef struct {
+	char               status;   /* ERR_NONE if read, else why not      */
+	unsigned long long hash;     /* Of program memory, if read          */
+	char               serial[64];
+	char               map[DEVICE_MAP]; /* deviceMapText(), if read     */
+} AuditResult;
+
+/* Known images' hashes for one memory map */
+typedef struct {
+	char               map[DEVICE_MAP];
+	unsigned long long hash[AUDIT_IMAGES];
+	char               ok[AUDIT_IMAGES];  /* Hash is good               */
+} AuditMap;
+
+static char     *images[AUDIT_IMAGES];
+static int       imageCount;
+static AuditMap *maps[AUDIT_DEVICES];
+static int       mapCount = 0;
+
+static unsigned long long auditHash(
+  unsigned long long          hash,
+  const unsigned char * const data,
+  const size_t                len)
+{
+	size_t i;
+
+	for(i=0;i<len;i++)
+		hash = (hash ^ data[i]) * 0x100000001b3ULL;
+	return hash;
+}
+
+/* Read the list of known hex files: one per line, '#' comments */
+static ErrorCode auditList(const char * const list)
+{
+	FILE *fp;
+	char  line[1024],*p;
+
+	if(!(fp = fopen(list,"r")))
+		return ERR_AUDIT_LIST;
+	for(imageCount=0;fgets(line,sizeof(line),fp);) {
+		if((p = strchr(line,'#'))) *p = 0;
+		for(p=line + strlen(line);(p > line) && (p[-1] <= ' ');p--);
+		*p = 0;
+		for(p=line;*p && (*p <= ' ');p++);
+		if(!*p) continue;
+		if((imageCount == AUDIT_IMAGES) || !(images[imageCount] = strdup(p))) {
+			(void)fclose(fp);
+			return ERR_AUDIT_LIST;
+		}
+		/* Missing or unreadable files are reported now, not per device */
+		if(ERR_NONE != hexOpen(images[imageCount])) {
+			(void)printf("Can't open known image '%s'\n",images[imageCount]);
+			(void)fclose(fp);
+			return ERR_AUDIT_LIST;
+		}
+		hexClose();
+		imageCount++;
+	}
+	(void)fclose(fp);
+
+	return imageCount ? ERR_NONE : ERR_AUDIT_LIST;
+}
+
+/* Hash the open device's program memory, reading it a block at a time */
+static ErrorCode auditRead(unsigned long long * const hash)
+{
+	ErrorCode    status = ERR_NONE;
+	unsigned int done,n;
+	int          i,block = hexGetBlockSize(),bpa = hexGetBytesPerAddress();
+	Range        span;
+
+	*hash = HASH_START;
+	for(i=0;(i < devQuery.memBlocks) && (ERR_NONE == status);i++) {
+		if((devQuery.mem[i].Type != TypeProgramMemory) ||
+		   !hexMemBlock(i,&span))
+			continue;
+		for(done=0;(done < span.len) && (ERR_NONE == status);done += n) {
+			n = (span.len - done < block) ? span.len - done : block;
+			usbBuf[0] = GET_DATA;
+			bufWrite32(usbBuf,1,(span.addr + done) / bpa);
+			usbBuf[5] = n;
+			if(ERR_NONE == (status = usbWrite(6,1)))
+				*hash = auditHash(*hash,&usbBuf[usbReportSize - n],n);
+		}
+	}
+
+	return status;
+}
+
+/* Hash a hex file's image as it would read back from the device queried */
+static ErrorCode auditImage(
+  char * const               file,
+  unsigned long long * const hash)
+{
+	ErrorCode            status;
+	unsigned char       *ops,*mem;
+	const unsigned char *p;
+	size_t               len;
+	unsigned int         addr,k;
+	int                  i;
+	Range                span;
+
+	if(ERR_NONE != (status = hexOpen(file)))
+		return status;
+	if(ERR_NONE != (status = hexOps(&ops,&len))) {
+		hexClose();
+		return status;
+	}
+
+	*hash = HASH_START;
+	for(i=0;i<devQuery.memBlocks;i++) {
+		if((devQuery.mem[i].Type != TypeProgramMemory) ||
+		   !hexMemBlock(i,&span))
+			continue;
+		if(!(mem = malloc(span.len))) {
+			status = ERR_HEX_MMAP;
+			break;
+		}
+		memset(mem,0xff,span.len);
+		/* Blocks are OP_BLOCK, address (hex file bytes), length, data */
+		for(p=ops;p < ops + len;p += 6 + p[5]) {
+			if(OP_BLOCK != p[0]) continue;
+			addr = p[1] | (p[2] << 8) | (p[3] << 16) |
+			  ((unsigned int)p[4] << 24);
+			for(k=0;k<p[5];k++)
+				if((addr + k >= span.addr) &&
+				   (addr + k - span.addr < span.len))
+					mem[addr + k - span.addr] = p[6 + k];
+		}
+		*hash = auditHash(*hash,mem,span.len);
+		free(mem);
+	}
+	hexClose();
+
+	return status;
+}
+
+/* Audit one device, in a process of its own: claim it, tell the first
+   process whether there was one (and which), read it, keep it until all
+   are claimed so that no other process takes it, and send back the
+   result */
+static void auditDevice(
+  const int            result,
+  const int            hold,
+  const unsigned short vendorID,
+  const unsigned short productID)
+{
+	AuditResult res;
+	char        id[AUDIT_ID],found;
+	int         bus = 0,addr = 0;
+
+	memset(id,0,sizeof(id));
+	memset(&res,0,sizeof(res));
+	if((id[0] = (ERR_NONE == usbOpen(vendorID,productID)))) {
+		if(!usbSerial(res.serial,sizeof(res.serial))) res.serial[0] = 0;
+		(void)usbLocation(&bus,&addr);
+		(void)snprintf(&id[1],sizeof(id) - 1,"%s/%d/%d",res.serial,bus,addr);
+	}
+	if((sizeof(id) != write(result,id,sizeof(id))) || !id[0])
+		return;
+
+	if(!res.serial[0]) {
+		if(bus || addr)
+			(void)snprintf(res.serial,sizeof(res.serial),"(bus %d addr %d)",
+			  bus,addr);
+		else
+			(void)strcpy(res.serial,"(no serial)");
+	}
+
+	if(ERR_NONE == (res.status = deviceQuery())) {
+		deviceMapText(res.map,sizeof(res.map));
+		res.status = auditRead(&res.hash);
+	}
+	/* Keep the device from the next process until all are claimed */
+	while(read(hold,&found,1) > 0);
+	usbClose();
+
+	/* Whole, in one write of no more than PIPE_BUF bytes */
+	(void)write(result,&res,sizeof(res));
+}
+
+/* The known image a device read back as, or NULL; each image is hashed
+   for the device's memory map the first time that map is seen */
+static const char *auditKnown(const AuditResult * const res)
+{
+	AuditMap *m;
+	int       i;
+
+	for(i=0;(i < mapCount) && strcmp(maps[i]->map,res->map);i++);
+	if(i == mapCount) {
+		if(!(m = malloc(sizeof(AuditMap))) ||
+		   (ERR_NONE != deviceUseMap(res->map))) {
+			free(m);
+			return NULL;
+		}
+		(void)strcpy(m->map,res->map);
+		for(i=0;i<imageCount;i++)
+			m->ok[i] = (ERR_NONE == auditImage(images[i],&m->hash[i]));
+		i = mapCount;
+		maps[mapCount++] = m;
+	}
+	m = maps[i];
+
+	for(i=0;i<imageCount;i++)
+		if(m->ok[i] && (m->hash[i] == res->hash))
+			return images[i];
+
+	return NULL;
+}
+
+/****************************************************************************
+ Function    : auditRun
+ Description : Reads back every attached bootloader device at once and
+               names the known image each carries.
+ Parameters  : char*           File listing known hex files, one per line.
+               unsigned short  Vendor ID of devices.
+               unsigned short  Product ID of devices.
+ Returns     : ErrorCode       ERR_NONE if every device carries a known
+                               image, ERR_AUDIT if any doesn't or couldn't
+                               be read, ERR_AUDIT_LIST if the list or a hex
+                               file in it can't be read, or
+                               ERR_DEVICE_NOT_FOUND if there are no devices.
+ ****************************************************************************/
+ErrorCode auditRun(
+  const char * const   list,
+  const unsigned short vendorID,
+  const unsigned short productID)
+{
+	ErrorCode          status;
+	AuditResult        res;
+	const char        *known;
+	int                result[AUDIT_DEVICES],hold[2],fd[2],n,i,k,len,bad = 0;
+	pid_t              pid[AUDIT_DEVICES];
+	char               id[AUDIT_DEVICES][AUDIT_ID];
+	unsigned long long start = traceClock();
+
+	if(ERR_NONE != (status = auditList(list)))
+		return status;
+	if(pipe(hold))
+		return ERR_AUDIT;
+
+	/* One process per device, each started once the last has claimed
+	   one, until none are left */
+	(void)fflush(stdout);
+	for(n=0;n<AUDIT_DEVICES;n++) {
+		if(pipe(fd)) break;
+		if(!(pid[n] = fork())) {
+			(void)close(fd[0]);
+			(void)close(hold[1]);
+			auditDevice(fd[1],hold[0],vendorID,productID);
+			_exit(0);
+		}
+		(void)close(fd[1]);
+		if((pid[n] < 0) || (AUDIT_ID != read(fd[0],id[n],AUDIT_ID)) ||
+		   !id[n][0]) {
+			(void)close(fd[0]);
+			if(pid[n] > 0) (void)waitpid(pid[n],NULL,0);
+			break;
+		}
+		for(i=0;(i < n) && strcmp(&id[i][1],&id[n][1]);i++);
+		if(i < n) {  /* Seen already */
+			(void)kill(pid[n],SIGKILL);
+			(void)close(fd[0]);
+			(void)waitpid(pid[n],NULL,0);
+			break;
+		}
+		result[n] = fd[0];
+	}
+	(void)close(hold[0]);
+	(void)close(hold[1]);  /* All claimed: go ahead and release them */
+
+	if(!n)
+		return ERR_DEVICE_NOT_FOUND;
+
+	(void)printf("%-24s %-16s  %s\n","Device","Image hash","Known image");
+	for(i=0;i<n;i++) {
+		for(len=0;(len < (int)sizeof(res)) &&
+		  ((k = read(result[i],(char *)&res + len,sizeof(res) - len)) > 0);
+		  len += k);
+		if(len == (int)sizeof(res)) {
+			res.serial[sizeof(res.serial) - 1] = 0;
+			res.map[sizeof(res.map) - 1]       = 0;
+		}
+		if(len != (int)sizeof(res)) {
+			(void)printf("Device %d: audit process failed\n",i + 1);
+			bad++;
+		} else if(ERR_NONE != res.status) {
+			(void)printf("%-24s %-16s  read failed (status %d)\n",
+			  res.serial,"-",res.status);
+			bad++;
+		} else {
+			known = auditKnown(&res);
+			(void)printf("%-24s %016llx  %s\n",res.serial,res.hash,
+			  known ? known : "unknown");
+			if(!known) bad++;
+		}
+		(void)close(result[i]);
+		(void)waitpid(pid[i],NULL,0);
+	}
+	(void)printf("%d device%s audited in %.1f ms, %d without a known "
+	  "image\n",n,(n == 1) ? "" : "s",(traceClock() - start) / 1e6,bad);
+
+	return bad ? ERR_AUDIT : ERR_NONE;
+}
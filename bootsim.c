@@ -0,0 +1,251 @@
+/****************************************************************************
+ File        : bootsim.c
+ Description : Simulated HID bootloader: memory and command set, shared by
+               the sim transport (usb-sim.c) and the uhid virtual device
+               (uhid.c).  It implements the stock protocol and the protocol
+               extensions (QUERY_EXTENSIONS, CRC32_RANGE, ERASE_RANGE; see
+               mphidflash.h), or only the stock protocol if told to behave
+               as a stock device.
+
+               The simulated part is PIC18-like: 128K of program memory
+               from 0x1000 (the bootloader itself sits below) and 14 bytes
+               of configuration words at 0x300000.  Flash behaves as flash:
+               erasing sets bytes to 0xff and programming can only clear
+               bits, so a write over unerased memory fails verification.
+               Timing is left to the caller, which is told how long each
+               erase keeps the device busy.
+
+               Memory can be loaded from a file when the device is opened
+               and saved back when it is closed, so that one run can check
+               what an earlier run wrote.
+
+               Needs nothing else from mphidflash but its header, so that
+               uhid.c links without the rest of the program.
+
+ License     : This file is part of 'mphidflash' program.
+
+               'mphidflash' is free software: you can redistribute it and/or
+               modify it under the terms of the GNU General Public License
+               as published by the Free Software Foundation, either version
+               3 of the License, or (at your option) any later version.
+
+               'mphidflash' is distributed in the hope that it will be useful,
+               but WITHOUT ANY WARRANTY; without even the implied warranty
+               of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+               See the GNU General Public License for more details.
+
+               You should have received a copy of the GNU General Public
+               License along with 'mphidflash' source code.  If not,
+               see <http://www.gnu.org/licenses/>.
+
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include "mphidflash.h"
+
+#define SIM_PROG_ADDR  0x1000     /* Program memory, as reported         */
+#define SIM_PROG_LEN   0x1f000
+#define SIM_CONF_ADDR  0x300000   /* Configuration words                 */
+#define SIM_CONF_LEN   14
+#define SIM_PAGE       1024       /* Erase page, bytes                   */
+#define SIM_ERASE_MS   2          /* Per page erased                     */
+
+static unsigned char prog[SIM_PROG_ADDR + SIM_PROG_LEN],
+                     conf[SIM_CONF_LEN];
+static char          unlocked = 0;
+static char          stock    = 0;
+static const char   *flashFile;
+
+/* Little-endian 32-bit value in a report */
+static unsigned int simRead32(
+  const unsigned char * const buf,
+  const int                   pos)
+{
+	return buf[pos] | (buf[pos + 1] << 8) | (buf[pos + 2] << 16) |
+	  ((unsigned int)buf[pos + 3] << 24);
+}
+
+/* CRC-32 as hexCrc32(), which this can't link against; bitwise, as the
+   device's time is simulated anyway */
+static unsigned int simCrc32(
+  unsigned int        crc,
+  const unsigned char byte)
+{
+	int i;
+
+	crc ^= byte;
+	for(i=0;i<8;i++)
+		crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	return crc;
+}
+
+/* Memory byte at a device address; NULL if there is none (or locked) */
+static unsigned char *simByte(
+  const unsigned int addr,
+  const char         writing)
+{
+	if((addr >= SIM_PROG_ADDR) && (addr < SIM_PROG_ADDR + SIM_PROG_LEN))
+		return &prog[addr];
+	if((addr >= SIM_CONF_ADDR) && (addr < SIM_CONF_ADDR + SIM_CONF_LEN) &&
+	   (unlocked || !writing))
+		return &conf[addr - SIM_CONF_ADDR];
+	return NULL;
+}
+
+/* Erase whole pages covering a range; returns pages erased */
+static unsigned int simErase(
+  const unsigned int addr,
+  const unsigned int len)
+{
+	unsigned int  a,end = addr + len,pages = 0;
+	unsigned char *p;
+
+	for(a=addr & ~(SIM_PAGE - 1);a < end;a += SIM_PAGE,pages++) {
+		if(!(p = simByte(a,1)))  continue;
+		if(p == conf)            memset(conf,0xff,sizeof(conf));
+		else                     memset(p,0xff,SIM_PAGE);
+	}
+	return pages;
+}
+
+/****************************************************************************
+ Function    : bootsimOpen
+ Description : Powers up the simulated device: erased, or loaded from a
+               memory file, and with configuration memory locked.
+ Parameters  : char*  Memory file, or NULL for none.  Must stay in place
+                      until bootsimClose().
+               char   1 to offer only the stock protocol.
+ Returns     : Nothing (void)
+ ****************************************************************************/
+void bootsimOpen(
+  const char * const file,
+  const char         stockOnly)
+{
+	FILE   *fp;
+	size_t  n;
+
+	memset(prog,0xff,sizeof(prog));
+	memset(conf,0xff,sizeof(conf));
+	if(file && (fp = fopen(file,"rb"))) {
+		/* An empty file is as good as none: all erased */
+		n  = fread(prog,1,sizeof(prog),fp);
+		n += fread(conf,1,sizeof(conf),fp);
+		if(n && (n < sizeof(prog) + sizeof(conf)))
+			(void)puts("Simulator: flash file short; rest erased");
+		(void)fclose(fp);
+	}
+	flashFile = file;
+	stock     = stockOnly;
+	unlocked  = 0;
+}
+
+/****************************************************************************
+ Function    : bootsimCommand
+ Description : Carries out one command sent to the simulated bootloader.
+ Parameters  : unsigned char*  Command report.
+               unsigned char*  Receives the response report, if any.
+               int             Report size in bytes (64 for full speed).
+               unsigned int*   Receives time in ms the command keeps the
+                               device busy (erasing), 0 for none; a real
+                               device takes no command in that time.
+ Returns     : int             1 if there's a response, 0 if not.
+ Notes       : Unknown commands are ignored without a response, as by the
+               stock bootloader.
+ ****************************************************************************/
+int bootsimCommand(
+  const unsigned char * const cmd,
+  unsigned char * const       reply,
+  const int                   size,
+  unsigned int * const        busyMs)
+{
+	unsigned int   addr = simRead32(cmd,1),n = cmd[5],
+	               count = simRead32(cmd,5),crc,i;
+	unsigned char *p;
+
+	memset(reply,0,size);
+	reply[0] = cmd[0];
+	*busyMs  = 0;
+
+	switch(cmd[0]) {
+		case QUERY_DEVICE:
+			reply[1] = 56;
+			reply[2] = DEVICE_FAMILY_PIC18;
+			reply[3] = TypeProgramMemory;
+			bufWrite32(reply,4,SIM_PROG_ADDR);
+			bufWrite32(reply,8,SIM_PROG_LEN);
+			reply[12] = TypeConfigWords;
+			bufWrite32(reply,13,SIM_CONF_ADDR);
+			bufWrite32(reply,17,SIM_CONF_LEN);
+			reply[21] = TypeEndOfTypeList;
+			if(!stock && (size >= EXT_SIGNATURE_POS + 4))
+				memcpy(&reply[EXT_SIGNATURE_POS],EXT_SIGNATURE,4);
+			return 1;
+		case UNLOCK_CONFIG:
+			unlocked = (cmd[1] == UNLOCKCONFIG);
+			return 0;
+		case ERASE_DEVICE:
+			*busyMs = SIM_ERASE_MS * simErase(SIM_PROG_ADDR,SIM_PROG_LEN);
+			if(unlocked) memset(conf,0xff,sizeof(conf));
+			return 0;
+		case PROGRAM_DEVICE:
+			if(n > (unsigned int)size - 6) n = size - 6;
+			for(i=0;i<n;i++)
+				if((p = simByte(addr + i,1)))
+					*p &= cmd[size - n + i];
+			return 0;
+		case GET_DATA:
+			memcpy(reply,cmd,6);
+			if(n > (unsigned int)size - 6) n = size - 6;
+			for(i=0;i<n;i++)
+				reply[size - n + i] = (p = simByte(addr + i,0)) ? *p : 0xff;
+			return 1;
+		case QUERY_EXTENSIONS:
+			if(stock) return 0;
+			reply[1] = EXT_CRC32 | EXT_ERASE_RANGE;
+			bufWrite32(reply,2,SIM_PAGE);
+			return 1;
+		case CRC32_RANGE:
+			if(stock) return 0;
+			for(crc=0xffffffff,i=0;i<count;i++)
+				crc = simCrc32(crc,(p = simByte(addr + i,0)) ? *p : 0xff);
+			memcpy(reply,cmd,9);
+			bufWrite32(reply,9,~crc);
+			return 1;
+		case ERASE_RANGE:
+			if(stock) return 0;
+			*busyMs = SIM_ERASE_MS * simErase(addr,count);
+			return 0;
+	}
+
+	return 0;
+}
+
+/****************************************************************************
+ Function    : bootsimSerial
+ Description : The simulated device's USB serial number.
+ Parameters  : None (void)
+ Returns     : char*  "SIM", or "SIM-STOCK" for a stock device.
+ ****************************************************************************/
+const char *bootsimSerial(void)
+{
+	return stock ? "SIM-STOCK" : "SIM";
+}
+
+/****************************************************************************
+ Function    : bootsimClose
+ Description : Powers down the simulated device, saving memory to the file
+               given to bootsimOpen(), if any.
+ Parameters  : None (void)
+ Returns     : Nothing (void)
+ ****************************************************************************/
+void bootsimClose(void)
+{
+	FILE *fp;
+
+	if(flashFile && (fp = fopen(flashFile,"wb"))) {
+		(void)fwrite(prog,sizeof(prog),1,fp);
+		(void)fwrite(conf,sizeof(conf),1,fp);
+		(void)fclose(fp);
+	}
+}
@@ -0,0 +1,303 @@
+/****************************************************************************
+ File        : check.c
+ Description : Check mode, for release pipelines: many hex files are
+               validated without a device, as many at a time as there are
+               processors, by the same parser that writes them.  Each file
+               has its line checksums and record types checked and, for
+               each memory map it is listed with (saved by --save-map), is
+               laid out in blocks as a write to that device would be, and
+               any data outside the device's memory counted.
+
+               The parser keeps its state in statics, as one file is
+               written at a time; so the work is shared among processes,
+               not threads.  Workers take the index of the next file from a
+               pipe filled by the first process, and send back one result
+               line each, printed in list order as they arrive.
+
+               Needs fork(); not in the Windows build.
+
+ License     : This file is part of 'mphidflash' program.
+
+               'mphidflash' is free software: you can redistribute it and/or
+               modify it under the terms of the GNU General Public License
+               as published by the Free Software Foundation, either version
+               3 of the License, or (at your option) any later version.
+
+               'mphidflash' is distributed in the hope that it will be useful,
+               but WITHOUT ANY WARRANTY; without even the implied warranty
+               of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+               See the GNU General Public License for more details.
+
+               You should have received a copy of the GNU General Public
+               License along with 'mphidflash' source code.  If not,
+               see <http://www.gnu.org/licenses/>.
+
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "mphidflash.h"
+
+#define CHECK_WORKERS  64            /* Most worker processes           */
+#define CHECK_MAPS     16            /* Most memory maps per file       */
+#define CHECK_LINE     PIPE_BUF      /* Longest result; written whole   */
+
+static char **entries = NULL;        /* List lines: file, then maps     */
+static int    entryCount;
+
+/* Read the list: one hex file per line, then any memory maps to check it
+   against; '#' comments */
+static ErrorCode checkList(const char * const list)
+{
+	FILE  *fp;
+	char   line[1024],*p,**e;
+	int    max = 0;
+
+	if(!(fp = fopen(list,"r")))
+		return ERR_CHECK_LIST;
+	for(entryCount=0;fgets(line,sizeof(line),fp);) {
+		if((p = strchr(line,'#'))) *p = 0;
+		for(p=line;*p && (*p <= ' ');p++);
+		if(!*p) continue;
+		if(entryCount == max) {
+			max = max ? max * 2 : 64;
+			if(!(e = realloc(entries,max * sizeof(char *)))) break;
+			entries = e;
+		}
+		if(!(entries[entryCount] = strdup(p))) break;
+		entryCount++;
+	}
+	if(ferror(fp) || !feof(fp)) {
+		(void)fclose(fp);
+		return ERR_CHECK_LIST;
+	}
+	(void)fclose(fp);
+
+	return ERR_NONE;
+}
+
+/* Short description of a failed check */
+static const char *checkReason(const ErrorCode status)
+{
+	switch(status) {
+		case ERR_HEX_OPEN:
+		case ERR_HEX_STAT:
+		case ERR_HEX_MMAP:     return "can't read file";
+		case ERR_HEX_SYNTAX:   return "bad hex syntax";
+		case ERR_HEX_CHECKSUM: return "bad line checksum";
+		case ERR_HEX_RECORD:   return "unsupported record type";
+		case ERR_HEX_UNPACK:   return "can't decompress";
+		case ERR_MAP_FILE:     return "can't read memory map";
+		default:               return "failed";
+	}
+}
+
+/* Bytes of a block stream outside the memory of the map loaded */
+static unsigned long checkOutside(
+  const unsigned char * const ops,
+  const size_t                len)
+{
+	const unsigned char *p;
+	unsigned long        outside = 0;
+	unsigned int         addr,k;
+	int                  i;
+	Range                span;
+
+	/* Memory as the write pass sees it (hexMemBlock()) */
+	for(p=ops;p < ops + len;p += 6 + p[5]) {
+		if(OP_BLOCK != p[0]) continue;
+		addr = p[1] | (p[2] << 8) | (p[3] << 16) | ((unsigned int)p[4] << 24);
+		for(k=0;k<p[5];k++) {
+			for(i=0;i<devQuery.memBlocks;i++)
+				if(hexMemBlock(i,&span) && (addr + k >= span.addr) &&
+				   (addr + k - span.addr < span.len))
+					break;
+			if(i == devQuery.memBlocks) outside++;
+		}
+	}
+
+	return outside;
+}
+
+/* Check one list entry and describe the result; returns 1 if it passed */
+static int checkFile(
+  const char * const entry,
+  char * const       out,
+  const int          size)
+{
+	char           buf[1024],fit[CHECK_LINE],*word[1 + CHECK_MAPS],*p;
+	ErrorCode      status;
+	unsigned char *ops;
+	size_t         len;
+	unsigned long  outside;
+	int            n,i,pos = 0,ok = 1;
+
+	/* Split into hex file and maps */
+	(void)snprintf(buf,sizeof(buf),"%s",entry);
+	for(n=0,p=strtok(buf," \t\r\n");p && (n <= CHECK_MAPS);
+	  p=strtok(NULL," \t\r\n"))
+		word[n++] = p;
+	if(p) {
+		(void)snprintf(out,size,"%s  FAIL  more than %d maps\n",word[0],
+		  CHECK_MAPS);
+		return 0;
+	}
+
+	/* Every line, whatever the device */
+	memset(&devQuery,0,sizeof(devQuery));
+	usbReportSize = 64;
+	if(ERR_NONE != (status = hexOpen(word[0]))) {
+		(void)snprintf(out,size,"%s  FAIL  %s\n",word[0],checkReason(status));
+		return 0;
+	}
+	if(ERR_NONE != (status = hexRanges(NULL,&i,0,1))) {
+		hexClose();
+		(void)snprintf(out,size,"%s  FAIL  %s\n",word[0],checkReason(status));
+		return 0;
+	}
+
+	/* Fit against each device it is meant for */
+	fit[0] = 0;
+	for(i=1;(i < n) && (pos < sizeof(fit));i++) {
+		if(ERR_NONE == (status = deviceLoadMap(word[i]))) {
+			deviceLock(0);  /* Configuration words count as memory */
+			status = hexOps(&ops,&len);
+		}
+		if(ERR_NONE != status) {
+			pos += snprintf(&fit[pos],sizeof(fit) - pos,"  %s: %s",word[i],
+			  checkReason(status));
+			ok = 0;
+		} else if((outside = checkOutside(ops,len))) {
+			pos += snprintf(&fit[pos],sizeof(fit) - pos,"  %s: %lu bytes "
+			  "outside memory",word[i],outside);
+			ok = 0;
+		} else {
+			pos += snprintf(&fit[pos],sizeof(fit) - pos,"  %s: fits",word[i]);
+		}
+	}
+	(void)snprintf(out,size,"%s  %s  %016llx%s\n",word[0],ok ? "ok  " : "FAIL",
+	  hexGetHash(),fit);
+	hexClose();
+
+	return ok;
+}
+
+/* Worker: check files by index from the work pipe until it's empty,
+   sending back for each its index, pass or fail and result line */
+static void checkWorker(
+  const int work,
+  const int result)
+{
+	char msg[CHECK_LINE];
+	int  hdr[3];
+
+	while(sizeof(hdr[0]) == read(work,&hdr[0],sizeof(hdr[0]))) {
+		hdr[1] = checkFile(entries[hdr[0]],&msg[sizeof(hdr)],
+		  sizeof(msg) - sizeof(hdr));
+		hdr[2] = strlen(&msg[sizeof(hdr)]);
+		memcpy(msg,hdr,sizeof(hdr));
+		/* Whole, in one write of no more than PIPE_BUF bytes */
+		(void)write(result,msg,sizeof(hdr) + hdr[2]);
+	}
+}
+
+/* Read exactly the given number of bytes; returns 0 at end of file */
+static int checkRead(
+  const int    fd,
+  void * const buf,
+  const int    len)
+{
+	int n,done;
+
+	for(done=0;done < len;done += n)
+		if((n = read(fd,(char *)buf + done,len - done)) <= 0)
+			return 0;
+	return 1;
+}
+
+/****************************************************************************
+ Function    : checkRun
+ Description : Validates every hex file in a list, without a device, and
+               prints one result line for each.
+ Parameters  : char*      List file: one hex file per line, followed by the
+                          memory map files to check its fit against.
+               int        Worker processes; 0 for one per processor.
+ Returns     : ErrorCode  ERR_NONE if every file passed, ERR_CHECK if any
+                          didn't, ERR_CHECK_LIST if the list can't be read.
+ ****************************************************************************/
+ErrorCode checkRun(
+  const char * const list,
+  int                workers)
+{
+	ErrorCode          status;
+	int                work[2],result[2],hdr[3],i,n,done,next,failed = 0;
+	pid_t              pid[CHECK_WORKERS];
+	char               buf[CHECK_LINE],**lines;
+	unsigned long long start = traceClock();
+
+	if(ERR_NONE != (status = checkList(list)))
+		return status;
+	if(!entryCount)
+		return ERR_CHECK_LIST;
+	if(!(lines = calloc(entryCount,sizeof(char *))))
+		return ERR_CHECK_LIST;
+
+	if(!workers) workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if(workers < 1)              workers = 1;
+	if(workers > CHECK_WORKERS)  workers = CHECK_WORKERS;
+	if(workers > entryCount)     workers = entryCount;
+
+	if(pipe(work) || pipe(result))
+		return ERR_CHECK_LIST;
+	(void)fflush(stdout);
+	for(n=0;n<workers;n++) {
+		if(!(pid[n] = fork())) {
+			(void)close(work[1]);
+			(void)close(result[0]);
+			checkWorker(work[0],result[1]);
+			_exit(0);
+		}
+		if(pid[n] < 0) break;
+	}
+	(void)close(work[0]);
+	(void)close(result[1]);
+
+	/* Indices are written whole, so each read takes exactly one */
+	for(next=0,done=0;done < entryCount;) {
+		if(next < entryCount) {
+			if(sizeof(next) != write(work[1],&next,sizeof(next))) break;
+			if(++next == entryCount) (void)close(work[1]);
+			if(next < workers) continue;  /* Give every worker one */
+		}
+		if(!checkRead(result[0],hdr,sizeof(hdr)) ||
+		   (hdr[0] < 0) || (hdr[0] >= entryCount) || lines[hdr[0]] ||
+		   (hdr[2] < 0) || (hdr[2] >= sizeof(buf)) ||
+		   !checkRead(result[0],buf,hdr[2]))
+			break;
+		buf[hdr[2]] = 0;
+		if(!hdr[1]) failed++;
+		if(!(lines[hdr[0]] = strdup(buf))) break;
+		/* Print in list order as far as results have come in */
+		for(;(done < entryCount) && lines[done];done++)
+			(void)fputs(lines[done],stdout);
+	}
+	if(next < entryCount) (void)close(work[1]);
+	(void)close(result[0]);
+	for(i=0;i<n;i++)
+		(void)waitpid(pid[i],NULL,0);
+
+	if(done < entryCount) {
+		(void)printf("Checking stopped after %d of %d files\n",done,
+		  entryCount);
+		failed += entryCount - done;
+	}
+	(void)printf("%d file%s checked by %d worker%s in %.1f ms, %d failed\n",
+	  entryCount,(entryCount == 1) ? "" : "s",n,(n == 1) ? "" : "s",
+	  (traceClock() - start) / 1e6,failed);
+
+	return failed ? ERR_CHECK : ERR_NONE;
+}
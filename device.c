@@ -0,0 +1,522 @@
+/****************************************************************************
+ File        : device.c
+ Description : Bootloader operations on the open device: query, unlock,
+               erase, read back, sign and reset.  Shared by the command-line
+               actions in main.c and by command scripts (script.c), which
+               run many of them over one open device and one QUERY_DEVICE.
+
+               Bootloaders that offer the protocol extensions described in
+               mphidflash.h are detected here, after QUERY_DEVICE; verify
+               (hex.c) then compares CRCs computed on the device, and an
+               image can be written after erasing only the pages it needs.
+               Anything else gets the stock protocol.
+
+               What QUERY_DEVICE returns (family, memory map and packet
+               size) can be saved to a memory map file and loaded in place
+               of a device, for work that needs only the map, such as
+               packing a self-contained flasher (pack.c).
+
+ License     : This file is part of 'mphidflash' program.
+
+               'mphidflash' is free software: you can redistribute it and/or
+               modify it under the terms of the GNU General Public License
+               as published by the Free Software Foundation, either version
+               3 of the License, or (at your option) any later version.
+
+               'mphidflash' is distributed in the hope that it will be useful,
+               but WITHOUT ANY WARRANTY; without even the implied warranty
+               of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+               See the GNU General Public License for more details.
+
+               You should have received a copy of the GNU General Public
+               License along with 'mphidflash' source code.  If not,
+               see <http://www.gnu.org/licenses/>.
+
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include "mphidflash.h"
+
+sQuery        devQuery;
+char          deviceExtensions = 1;  /* 0 = stock protocol only, as set
+                                        by --no-extensions             */
+unsigned char deviceExt  = 0;        /* EXT_ bits the device offers    */
+unsigned int  devicePage = 0;        /* Its ERASE_RANGE page, bytes    */
+
+extern unsigned char *usbBuf;  /* In usb.c */
+
+/* Memory block types as reported, before config blocks are masked out */
+static unsigned char memType[sizeof(devQuery.mem) / sizeof(devQuery.mem[0])];
+
+#define DEVICE_RANGES 32  /* Most ranges erased separately */
+
+/* Set up for a memory map just filled in, from the device or a file */
+static void deviceMapped(void)
+{
+	int i;
+
+	for(i=0;i<devQuery.memBlocks;i++)
+		memType[i] = devQuery.mem[i].Type;
+	hexSetBytesPerAddress(
+	  (devQuery.DeviceFamily == DEVICE_FAMILY_PIC24) ? 2 : 1);
+	deviceLock(1);
+}
+
+/****************************************************************************
+ Function    : deviceQuery
+ Description : Sends QUERY_DEVICE and fills in devQuery from the response.
+               Configuration memory is masked out (see deviceLock()) until
+               deviceUnlock() is called.
+ Parameters  : None (void)
+ Returns     : ErrorCode  ERR_NONE on success, else as returned by usbWrite().
+ ****************************************************************************/
+ErrorCode deviceQuery(void)
+{
+	ErrorCode status;
+	int       i;
+
+	EV_BEGIN("query",0);
+	usbBuf[0] = QUERY_DEVICE;
+	status    = usbWrite(1,1);
+	EV_END();
+	if(ERR_NONE != status)
+		return status;
+
+	memcpy(&devQuery,usbBuf,sizeof(devQuery));
+	for(i=0;(i < sizeof(memType)) &&
+	  (devQuery.mem[i].Type != TypeEndOfTypeList);i++) {
+		devQuery.mem[i].Address = convertEndian(devQuery.mem[i].Address);
+		devQuery.mem[i].Length  = convertEndian(devQuery.mem[i].Length);
+	}
+	devQuery.memBlocks = i;
+	deviceMapped();
+
+	/* Only ask about extensions if the device says it has some; the
+	   stock bootloader would just never answer QUERY_EXTENSIONS. */
+	deviceExt = 0;
+	if(deviceExtensions && (usbReportSize >= EXT_SIGNATURE_POS + 4) &&
+	   !memcmp(&usbBuf[EXT_SIGNATURE_POS],EXT_SIGNATURE,4)) {
+		usbBuf[0] = QUERY_EXTENSIONS;
+		if((ERR_NONE == usbWrite(1,1)) && (usbBuf[0] == QUERY_EXTENSIONS)) {
+			deviceExt  = usbBuf[1] & (EXT_CRC32 | EXT_ERASE_RANGE);
+			devicePage = bufRead32(2);
+			/* Page size must be a power of two */
+			if(!devicePage || (devicePage & (devicePage - 1)))
+				deviceExt &= ~EXT_ERASE_RANGE;
+		} else {
+			(void)puts("Extension query failed; using standard protocol");
+		}
+	}
+
+	return ERR_NONE;
+}
+
+/****************************************************************************
+ Function    : deviceInfo
+ Description : Prints device family, program memory and packet framing as
+               found by the last deviceQuery().
+ Parameters  : None (void)
+ Returns     : Nothing (void)
+ ****************************************************************************/
+void deviceInfo(void)
+{
+	int i;
+
+	(void)printf("Device family: ");
+	switch(devQuery.DeviceFamily) {
+		case DEVICE_FAMILY_PIC18:
+			(void)printf("PIC18\n");
+			break;
+		case DEVICE_FAMILY_PIC24:
+			(void)printf("PIC24\n");
+			break;
+		case DEVICE_FAMILY_PIC32:
+			(void)printf("PIC32\n");
+			break;
+		default:
+			(void)printf("Unknown. Bytes per address set to 1.\n");
+			break;
+	}
+	(void)printf("Memory");
+	for(i=0;i<devQuery.memBlocks;i++) {
+		if(memType[i] == TypeProgramMemory)
+			(void)printf(": %d bytes free, addr: %04x, total %d\n",
+			  devQuery.mem[i].Length * hexGetBytesPerAddress(),
+			  devQuery.mem[i].Address,devQuery.memBlocks);
+	}
+	(void)printf("Packets: %d-byte reports, %d data bytes\n",
+	  usbReportSize,hexGetBlockSize());
+	if(deviceExt) {
+		(void)printf("Extensions:");
+		if(deviceExt & EXT_CRC32)
+			(void)printf(" CRC32 verify");
+		if(deviceExt & EXT_ERASE_RANGE)
+			(void)printf("%s range erase (%u-byte pages)",
+			  (deviceExt & EXT_CRC32) ? "," : "",devicePage);
+		(void)putchar('\n');
+	}
+}
+
+/****************************************************************************
+ Function    : deviceLock
+ Description : Masks configuration memory blocks out of devQuery so hex
+               file data for them is skipped, or restores them.
+ Parameters  : char  1 to mask, 0 to restore.
+ Returns     : Nothing (void)
+ ****************************************************************************/
+void deviceLock(const char locked)
+{
+	int i;
+
+	for(i=0;i<devQuery.memBlocks;i++) {
+		if(memType[i] == TypeConfigWords)
+			devQuery.mem[i].Type = locked ? 0 : TypeConfigWords;
+	}
+}
+
+/****************************************************************************
+ Function    : deviceUnlock
+ Description : Unlocks configuration memory for erase and write.
+ Parameters  : None (void)
+ Returns     : ErrorCode  ERR_NONE on success, else as returned by usbWrite().
+ ****************************************************************************/
+ErrorCode deviceUnlock(void)
+{
+	ErrorCode status;
+
+	(void)puts("Unlocking configuration memory...");
+	EV_BEGIN("unlock",0);
+	usbBuf[0] = UNLOCK_CONFIG;
+	usbBuf[1] = UNLOCKCONFIG;
+	if(ERR_NONE == (status = usbWrite(2,0)))
+		deviceLock(0);
+	EV_END();
+
+	return status;
+}
+
+/****************************************************************************
+ Function    : deviceErase
+ Description : Erases program memory (and configuration memory if unlocked)
+               and waits for the erase to complete.
+ Parameters  : None (void)
+ Returns     : ErrorCode  ERR_NONE on success, else as returned by usbWrite().
+ ****************************************************************************/
+ErrorCode deviceErase(void)
+{
+	ErrorCode          status;
+	unsigned long long start = traceClock();
+
+	(void)puts("Erasing...");
+	metricsPhase(PHASE_ERASE,0);
+	EV_BEGIN("erase",0);
+	watchdogErase(1);
+	usbBuf[0] = ERASE_DEVICE;
+	status    = usbWrite(1,0);
+	/* The query here isn't needed for any technical
+	   reason, just makes the presentation better.
+	   The ERASE_DEVICE command above returns
+	   immediately...subsequent commands can be made
+	   but will pause until the erase cycle completes.
+	   So this query just keeps the "Writing" message
+	   or others from being displayed prematurely. */
+	if(ERR_NONE == status) {
+		EV_MARK("erase sent",0);
+		usbBuf[0] = QUERY_DEVICE;
+		status    = usbWrite(1,1);
+	}
+	watchdogErase(0);
+	EV_END();
+	telemetryPhase(PHASE_ERASE,traceClock() - start);
+
+	return status;
+}
+
+/****************************************************************************
+ Function    : deviceEraseImage
+ Description : Erases only the pages the currently-open hex file will be
+               written to, if the device can erase by range; else erases
+               the whole device as deviceErase() does.
+ Parameters  : None (void)
+ Returns     : ErrorCode  ERR_NONE on success, else as returned by
+                          hexRanges() or usbWrite().
+ Notes       : Whatever the image doesn't cover is left as it was.
+ ****************************************************************************/
+ErrorCode deviceEraseImage(void)
+{
+	ErrorCode          status;
+	Range              range[DEVICE_RANGES];
+	int                i,n;
+	unsigned int       total = 0;
+	unsigned long long start;
+
+	if(!(deviceExt & EXT_ERASE_RANGE))
+		return deviceErase();
+
+	if(ERR_NONE != (status = hexRanges(range,&n,DEVICE_RANGES,devicePage)))
+		return status;
+	if(n < 0)  /* Too scattered to be worth it */
+		return deviceErase();
+
+	for(i=0;i<n;i++) total += range[i].len;
+	(void)printf("Erasing %u bytes in %d range%s...\n",total,n,
+	  (n == 1) ? "" : "s");
+	start = traceClock();
+	metricsPhase(PHASE_ERASE,0);
+	EV_BEGIN("erase",0);
+	watchdogErase(1);
+	for(i=0,status=ERR_NONE;(i < n) && (ERR_NONE == status);i++) {
+		usbBuf[0] = ERASE_RANGE;
+		bufWrite32(usbBuf,1,range[i].addr / hexGetBytesPerAddress());
+		bufWrite32(usbBuf,5,range[i].len);
+		status = usbWrite(9,0);
+	}
+	/* As in deviceErase(), wait here for the erase to finish */
+	if(ERR_NONE == status) {
+		usbBuf[0] = QUERY_DEVICE;
+		status    = usbWrite(1,1);
+	}
+	watchdogErase(0);
+	EV_END();
+	telemetryPhase(PHASE_ERASE,traceClock() - start);
+
+	return status;
+}
+
+/****************************************************************************
+ Function    : deviceDump
+ Description : Reads a range of device memory and saves it as raw binary.
+ Parameters  : unsigned int  Start address, in device address units (as
+                             shown for program memory by deviceInfo()).
+               unsigned int  Length in bytes.
+               char*         Output file name.
+ Returns     : ErrorCode     ERR_NONE on success, ERR_DUMP_WRITE if the file
+                             can't be written, else as returned by usbWrite().
+ ****************************************************************************/
+ErrorCode deviceDump(
+  const unsigned int addr,
+  const unsigned int len,
+  const char * const filename)
+{
+	ErrorCode     status = ERR_NONE;
+	FILE         *fp;
+	unsigned int  done,n;
+	int           block  = hexGetBlockSize();
+
+	if(!(fp = fopen(filename,"wb")))
+		return ERR_DUMP_WRITE;
+
+	(void)printf("Reading %u bytes from %04x to '%s'...\n",len,addr,filename);
+	EV_BEGIN("dump",addr);
+	for(done=0;(done < len) && (ERR_NONE == status);done += n) {
+		n = (len - done < block) ? len - done : block;
+		usbBuf[0] = GET_DATA;
+		bufWrite32(usbBuf,1,addr + done / hexGetBytesPerAddress());
+		usbBuf[5] = n;
+		if((ERR_NONE == (status = usbWrite(6,1))) &&
+		   (1 != fwrite(&usbBuf[usbReportSize - n],n,1,fp)))
+			status = ERR_DUMP_WRITE;
+	}
+	EV_END();
+
+	if(fclose(fp) && (ERR_NONE == status))
+		status = ERR_DUMP_WRITE;
+
+	return status;
+}
+
+/****************************************************************************
+ Function    : deviceSign
+ Description : Signs flash, as required by later versions of the bootloader
+               before they will start the application.
+ Parameters  : None (void)
+ Returns     : ErrorCode  ERR_NONE on success, else as returned by usbWrite().
+ ****************************************************************************/
+ErrorCode deviceSign(void)
+{
+	ErrorCode status;
+
+	(void)puts("Signing flash...");
+	EV_BEGIN("sign",0);
+	usbBuf[0] = SIGN_FLASH;
+	status    = usbWrite(1,0);
+	EV_END();
+
+	return status;
+}
+
+/****************************************************************************
+ Function    : deviceReset
+ Description : Resets the device out of the bootloader.
+ Parameters  : None (void)
+ Returns     : ErrorCode  ERR_NONE on success, else as returned by usbWrite().
+ Notes       : The device drops off the bus; nothing further can be sent.
+ ****************************************************************************/
+ErrorCode deviceReset(void)
+{
+	ErrorCode status;
+
+	(void)puts("Resetting device...");
+	EV_BEGIN("reset",0);
+	usbBuf[0] = RESET_DEVICE;
+	status    = usbWrite(1,0);
+	EV_END();
+
+	return status;
+}
+
+/****************************************************************************
+ Function    : deviceMapText
+ Description : Describes the memory map found by the last deviceQuery() (or
+               deviceLoadMap()): device family, report and packet sizes and
+               memory blocks, one per line, as in a memory map file.
+ Parameters  : char*  Buffer receiving the text, NUL-terminated.
+               int    Size of buffer.
+ Returns     : Nothing (void)
+ Notes       : Two devices with the same text take the same packets for
+               the same image.  Extensions aren't included; they change how
+               an image is erased and verified, not what is written.
+ ****************************************************************************/
+void deviceMapText(
+  char * const buf,
+  const int    size)
+{
+	int i,n;
+
+	n = snprintf(buf,size,"family %d\nreport %d\npacket %d\n",
+	  devQuery.DeviceFamily,usbReportSize,devQuery.PacketDataFieldSize);
+	for(i=0;(i < devQuery.memBlocks) && (n < size);i++)
+		n += snprintf(&buf[n],size - n,"memory %d 0x%08x 0x%08x\n",
+		  memType[i],devQuery.mem[i].Address,devQuery.mem[i].Length);
+}
+
+/****************************************************************************
+ Function    : deviceSaveMap
+ Description : Saves the device's memory map, and any extensions, to a file
+               for deviceLoadMap().
+ Parameters  : char*      File name.
+ Returns     : ErrorCode  ERR_NONE on success, ERR_MAP_FILE if the file
+                          can't be written.
+ ****************************************************************************/
+ErrorCode deviceSaveMap(const char * const filename)
+{
+	FILE *fp;
+	char  map[DEVICE_MAP];
+	int   ok;
+
+	if(!(fp = fopen(filename,"w")))
+		return ERR_MAP_FILE;
+	deviceMapText(map,sizeof(map));
+	(void)fprintf(fp,"# mphidflash memory map\n%s",map);
+	if(deviceExt)
+		(void)fprintf(fp,"extensions %d %u\n",deviceExt,devicePage);
+	ok = !ferror(fp);
+
+	return (!fclose(fp) && ok) ? ERR_NONE : ERR_MAP_FILE;
+}
+
+/* Set up a memory map from the text of a map file, and close it */
+static ErrorCode deviceReadMap(FILE * const fp)
+{
+	char          line[256],word[16];
+	int           family = -1,report = -1,packet = -1,type,ext,n = 0;
+	unsigned int  addr,len,page;
+	ErrorCode     status = ERR_NONE;
+
+	memset(&devQuery,0,sizeof(devQuery));
+	deviceExt = 0;
+	while((ERR_NONE == status) && fgets(line,sizeof(line),fp)) {
+		if((1 != sscanf(line,"%15s",word)) || (word[0] == '#'))
+			continue;
+		if(!strcmp(word,"family")) {
+			if(1 != sscanf(line,"%*s %d",&family)) status = ERR_MAP_FILE;
+		} else if(!strcmp(word,"report")) {
+			if((1 != sscanf(line,"%*s %d",&report)) || (report < 8) ||
+			   (report > USB_MAX_REPORT))
+				status = ERR_MAP_FILE;
+		} else if(!strcmp(word,"packet")) {
+			if((1 != sscanf(line,"%*s %d",&packet)) || (packet < 0) ||
+			   (packet > 255))
+				status = ERR_MAP_FILE;
+		} else if(!strcmp(word,"memory")) {
+			if((3 != sscanf(line,"%*s %d %x %x",&type,&addr,&len)) ||
+			   (n == sizeof(memType)))
+				status = ERR_MAP_FILE;
+			else {
+				devQuery.mem[n].Type      = type;
+				devQuery.mem[n].Address   = addr;
+				devQuery.mem[n++].Length  = len;
+			}
+		} else if(!strcmp(word,"extensions")) {
+			if(2 != sscanf(line,"%*s %d %u",&ext,&page))
+				status = ERR_MAP_FILE;
+			else if(deviceExtensions) {
+				deviceExt  = ext & (EXT_CRC32 | EXT_ERASE_RANGE);
+				devicePage = page;
+				if(!devicePage || (devicePage & (devicePage - 1)))
+					deviceExt &= ~EXT_ERASE_RANGE;
+			}
+		} else {
+			status = ERR_MAP_FILE;
+		}
+	}
+	(void)fclose(fp);
+	if((family < 0) || (report < 0) || (packet < 0) || !n)
+		status = ERR_MAP_FILE;
+	if(ERR_NONE != status) {
+		deviceExt = 0;
+		return status;
+	}
+
+	devQuery.Command             = QUERY_DEVICE;
+	devQuery.PacketDataFieldSize = packet;
+	devQuery.DeviceFamily        = family;
+	devQuery.memBlocks           = n;
+	usbReportSize                = report;
+	deviceMapped();
+
+	return ERR_NONE;
+}
+
+/****************************************************************************
+ Function    : deviceLoadMap
+ Description : Sets up a memory map from a file saved by deviceSaveMap(), in
+               place of querying a device.
+ Parameters  : char*      File name.
+ Returns     : ErrorCode  ERR_NONE on success, ERR_MAP_FILE if the file
+                          can't be read or isn't a memory map.
+ Notes       : Extensions in the file are taken unless --no-extensions was
+               given.  Blank lines and lines starting with '#' are ignored.
+ ****************************************************************************/
+ErrorCode deviceLoadMap(const char * const filename)
+{
+	FILE *fp;
+
+	if(!(fp = fopen(filename,"r")))
+		return ERR_MAP_FILE;
+
+	return deviceReadMap(fp);
+}
+
+/****************************************************************************
+ Function    : deviceUseMap
+ Description : Sets up a memory map from text given by deviceMapText(),
+               perhaps in another process, in place of querying a device.
+ Parameters  : char*      Memory map text.
+ Returns     : ErrorCode  ERR_NONE on success, ERR_MAP_FILE if the text
+                          isn't a memory map.
+ ****************************************************************************/
+ErrorCode deviceUseMap(const char * const text)
+{
+#ifndef WIN
+	FILE *fp;
+
+	if(!(fp = fmemopen((void *)text,strlen(text),"r")))
+		return ERR_MAP_FILE;
+
+	return deviceReadMap(fp);
+#else
+	return ERR_MAP_FILE;
+#endif
+}
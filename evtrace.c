@@ -0,0 +1,207 @@
+/****************************************************************************
+ File        : evtrace.c
+ Description : Event timeline of a session, written on exit as trace-event
+               JSON that Chrome's about:tracing or Perfetto can open.  Where
+               the binary --trace capture records what was sent, this shows
+               when: each operation, hex pass and USB command as a span,
+               with the backend's send and receive calls nested inside, so
+               PROGRAM_COMPLETE stalls, the wait on the post-erase query and
+               the parsing between transfers can all be seen.
+
+               Trace points are the EV_BEGIN/EV_END/EV_MARK macros in
+               mphidflash.h, which compile to nothing unless EVTRACE is
+               defined.  Each thread logs to a ring of its own, allocated on
+               its first event, so logging takes no locks; when a ring wraps
+               the oldest events are overwritten.  A thread that ends hands
+               its ring on to the next thread started, which carries on in
+               it on the same timeline row: a parser thread is started for
+               every hex pass, and a resident program (--serve, --watch)
+               would otherwise take a new ring for each.  Event names must
+               be string constants.
+
+ License     : This file is part of 'mphidflash' program.
+
+               'mphidflash' is free software: you can redistribute it and/or
+               modify it under the terms of the GNU General Public License
+               as published by the Free Software Foundation, either version
+               3 of the License, or (at your option) any later version.
+
+               'mphidflash' is distributed in the hope that it will be useful,
+               but WITHOUT ANY WARRANTY; without even the implied warranty
+               of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+               See the GNU General Public License for more details.
+
+               You should have received a copy of the GNU General Public
+               License along with 'mphidflash' source code.  If not,
+               see <http://www.gnu.org/licenses/>.
+
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "mphidflash.h"
+
+#ifdef EVTRACE
+
+#ifndef WIN
+#include <pthread.h>
+#endif
+
+#define EV_RING (1 << 16)              /* Events per thread, power of two */
+
+typedef struct {
+	unsigned long long ts;             /* traceClock()                    */
+	const char        *name;           /* NULL for end events             */
+	unsigned int       arg;
+	char               ph;             /* 'B'egin, 'E'nd or 'i'nstant     */
+} Event;
+
+typedef struct EvRing {
+	struct EvRing     *next;
+	struct EvRing     *nextFree;       /* In evFree                       */
+	int                tid;
+	unsigned long      count;          /* Events ever logged              */
+	Event              ev[EV_RING];
+} EvRing;
+
+static FILE              *evFp    = NULL;
+static unsigned long long evStart;
+static EvRing            *evRings = NULL;  /* All threads' rings          */
+static int                evTids  = 0;
+static __thread EvRing   *evRing  = NULL;  /* This thread's ring          */
+#ifndef WIN
+static EvRing            *evFree  = NULL;  /* Those of ended threads      */
+static pthread_mutex_t    evLock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t      evKey;           /* Hands back a thread's ring  */
+static pthread_once_t     evOnce  = PTHREAD_ONCE_INIT;
+
+/* A thread with a ring has ended; keep the ring for the next one */
+static void evRingDone(void *ring)
+{
+	(void)pthread_mutex_lock(&evLock);
+	((EvRing *)ring)->nextFree = evFree;
+	evFree                     = ring;
+	(void)pthread_mutex_unlock(&evLock);
+}
+
+static void evKeyCreate(void)
+{
+	(void)pthread_key_create(&evKey,evRingDone);
+}
+
+/* A ring for the calling thread: one an ended thread left, else new */
+static EvRing *evRingReuse(void)
+{
+	EvRing *r;
+
+	(void)pthread_once(&evOnce,evKeyCreate);
+	(void)pthread_mutex_lock(&evLock);
+	if((r = evFree)) evFree = r->nextFree;
+	(void)pthread_mutex_unlock(&evLock);
+	return r;
+}
+#endif
+
+/****************************************************************************
+ Function    : evtraceOpen
+ Description : Creates the event trace file and starts logging.
+ Parameters  : char*      Filename (must be non-NULL).
+ Returns     : ErrorCode  ERR_NONE on success, ERR_EVENTS_OPEN on error.
+ ****************************************************************************/
+ErrorCode evtraceOpen(const char * const filename)
+{
+	if(!(evFp = fopen(filename,"w")))
+		return ERR_EVENTS_OPEN;
+
+	evStart = traceClock();
+	return ERR_NONE;
+}
+
+/****************************************************************************
+ Function    : evtraceEvent
+ Description : Logs one event for the calling thread.  Use the EV_ macros
+               rather than calling this directly.
+ Parameters  : char          'B' (span begins), 'E' (innermost open span
+                             ends) or 'i' (instant).
+               char*         Event name, a string constant (unused for 'E').
+               unsigned int  Argument shown with the event, 0 for none.
+ Returns     : Nothing (void)
+ ****************************************************************************/
+void evtraceEvent(
+  const char         ph,
+  const char * const name,
+  const unsigned int arg)
+{
+	Event *e;
+
+	if(!evFp) return;
+
+	if(!evRing) {
+#ifndef WIN
+		if(!(evRing = evRingReuse())) {
+#endif
+			if(!(evRing = calloc(1,sizeof(EvRing)))) return;
+			evRing->tid  = __atomic_add_fetch(&evTids,1,__ATOMIC_RELAXED);
+			evRing->next = __atomic_load_n(&evRings,__ATOMIC_RELAXED);
+			while(!__atomic_compare_exchange_n(&evRings,&evRing->next,
+			  evRing,0,__ATOMIC_RELEASE,__ATOMIC_RELAXED));
+#ifndef WIN
+		}
+		(void)pthread_setspecific(evKey,evRing);
+#endif
+	}
+
+	e       = &evRing->ev[evRing->count & (EV_RING - 1)];
+	e->ts   = traceClock();
+	e->name = name;
+	e->arg  = arg;
+	e->ph   = ph;
+	__atomic_store_n(&evRing->count,evRing->count + 1,__ATOMIC_RELEASE);
+}
+
+/****************************************************************************
+ Function    : evtraceClose
+ Description : Writes all logged events to the trace file and closes it.
+               Safe to call when no event trace is open.
+ Parameters  : None (void)
+ Returns     : Nothing (void)
+ Notes       : Other threads should have stopped logging by now.
+ ****************************************************************************/
+void evtraceClose(void)
+{
+	EvRing        *r;
+	Event         *e;
+	unsigned long  i,count,lost = 0;
+
+	if(!evFp) return;
+
+	(void)fprintf(evFp,"{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+	  "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+	  "\"args\":{\"name\":\"mphidflash\"}}");
+	for(r=__atomic_load_n(&evRings,__ATOMIC_ACQUIRE);r;r=r->next) {
+		count = __atomic_load_n(&r->count,__ATOMIC_ACQUIRE);
+		i     = (count > EV_RING) ? count - EV_RING : 0;
+		lost += i;
+		for(;i<count;i++) {
+			e = &r->ev[i & (EV_RING - 1)];
+			(void)fprintf(evFp,",\n{\"ph\":\"%c\",\"pid\":1,\"tid\":%d,"
+			  "\"ts\":%.3f",e->ph,r->tid,(e->ts - evStart) / 1e3);
+			if(e->name)
+				(void)fprintf(evFp,",\"name\":\"%s\"",e->name);
+			if(e->ph == 'i')
+				(void)fprintf(evFp,",\"s\":\"t\"");
+			if(e->arg)
+				(void)fprintf(evFp,",\"args\":{\"arg\":\"0x%08x\"}",e->arg);
+			(void)fputc('}',evFp);
+		}
+	}
+	(void)fprintf(evFp,"\n]}\n");
+	(void)fclose(evFp);
+	evFp = NULL;
+
+	if(lost)
+		(void)printf("Warning: %lu oldest events overwritten (ring full)\n",
+		  lost);
+}
+
+#endif /* EVTRACE */
@@ -0,0 +1,300 @@
+/****************************************************************************
+ File        : fault.c
+ Description : Fault injection between usbWrite() and the USB code, for
+               measuring what a noisy link costs: how long each kind of
+               fault holds a run up, and how long after it the run stops
+               (by timeout, failed verify or otherwise).  Off unless asked
+               for with --faults; then reports are passed through as usual
+               except that, at the rates given, some are:
+
+               drop     Lost, in either direction.  A lost command gets no
+                        response, so the read after it waits out its
+                        timeout; a lost response is waited out the same way.
+               delay    Answered late (--faults delay=<percent>:<ms>).  A
+                        response later than the timeout is lost instead.
+               short    Cut short: only the start of the response arrives,
+                        the rest of the buffer keeping what it held before.
+               unplug   Met by a disconnect.  The call fails at once, as do
+                        any others in the next UNPLUG_MS, the time a device
+                        takes to drop off the bus and come back.
+               corrupt  GET_DATA responses only: a bit of the data flipped.
+
+               Faults are chosen by a pseudo-random sequence from a seed,
+               one draw per report, so a run with the same seed, options
+               and device sees the same faults on the same reports.  The
+               seed is printed so that any run can be repeated.
+
+ License     : This file is part of 'mphidflash' program.
+
+               'mphidflash' is free software: you can redistribute it and/or
+               modify it under the terms of the GNU General Public License
+               as published by the Free Software Foundation, either version
+               3 of the License, or (at your option) any later version.
+
+               'mphidflash' is distributed in the hope that it will be useful,
+               but WITHOUT ANY WARRANTY; without even the implied warranty
+               of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+               See the GNU General Public License for more details.
+
+               You should have received a copy of the GNU General Public
+               License along with 'mphidflash' source code.  If not,
+               see <http://www.gnu.org/licenses/>.
+
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+
+#ifndef WIN
+#include <unistd.h>
+#else
+#include <windows.h>
+#endif
+
+#include "mphidflash.h"
+
+#define UNPLUG_MS  500  /* Time a disconnected device stays away        */
+
+enum { FAULT_DROP, FAULT_DELAY, FAULT_SHORT, FAULT_UNPLUG, FAULT_CORRUPT,
+       FAULT_TYPES };
+
+static const char * const faultName[FAULT_TYPES] = {
+	"drop","delay","short","unplug","corrupt"
+};
+
+static double             rate[FAULT_TYPES];     /* Percent of reports   */
+static unsigned long      injected[FAULT_TYPES];
+static unsigned long long extra[FAULT_TYPES];    /* ns waited because of */
+static char               enabled = 0,
+                          sendDropped = 0;       /* Last command lost    */
+static int                delayMs = 50,
+                          firstFault = -1;
+static unsigned int       state;                 /* xorshift32           */
+static unsigned long long goneUntil = 0,         /* Unplugged till then  */
+                          firstAt;               /* traceClock() values  */
+static unsigned char      lastCmd,lastLen;
+
+static void faultSleep(const int ms)
+{
+	if(ms <= 0) return;
+#ifndef WIN
+	(void)usleep(ms * 1000);
+#else
+	Sleep(ms);
+#endif
+}
+
+/* Which fault, if any, befalls the next report.  One draw per report
+   whatever the rates, so that the sequence depends on the seed alone. */
+static int faultDraw(const char response)
+{
+	double r,sum = 0.0;
+	int    i;
+
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	r = state / 4294967296.0 * 100.0;
+
+	for(i=0;i<FAULT_TYPES;i++) {
+		/* Commands can only be lost or met by a disconnect */
+		if(!response && (i != FAULT_DROP) && (i != FAULT_UNPLUG)) continue;
+		if((i == FAULT_CORRUPT) && (lastCmd != GET_DATA)) continue;
+		if(r < (sum += rate[i])) break;
+	}
+	if(i == FAULT_TYPES) return -1;
+
+	injected[i]++;
+	if(firstFault < 0) {
+		firstFault = i;
+		firstAt    = traceClock();
+	}
+	return i;
+}
+
+/****************************************************************************
+ Function    : faultSet
+ Description : Sets the fault rates from a command-line specification.
+ Parameters  : char*      Comma-separated <fault>=<percent> list, e.g.
+                          "drop=1,delay=2:80,corrupt=0.5"; delay may give
+                          its length in ms after a colon (default 50).
+               unsigned   Seed for choosing faulty reports.
+ Returns     : ErrorCode  ERR_NONE on success, ERR_CMD_ARG if the
+                          specification is malformed or its rates add up
+                          to more than 100.
+ ****************************************************************************/
+ErrorCode faultSet(
+  const char * const spec,
+  const unsigned int seed)
+{
+	const char *p = spec;
+	char        name[16];
+	double      pct,sum = 0.0;
+	int         i,n;
+
+	while(*p) {
+		if((2 != sscanf(p,"%15[a-z]=%lf%n",name,&pct,&n)) ||
+		   (pct < 0.0) || (pct > 100.0))
+			return ERR_CMD_ARG;
+		p += n;
+		for(i=0;(i < FAULT_TYPES) && strcmp(name,faultName[i]);i++);
+		if(i == FAULT_TYPES)
+			return ERR_CMD_ARG;
+		rate[i] = pct;
+		if((i == FAULT_DELAY) && (*p == ':')) {
+			if((1 != sscanf(++p,"%d%n",&delayMs,&n)) || (delayMs < 1))
+				return ERR_CMD_ARG;
+			p += n;
+		}
+		if(*p == ',')  p++;
+		else if(*p)    return ERR_CMD_ARG;
+	}
+	for(i=0;i<FAULT_TYPES;i++)
+		sum += rate[i];
+	if(sum > 100.0)
+		return ERR_CMD_ARG;
+
+	/* Spread the seed, so that small ones don't start the sequence small */
+	state  = seed + 0x9e3779b9;
+	state ^= state >> 16; state *= 0x7feb352d;
+	state ^= state >> 15; state *= 0x846ca68b;
+	state ^= state >> 16;
+	if(!state) state = 1;
+	enabled = (sum > 0.0);
+	(void)printf("Injecting USB faults (seed %u)\n",seed);
+
+	return ERR_NONE;
+}
+
+/****************************************************************************
+ Function    : faultSend
+ Description : usbSend(), with any fault due.
+ Parameters  : unsigned char*  Report, as for usbSend().
+               int             Size of data in bytes.
+               int             Timeout in milliseconds.
+ Returns     : ErrorCode       As for usbSend(); ERR_USB_WRITE for a
+                               disconnect.
+ ****************************************************************************/
+ErrorCode faultSend(
+  unsigned char * const buf,
+  const int             len,
+  const int             timeout)
+{
+	if(!enabled)
+		return usbSend(buf,len,timeout);
+
+	lastCmd     = buf[0];
+	lastLen     = buf[5];
+	sendDropped = 0;
+	if(traceClock() < goneUntil)
+		return ERR_USB_WRITE;
+
+	switch(faultDraw(0)) {
+		case FAULT_DROP:
+			sendDropped = 1;
+			return ERR_NONE;
+		case FAULT_UNPLUG:
+			goneUntil = traceClock() + UNPLUG_MS * 1000000ULL;
+			return ERR_USB_WRITE;
+	}
+
+	return usbSend(buf,len,timeout);
+}
+
+/****************************************************************************
+ Function    : faultRecv
+ Description : usbRecv(), with any fault due.
+ Parameters  : unsigned char*  Receives the report.
+               int             Timeout in milliseconds.
+ Returns     : ErrorCode       As for usbRecv(); ERR_USB_TIMEOUT for a lost
+                               or too late response, ERR_USB_READ for a
+                               disconnect.
+ ****************************************************************************/
+ErrorCode faultRecv(
+  unsigned char * const buf,
+  const int             timeout)
+{
+	ErrorCode          status;
+	unsigned long long start = traceClock(),waited;
+	unsigned char      before[USB_MAX_REPORT];
+	int                fault,n;
+
+	if(!enabled)
+		return usbRecv(buf,timeout);
+
+	if(start < goneUntil)
+		return ERR_USB_READ;
+
+	/* A lost command's response never comes: the backend waits it out */
+	if(sendDropped) {
+		status = usbRecv(buf,timeout);
+		extra[FAULT_DROP] += traceClock() - start;
+		return status;
+	}
+
+	if(FAULT_UNPLUG == (fault = faultDraw(1))) {
+		goneUntil = start + UNPLUG_MS * 1000000ULL;
+		return ERR_USB_READ;
+	}
+	memcpy(before,buf,usbReportSize);
+	if(ERR_NONE != (status = usbRecv(buf,timeout)))
+		return status;
+
+	switch(fault) {
+		case FAULT_DELAY:
+			if(delayMs < timeout) {
+				faultSleep(delayMs);
+				extra[FAULT_DELAY] += delayMs * 1000000ULL;
+				break;
+			}
+			/* Too late; as good as lost */
+			/* fall through */
+		case FAULT_DROP:
+			waited = (traceClock() - start) / 1000000ULL;
+			faultSleep(timeout - (int)waited);
+			extra[fault] += traceClock() - start;
+			return ERR_USB_TIMEOUT;
+		case FAULT_SHORT:
+			n = 1 + state % (usbReportSize - 1);
+			memcpy(&buf[n],&before[n],usbReportSize - n);
+			break;
+		case FAULT_CORRUPT:
+			n = (lastLen && (lastLen <= usbReportSize)) ? lastLen : 1;
+			buf[usbReportSize - n + state % n] ^= 1 << (state >> 8) % 8;
+			break;
+	}
+
+	return ERR_NONE;
+}
+
+/****************************************************************************
+ Function    : faultReport
+ Description : Prints the faults injected in the run, the time each kind
+               held it up and, if it failed, how long after the first.
+ Parameters  : ErrorCode  The run's final status.
+ Returns     : Nothing (void)
+ ****************************************************************************/
+void faultReport(const ErrorCode status)
+{
+	unsigned long total = 0;
+	int           i;
+
+	if(!enabled)
+		return;
+
+	(void)printf("\n%-8s %8s %12s\n","Fault","Injected","Wait (ms)");
+	for(i=0;i<FAULT_TYPES;i++) {
+		if(!rate[i]) continue;
+		(void)printf("%-8s %8lu %12.1f\n",faultName[i],injected[i],
+		  extra[i] / 1e6);
+		total += injected[i];
+	}
+	if(firstFault < 0)
+		(void)puts("No faults injected");
+	else if(ERR_NONE == status)
+		(void)printf("Run completed despite %lu fault%s\n",total,
+		  (total == 1) ? "" : "s");
+	else
+		(void)printf("Run failed %.1f ms after the first fault (%s)\n",
+		  (traceClock() - firstAt) / 1e6,faultName[firstFault]);
+}
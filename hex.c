@@ -29,12 +29,15 @@
  ****************************************************************************/
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <ctype.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 
 #ifndef WIN
+#include <sched.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #else
 #include <windows.h>
@@ -47,11 +50,113 @@ static char          *hexFileData = NULL; /* Memory-mapped hex file data */
 static char          *hexPlusOne;         /* Saves a lot of "+1" math    */
 static int            hexFd;              /* Open hex file descriptor    */
 static size_t         hexFileSize;        /* Save for use by munmap()    */
-static unsigned char  hexBuf[56];         /* Data read/written to USB    */
-extern unsigned char *usbBuf;             /* In usb code                 */
+static unsigned long long hexHash = 0;    /* Of last file opened; 0=none */
+static unsigned char *hexRecords = NULL;  /* Decoded compressed file     */
+static size_t         hexRecordsLen,hexRecordsMax;
+static unsigned char  pktBufX[1 + USB_MAX_REPORT],
+                     *pktBuf = &pktBufX[1], /* PROGRAM_DEVICE packet...  */
+                     *hexBuf = &pktBufX[1]; /* ...and its data; see
+                                               packetSetup()             */
+static int            blockSize = 56;     /* Data bytes per USB packet   */
+extern unsigned char *usbBuf;             /* In usb.c                    */
 unsigned char bytesPerAddress = 1;        /* Bytes in flash per address */ 		
 static char Flushed= 1;                   /* Do we need to flush buffer? */
 
+/* Data bytes in the blocks of this pass, and of the last whole pass over
+   the open file (0 = none yet), for progress in the metrics file */
+static unsigned long  passBytes,passTotal = 0;
+
+/* Sampled verification (see sampleSkip()) */
+static double         sampleRate = 1.0;   /* Fraction of blocks to check */
+static unsigned int   sampleSeed;
+static char           sampleFirst;        /* Next block starts a run     */
+static unsigned long  sampleRows,         /* Blocks left to chance...    */
+                      sampleHits,         /* ...and how many were picked */
+                      sampleForced;       /* Blocks always checked       */
+static unsigned char  deferBuf[USB_MAX_REPORT]; /* Last block passed over */
+static unsigned int   deferAddr;
+static int            deferLen = 0;
+
+/* Compressed files are decoded once, as they are opened, into records
+   of 1 byte length, 1 byte type, 2 bytes address and 4 bytes line number
+   (little-endian) and the data, so they take about as much memory as the
+   image they hold */
+#define UNPACK_CHUNK  65536               /* Decoded text per read       */
+#define HEX_LINE_MAX  (10 + 2 * 255)      /* Hex digits in longest line  */
+#define REC_HEADER    8                   /* Bytes before decoded data   */
+
+/* One record of the hex file, from either source */
+typedef struct {
+	unsigned int  len,addr,type,
+	              line;                   /* Compressed files only       */
+	unsigned char data[255];
+} Record;
+
+/* Address index of the open file's data records, for working on a window
+   of the image without parsing the rest (see hexSetWindow()): one entry
+   per record, in address order */
+typedef struct {
+	unsigned int  addr,len,line;
+	size_t        offset;                 /* For hexRecord()             */
+} IndexEntry;
+
+static IndexEntry    *hexIndex = NULL;
+static int            indexCount = 0;
+static char           indexed  = 0,       /* Built for the open file     */
+                      windowed = 0;
+static unsigned int   winStart,winEnd,    /* Byte addresses; end is past */
+                      winHi;              /* Upper address last given    */
+static int            winFirst;           /* First entry that may reach  */
+#define WINDOW_LIST   32                  /* Most spans hexWindowReport()
+                                             lists                       */
+
+static unsigned int hexLine(const unsigned int);
+
+static unsigned char  parseBuf[USB_MAX_REPORT]; /* Block being assembled */
+
+/* Verify by CRC (device offers EXT_CRC32; see crcBlock()) */
+#define CRC_MAX   0x10000                 /* Most bytes per CRC32_RANGE  */
+#define CRC_RATE  20                      /* Slowest device CRC allowed
+                                             for, bytes per ms           */
+static unsigned int   crcAddr,crcLen = 0, /* Range not yet checked...    */
+                      crcValue,           /* ...and its CRC so far       */
+                      crcSpan = CRC_MAX;  /* Bytes per CRC32_RANGE       */
+
+/* Page scan for range erase (see hexRanges()) */
+static char           scanning = 0;
+static Range         *scanRange;
+static int            scanCount,scanMax;
+static unsigned int   scanPage;
+
+/* Parser output recorded as a block stream, each op as 1 byte op, 4 bytes
+   address (little-endian), 1 byte length and the data; played back in
+   place of parsing by a self-contained flasher (see hexOps()) */
+static char           packing = 0;
+static unsigned char *opsBuf  = NULL;     /* Being recorded              */
+static size_t         opsBufLen,opsBufMax;
+static const unsigned char *opsData = NULL; /* Played back; NULL: parse  */
+static size_t         opsLen;
+
+#ifndef WIN
+/* Pipeline from the parser thread to the USB thread (see hexPass()).  A
+   single-producer/single-consumer ring: only the parser moves pipeHead,
+   only the USB thread moves pipeTail. */
+#define PIPE_DEPTH 32                     /* Frames, power of two        */
+#define PIPE_SPINS 200                    /* Yields before sleeping      */
+
+typedef struct {
+	unsigned int  addr;
+	short         len;
+	char          op;                     /* OP_...                      */
+	unsigned char data[256];              /* Max blockSize, plus padding */
+} Frame;
+
+static Frame          pipeRing[PIPE_DEPTH];
+static unsigned int   pipeHead,pipeTail;
+static int            pipeStatus;         /* First USB error, for parser */
+static char           pipeActive = 0;
+#endif
+
 /**************************************************************************** 		
 Function : hexSetBytesPerAddress 		
 Description : Sets given byte width 		
@@ -74,67 +179,375 @@ unsigned char hexGetBytesPerAddress(void){
 }
 
 /****************************************************************************
- Function    : hexOpen
- Description : Open and memory-map an Intel hex file.
- Parameters  : char*      Filename (must be non-NULL).
- Returns     : ErrorCode  ERR_NONE     Success
-                          ERR_HEX_OPEN File not found or no read permission
-                          ERR_HEX_STAT fstat() call failed for some reason
-                          ERR_HEX_MMAP Memory-mapping failed
+ Function    : hexGetBlockSize
+ Description : Data bytes carried per PROGRAM_DEVICE or GET_DATA packet: the
+               data field size reported by QUERY_DEVICE, limited to what fits
+               in a USB report after the 6-byte command header, rounded down
+               to whole 32-bit words.  Being a byte, it always fits the
+               packets' 1-byte size field.
+ Parameters  : None (void)
+ Returns     : int  Bytes per packet; 56 if the device reports no size.
  ****************************************************************************/
-ErrorCode hexOpen(char * const filename)
+int hexGetBlockSize(void)
+{
+	int size = devQuery.PacketDataFieldSize;
+
+	if(!size) return 56;
+	if(size > usbReportSize - 6) size = usbReportSize - 6;
+	return size & ~3;
+}
+
+/* Size blocks for the device, and put their data where a full block's
+   goes in a PROGRAM_DEVICE packet, so that the packet is built around it
+   rather than copied together (see issueBlock()) */
+static void packetSetup(void)
 {
-	ErrorCode status = ERR_HEX_OPEN;
+	blockSize = hexGetBlockSize();
+	hexBuf    = &pktBuf[usbReportSize - blockSize];
+	memset(pktBuf,0,usbReportSize - blockSize);
+}
 
-	if((hexFd = open(filename,O_RDONLY)) >= 0) {
+/* 64-bit FNV-1a hash of the hex text, identifying the image in logs */
+#define HASH_START 0xcbf29ce484222325ULL
 
-		struct stat filestat;
+static void hexHashData(
+  const char * const data,
+  const size_t       len)
+{
+	size_t i;
 
-		status = ERR_HEX_STAT;
-		if(!fstat(hexFd,&filestat)) {
+	for(i=0;i<len;i++)
+		hexHash = (hexHash ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+}
 
-			status      = ERR_HEX_MMAP;
-			hexFileSize = filestat.st_size;
+static int hexDigit(const char c)
+{
+	return (c <= '9') ? (c - '0') : (0x0a + toupper(c) - 'A');
+}
 
-#ifndef WIN
-			if((hexFileData = mmap(0,hexFileSize,PROT_READ,
-			  MAP_FILE | MAP_SHARED,hexFd,0)) != (void *)(-1)) {
-				hexPlusOne = &hexFileData[1];
-				return ERR_NONE;
+/* Check one line of decoded text (hex digits after the ':') and add it to
+   hexRecords */
+static ErrorCode hexStore(
+  const char * const line,
+  const int          digits,
+  const unsigned int lineNum,
+  char * const       eof)
+{
+	unsigned char  rec[5 + 255],*p;
+	unsigned int   i,n = digits / 2,checksum = 0;
+
+	if(digits < 10) return ERR_HEX_SYNTAX;
+	for(i=0;(i < n) && (i < sizeof(rec));i++)
+		rec[i] = (hexDigit(line[i * 2]) << 4) | hexDigit(line[i * 2 + 1]);
+	/* Length, address, type, data, checksum; anything after is ignored
+	   as it is in uncompressed files */
+	if(n < 5u + rec[0]) return ERR_HEX_SYNTAX;
+	for(i=0;i < 5u + rec[0];i++) checksum += rec[i];
+	if(checksum & 0xff) return ERR_HEX_CHECKSUM;
+	if(1 == rec[3]) {  /* EOF record; the parser stops at the end anyway */
+		*eof = 1;
+		return ERR_NONE;
+	}
+
+	if(hexRecordsLen + REC_HEADER + rec[0] > hexRecordsMax) {
+		hexRecordsMax = hexRecordsMax ? hexRecordsMax * 2 : UNPACK_CHUNK;
+		if(!(p = realloc(hexRecords,hexRecordsMax))) return ERR_HEX_MMAP;
+		hexRecords = p;
+	}
+	p    = &hexRecords[hexRecordsLen];
+	p[0] = rec[0];
+	p[1] = rec[3];
+	p[2] = rec[2];
+	p[3] = rec[1];
+	bufWrite32(p,4,lineNum);
+	memcpy(&p[REC_HEADER],&rec[4],rec[0]);
+	hexRecordsLen += REC_HEADER + rec[0];
+
+	return ERR_NONE;
+}
+
+/* Decode the mapped compressed file into hexRecords, checking each line.
+   Text between records is skipped, and records after the EOF record are
+   ignored, as in uncompressed files. */
+static ErrorCode hexUnpack(void)
+{
+	static char  chunk[UNPACK_CHUNK];
+	char         line[HEX_LINE_MAX];
+	ErrorCode    status;
+	int          n,i,digits = -1;  /* -1: not in a record */
+	unsigned int lineNum = 1,recLine = 0;
+	char         eof = 0;
+
+	hexRecordsLen = hexRecordsMax = 0;
+	if(ERR_NONE != (status = unpackOpen((unsigned char *)hexFileData,
+	  hexFileSize)))
+		return status;
+
+	do {
+		if(ERR_NONE != (status = unpackRead(chunk,sizeof(chunk),&n)))
+			break;
+		hexHashData(chunk,n);
+		for(i=0;(i < n) && !eof && (ERR_NONE == status);i++) {
+			if(digits >= 0 && isxdigit((unsigned char)chunk[i])) {
+				if(HEX_LINE_MAX == digits) status = ERR_HEX_SYNTAX;
+				else                       line[digits++] = chunk[i];
+				continue;
 			}
+			if(digits >= 0)  /* End of a record */
+				status = hexStore(line,digits,recLine,&eof);
+			digits = (':' == chunk[i]) ? 0 : -1;
+			if(!digits)              recLine = lineNum;
+			if('\n' == chunk[i])     lineNum++;
+		}
+	} while(n && (ERR_NONE == status));
+	if((ERR_NONE == status) && !eof && (digits >= 0))
+		status = hexStore(line,digits,recLine,&eof);
+	unpackClose();
+
+	return status;
+}
+
+/* Unmap the hex file */
+static void hexUnmap(void)
+{
+#ifndef WIN
+	(void)munmap(hexFileData,hexFileSize);
 #else
-			HANDLE handle;
-			handle = CreateFileMapping((HANDLE)_get_osfhandle(hexFd), NULL, PAGE_WRITECOPY, 0, 0, NULL);
-			if (handle != NULL) {
-				hexFileData = MapViewOfFile(handle, FILE_MAP_COPY, 0, 0, hexFileSize);
-				hexPlusOne = &hexFileData[1];
-				CloseHandle(handle); 
-				return ERR_NONE;
-			}
+	UnmapViewOfFile(hexFileData);
 #endif
+	hexFileData = NULL;
+}
 
-			/* Else clean up and return error code */
-			hexFileData = NULL;
-		}
+/* Finish opening a mapped file: hash it, or decode it if compressed */
+static ErrorCode hexMapped(void)
+{
+	ErrorCode status;
+
+	hexHash = HASH_START;
+	if(UNPACK_NONE ==
+	   unpackFormat((unsigned char *)hexFileData,hexFileSize)) {
+		hexHashData(hexFileData,hexFileSize);
+		return ERR_NONE;
+	}
+
+	status = hexUnpack();
+	hexUnmap();
+	if(ERR_NONE != status) {
+		free(hexRecords);
+		hexRecords = NULL;
+		hexHash    = 0;
 		(void)close(hexFd);
 	}
 
 	return status;
 }
 
+/****************************************************************************
+ Function    : hexGetHash
+ Description : Identifies the hex file most recently opened.
+ Parameters  : None (void)
+ Returns     : unsigned long long  FNV-1a hash of the file's contents, or 0
+                                   if no file has been opened.
+ ****************************************************************************/
+unsigned long long hexGetHash(void)
+{
+	return hexHash;
+}
+
+/****************************************************************************
+ Function    : hexOpenFd
+ Description : Memory-map an Intel hex file that is already open, or decode
+               it if it is compressed (see unpack.c).
+ Parameters  : int        File descriptor, open for reading.  Taken over:
+                          closed by hexClose(), or here on failure.
+ Returns     : ErrorCode  ERR_NONE     Success
+                          ERR_HEX_STAT fstat() call failed for some reason
+                          ERR_HEX_MMAP Memory-mapping failed
+                          ERR_HEX_UNPACK, ERR_HEX_SYNTAX or ERR_HEX_CHECKSUM
+                                       Compressed file couldn't be decoded
+ Notes       : Any file that can be mapped will do, such as a memfd passed
+               in by a client of the flash server (serve.c).  Every line of
+               a compressed file is checked here, as it is decoded.
+ ****************************************************************************/
+ErrorCode hexOpenFd(const int fd)
+{
+	ErrorCode   status = ERR_HEX_STAT;
+	struct stat filestat;
+
+	hexFd = fd;
+	if(!fstat(hexFd,&filestat)) {
+
+		status      = ERR_HEX_MMAP;
+		hexFileSize = filestat.st_size;
+
+#ifndef WIN
+		if((hexFileData = mmap(0,hexFileSize,PROT_READ,
+		  MAP_FILE | MAP_SHARED,hexFd,0)) != (void *)(-1)) {
+			hexPlusOne = &hexFileData[1];
+			return hexMapped();
+		}
+#else
+		HANDLE handle;
+		handle = CreateFileMapping((HANDLE)_get_osfhandle(hexFd), NULL, PAGE_WRITECOPY, 0, 0, NULL);
+		if (handle != NULL) {
+			hexFileData = MapViewOfFile(handle, FILE_MAP_COPY, 0, 0, hexFileSize);
+			hexPlusOne = &hexFileData[1];
+			CloseHandle(handle); 
+			return hexMapped();
+		}
+#endif
+
+		/* Else clean up and return error code */
+		hexFileData = NULL;
+	}
+	(void)close(hexFd);
+
+	return status;
+}
+
+/****************************************************************************
+ Function    : hexOpen
+ Description : Open and memory-map an Intel hex file, which may be
+               compressed.
+ Parameters  : char*      Filename (must be non-NULL).
+ Returns     : ErrorCode  ERR_NONE     Success
+                          ERR_HEX_OPEN File not found or no read permission
+                          else as hexOpenFd()
+ ****************************************************************************/
+ErrorCode hexOpen(char * const filename)
+{
+	int fd;
+
+	if((fd = open(filename,O_RDONLY)) < 0)
+		return ERR_HEX_OPEN;
+
+	return hexOpenFd(fd);
+}
+
+/****************************************************************************
+ Function    : hexSetSample
+ Description : Sets the fraction of blocks checked by verify passes.
+ Parameters  : int           Percentage, 1 to 100 (100 = full verify).
+               unsigned int  Seed choosing which blocks; the same seed and
+                             image always give the same selection.
+ Returns     : Nothing (void)
+ ****************************************************************************/
+void hexSetSample(
+  const int          percent,
+  const unsigned int seed)
+{
+	sampleRate = percent / 100.0;
+	sampleSeed = seed;
+}
+
+/****************************************************************************
+ Function    : hexSetCrcSpan
+ Description : Sets the most bytes a verify by CRC checks per CRC32_RANGE,
+               as tuned for the device (tune.c).
+ Parameters  : unsigned int  Bytes; 0 for the default (CRC_MAX).
+ Returns     : Nothing (void)
+ Notes       : Any span above CRC_MAX is taken as CRC_MAX.
+ ****************************************************************************/
+void hexSetCrcSpan(const unsigned int span)
+{
+	crcSpan = (!span || (span > CRC_MAX)) ? CRC_MAX : span;
+}
+
+/****************************************************************************
+ Function    : sampleSkip
+ Description : Decides whether a sampled verify pass can pass over a block.
+               The first block of each contiguous run of data is always
+               checked, as is any block holding the start of a program
+               memory region (where this bootloader puts the application's
+               reset vector) or configuration words; the last block of each
+               run is checked by sampleRunEnd().  Others are picked by a
+               hash of their address, so the choice is random across seeds
+               but repeatable for any one seed.
+ Parameters  : unsigned int  Block address.
+               int           Block length in bytes; data is in hexBuf.
+ Returns     : int           1 to skip the block, 0 to check it.
+ ****************************************************************************/
+static int sampleSkip(
+  const unsigned int addr,
+  const int          len)
+{
+	unsigned int h = addr ^ sampleSeed;
+	int          i;
+
+	if(sampleRate >= 1.0) return 0;
+
+	deferLen = 0;
+	for(i=0;!sampleFirst && (i < devQuery.memBlocks);i++) {
+		if(((devQuery.mem[i].Type == TypeProgramMemory) &&
+		    (devQuery.mem[i].Address >= addr) &&
+		    (devQuery.mem[i].Address < addr + len)) ||
+		   ((devQuery.mem[i].Type == TypeConfigWords) &&
+		    (addr >= devQuery.mem[i].Address) && (addr <
+		     devQuery.mem[i].Address + devQuery.mem[i].Length *
+		     bytesPerAddress)))
+			sampleFirst = 1;
+	}
+	if(sampleFirst) {
+		sampleFirst = 0;
+		sampleForced++;
+		return 0;
+	}
+
+	/* Integer hash finalizer; spreads neighbouring addresses */
+	h ^= h >> 16; h *= 0x7feb352d;
+	h ^= h >> 15; h *= 0x846ca68b;
+	h ^= h >> 16;
+	sampleRows++;
+	if(h < sampleRate * 4294967296.0) {
+		sampleHits++;
+		return 0;
+	}
+
+	/* Keep it in case it turns out to be the last of its run */
+	memcpy(deferBuf,hexBuf,len);
+	deferAddr = addr;
+	deferLen  = len;
+	return 1;
+}
+
+/****************************************************************************
+ Function    : hexMemBlock
+ Description : Finds the hex file bytes one of the device's memory blocks
+               holds.  Block addresses are as in the hex file; lengths are
+               in device address units, bytesPerAddress bytes each.
+ Parameters  : int     Index into devQuery.mem[].
+               Range*  Receives the span of hex file bytes.
+ Returns     : int     1 if the block is programmable, 0 if it has been
+                       masked out by deviceLock().
+ Notes       : Everything that matches hex data to device memory goes
+               through here, so that all of it agrees on which bytes are
+               where.  Device addresses are these divided by
+               bytesPerAddress.
+ ****************************************************************************/
+int hexMemBlock(
+  const int    i,
+  Range * const span)
+{
+	span->addr = devQuery.mem[i].Address;
+	span->len  = devQuery.mem[i].Length * bytesPerAddress;
+
+	return devQuery.mem[i].Type != 0;
+}
+
 /* check memory address & length are in a programmable memory area, as reported by device's Bootloader */
-static int verifyBlockProgrammable( unsigned int *addr, char *len )
+static int verifyBlockProgrammable( unsigned int *addr, int *len )
 {
-	int i, isA, isL, MA, ML;
+	int   i, isA, isL, MA, ML;
+	Range span;
 	for ( i = 0; i < devQuery.memBlocks; i++ )
 	{
 		/* only look at programmable memory blocks */
-		if ( !devQuery.mem[ i ].Type )
+		if ( !hexMemBlock( i, &span ) )
 			continue;
 
 		/* calc if first or last address is in this block */
-		MA = devQuery.mem[ i ].Address;
-		ML = devQuery.mem[ i ].Length * bytesPerAddress;
+		MA = span.addr;
+		ML = span.len;
 		isA = ( *addr >= MA ) && ( *addr < MA + ML );
 		isL = ( *addr + *len > MA ) && ( *addr + *len <= MA + ML );
 
@@ -179,18 +592,150 @@ static int verifyBlockProgrammable( unsigned int *addr, char *len )
    ( (hexPlusOne [pos] <= '9') ? (hexPlusOne [pos] - '0') : \
      (0x0a + toupper(hexPlusOne [pos]) - 'A')      ))
 
+/****************************************************************************
+ Function    : hexCrc32
+ Description : Updates a CRC-32 (IEEE 802.3, as zlib's crc32()) with more
+               data.
+ Parameters  : unsigned int    CRC so far; 0 to start.
+               unsigned char*  Data.
+               int             Length of data in bytes.
+ Returns     : unsigned int    Updated CRC.
+ ****************************************************************************/
+unsigned int hexCrc32(
+  unsigned int               crc,
+  const unsigned char * const buf,
+  const int                  len)
+{
+	static unsigned int table[256];
+	unsigned int        c;
+	int                 i,j;
+
+	if(!table[1]) {
+		for(i=0;i<256;i++) {
+			for(c=i,j=0;j<8;j++)
+				c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+	}
+	crc = ~crc;
+	for(i=0;i<len;i++)
+		crc = table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+/* Have the device check the range accumulated by crcBlock() */
+static ErrorCode crcCheck(void)
+{
+	ErrorCode    status;
+	unsigned int addr = crcAddr / bytesPerAddress,len = crcLen;
+
+	if(!crcLen) return ERR_NONE;
+	crcLen = 0;
+
+	DEBUGMSG("Checking CRC");
+	usbBuf[0] = CRC32_RANGE;
+	bufWrite32(usbBuf,1,addr);
+	bufWrite32(usbBuf,5,len);
+	/* The device works through the whole span before it answers; allow
+	   for that on top of the usual round trip */
+	watchdogBudget(watchdogTimeout() + len / CRC_RATE);
+	status = usbWrite(9,1);
+	watchdogBudget(0);
+	if(ERR_NONE != status)
+		return status;
+	if((usbBuf[0] != CRC32_RANGE) || (bufRead32(1) != addr) ||
+	   (bufRead32(5) != len)) {
+		(void)printf("\nUnexpected response to CRC32_RANGE at %08x\n",addr);
+		return ERR_USB_READ;
+	}
+	if(bufRead32(9) != crcValue) {
+		(void)printf("\nCRC mismatch in %u bytes at address %08x\n",len,
+		  addr);
+		return ERR_VERIFY;
+	}
+
+	return ERR_NONE;
+}
+
+/* Verify one block by CRC.  Contiguous blocks are checked together, so
+   that a whole run of data costs one round trip rather than one each. */
+static ErrorCode crcBlock(
+  const unsigned int addr,
+  const int          len)
+{
+	ErrorCode status = ERR_NONE;
+
+	if(crcLen && ((addr != crcAddr + crcLen) || (crcLen + len > crcSpan)))
+		status = crcCheck();
+	if(!crcLen) {
+		crcAddr  = addr;
+		crcValue = 0;
+	}
+	crcValue  = hexCrc32(crcValue,hexBuf,len);
+	crcLen   += len;
+
+	return status;
+}
+
+/* Note the erase pages a block touches, for hexRanges() */
+static void scanBlock(
+  unsigned int addr,
+  int          len)
+{
+	unsigned int start,end;
+	Range       *r;
+
+	if((scanCount < 0) || verifyBlockProgrammable(&addr,&len))
+		return;
+	if(len & 1) len++;  /* As padded by issueBlock() */
+
+	start = addr & ~(scanPage - 1);
+	end   = (addr + len + scanPage - 1) & ~(scanPage - 1);
+	r     = scanCount ? &scanRange[scanCount - 1] : NULL;
+	if(r && (start <= r->addr + r->len) && (end >= r->addr)) {
+		if(end > r->addr + r->len) r->len  = end - r->addr;
+		if(start < r->addr) {
+			r->len  += r->addr - start;
+			r->addr  = start;
+		}
+	} else if(scanCount == scanMax) {
+		scanCount = -1;
+	} else {
+		scanRange[scanCount].addr  = start;
+		scanRange[scanCount++].len = end - start;
+	}
+}
+
+/* Say where a verify found a difference, and which line gave the byte;
+   block data is in hexBuf, the device's in usbBuf */
+static void verifyMismatch(
+  const unsigned int addr,
+  const int          len)
+{
+	const unsigned char *dev = &usbBuf[usbReportSize - len];
+	unsigned int         line;
+	int                  k;
+
+	for(k=0;(k < len) && (dev[k] == hexBuf[k]);k++);
+	if(k == len) return;
+	(void)printf("\nMismatch at %08x: device %02x, file %02x",addr + k,
+	  dev[k],hexBuf[k]);
+	if((line = hexLine(addr + k)))
+		(void)printf(" (line %u)",line);
+}
+
 /****************************************************************************
  Function    : issueBlock
  Description : Send data over USB bus to device.
  Parameters  : unsigned int  Destination address on PIC device.
-               char          Byte count (max 56).
+               int           Byte count (max blockSize).
                char          Verify vs. write.
  Returns     : ErrorCode     ERR_NONE on success, or error code as returned
                              from usbWrite();
  ****************************************************************************/
 static ErrorCode issueBlock(
   unsigned int  addr,
-  char          len,
+  int           len,
   char          verify)
 {
 	ErrorCode status;
@@ -229,37 +774,32 @@ static ErrorCode issueBlock(
 	usbBuf[5] = len;
 
 	if(verify) {
+		if(deviceExt & EXT_CRC32) return crcBlock(addr,len);
+		if(sampleSkip(addr,len)) return ERR_NONE;
 		DEBUGMSG("Verifying");
 		usbBuf[0] = GET_DATA;
 		if(ERR_NONE == (status = usbWrite(6,1))) {
-#ifdef DEBUG
-			int i;
-			if(memcmp(&usbBuf[64 - len],hexBuf,len)) {
-				(void)puts("Verify FAIL\nExpected:");
-				(void)printf("NA NA NA NA NA NA NA NA - ");
-				for(i=0;i<(56-len);i++) (void)printf("NA ");
-				for(i=0;i<len;i++)
-					(void)printf("%02x ",hexBuf[i]);
-				(void)putchar('\n'); fflush(stdout);
-				return ERR_VERIFY;
-			} else {
-				(void)puts("Verify OK");
+			if(!memcmp(&usbBuf[usbReportSize - len],hexBuf,len)) {
+				DEBUGMSG("Verify OK");
 				return ERR_NONE;
 			}
-#else
-			return (memcmp(&usbBuf[64 - len],hexBuf,len) ?
-			  ERR_VERIFY : ERR_NONE);
-#endif
-
+			DEBUGMSG("Verify FAIL");
+			verifyMismatch(addr,len);
+			return ERR_VERIFY;
 		}
 	} else {
 		DEBUGMSG("Writing");
-		usbBuf[0] = PROGRAM_DEVICE;
+		pktBuf[0] = PROGRAM_DEVICE;
+		bufWrite32(pktBuf,1,addr / bytesPerAddress);
+		pktBuf[5] = len;
 		/* Regardless of actual byte count, data packet is always
-		   64 bytes.  Following the header, the bootloader wants the
-		   data portion 'right justified' within packet.  Odd. */
-		memcpy(&usbBuf[64 - len],hexBuf,len);
-		if((ERR_NONE == (status = usbWrite(64,0))) && (len < 56))
+		   a full report.  Following the header, the bootloader wants
+		   the data portion 'right justified' within packet.  Odd.
+		   A full block is already there; only a short one moves. */
+		if(len < blockSize)
+			memmove(&pktBuf[usbReportSize - len],hexBuf,len);
+		status = usbPacket(pktBuf,usbReportSize,NULL);
+		if((ERR_NONE == status) && (len < blockSize))
 		{
 			/* Short data packets need flushing */
 			DEBUGMSG("Completing");
@@ -267,7 +807,7 @@ static ErrorCode issueBlock(
 			status    = usbWrite(1,0);
 		}
 		// flag if external code may need to flush before next write
-		Flushed= (len < 56);
+		Flushed= (len < blockSize);
 	}
 
 #ifdef DEBUG
@@ -278,157 +818,901 @@ static ErrorCode issueBlock(
 }
 
 /****************************************************************************
- Function    : hexWrite
- Description : Writes (and optionally verifies) currently-open hex file to
-               device.
+ Function    : sampleRunEnd
+ Description : Marks the end of a contiguous run of hex data.  On a sampled
+               verify pass, the run's last block is checked now if it was
+               passed over.
+ Parameters  : char       Verify (1) vs. write (0) pass.
+ Returns     : ErrorCode  ERR_NONE on success, or as returned by issueBlock().
+ ****************************************************************************/
+static ErrorCode sampleRunEnd(const char pass)
+{
+	ErrorCode status = ERR_NONE;
+
+	if(pass && deferLen) {
+		memcpy(hexBuf,deferBuf,deferLen);
+		sampleRows--;             /* Now counted as always checked */
+		sampleFirst = 1;
+		status      = issueBlock(deferAddr,deferLen,pass);
+	}
+	sampleFirst = 1;
+	deferLen    = 0;
+
+	return status;
+}
+
+/* Report how much a sampled verify pass checked, and what that's worth */
+static void sampleReport(void)
+{
+	double p,f = sampleRows ? (double)sampleHits / sampleRows : 1.0;
+	int    n;
+
+	(void)printf("\nSampled verify, seed %u: %lu of %lu blocks checked "
+	  "(%lu always checked)",sampleSeed,sampleHits + sampleForced,
+	  sampleRows + sampleForced,sampleForced);
+	if((f > 0.0) && (f < 1.0)) {
+		/* Smallest number of bad blocks caught with 99% confidence */
+		for(n=0,p=1.0;p > 0.01;n++,p *= 1.0 - f);
+		(void)printf("\nChance a bad block is caught: %.1f%% for one, "
+		  "99%% for %d or more",f * 100.0,n);
+	}
+}
+
+/* Record one parser request for hexOps(); block data is in hexBuf */
+static ErrorCode opsAdd(
+  const char         op,
+  const unsigned int addr,
+  const int          len)
+{
+	unsigned char *p;
+
+	if(opsBufLen + 6 + len > opsBufMax) {
+		opsBufMax = opsBufMax ? opsBufMax * 2 : UNPACK_CHUNK;
+		if(!(p = realloc(opsBuf,opsBufMax))) return ERR_HEX_MMAP;
+		opsBuf = p;
+	}
+	p = &opsBuf[opsBufLen];
+	p[0] = op;
+	bufWrite32(p,1,addr);
+	p[5] = len;
+	if(OP_BLOCK == op) memcpy(&p[6],hexBuf,len);
+	else               p[5] = 0;
+	opsBufLen += 6 + p[5];
+
+	return ERR_NONE;
+}
+
+/* Carry out one parser request; block data is in hexBuf */
+static ErrorCode hexIssue(
+  const char         op,
+  const unsigned int addr,
+  const int          len,
+  const char         pass)
+{
+	ErrorCode status;
+
+	if(OP_BLOCK == op) passBytes += len;
+	if(scanning) {
+		if(OP_BLOCK == op) scanBlock(addr,len);
+		return ERR_NONE;
+	}
+	if(packing)
+		return opsAdd(op,addr,len);
+	if(OP_BLOCK == op) {
+		metricsBlock(len);
+		return issueBlock(addr,len,pass);
+	}
+	if(OP_FLUSH == op)
+		return Flushed ? ERR_NONE : issueBlock(addr,0,pass);
+	if(OP_RUNEND == op) {
+		if((ERR_NONE == (status = sampleRunEnd(pass))) && pass)
+			status = crcCheck();
+		return status;
+	}
+	return ERR_NONE;
+}
+
+/****************************************************************************
+ Function    : hexEmit
+ Description : Passes one request from the parser to the USB side: queued
+               for the USB thread when pipelined, else carried out at once.
+               Block data is taken from parseBuf.
+ Parameters  : char          OP_BLOCK, OP_FLUSH, OP_RUNEND or OP_END.
+               unsigned int  Block address.
+               int           Block length.
+               char          Verify (1) vs. write (0).
+ Returns     : ErrorCode     ERR_NONE, or the error that stopped the USB
+                             side, in which case the parser should stop.
+ Notes       : When the ring is full, waits for the USB side to catch up.
+ ****************************************************************************/
+static ErrorCode hexEmit(
+  const char         op,
+  const unsigned int addr,
+  const int          len,
+  const char         pass)
+{
+#ifndef WIN
+	ErrorCode     status;
+	Frame        *f;
+	unsigned int  head;
+	int           spins = 0;
+
+	if(pipeActive) {
+		if((OP_END != op) &&
+		   (status = __atomic_load_n(&pipeStatus,__ATOMIC_ACQUIRE)))
+			return status;
+
+		head = pipeHead;
+		while(head - __atomic_load_n(&pipeTail,__ATOMIC_ACQUIRE) ==
+		  PIPE_DEPTH) {
+			if(++spins < PIPE_SPINS) (void)sched_yield();
+			else                     (void)usleep(100);
+		}
+		f       = &pipeRing[head & (PIPE_DEPTH - 1)];
+		f->op   = op;
+		f->addr = addr;
+		f->len  = len;
+		if(OP_BLOCK == op) memcpy(f->data,parseBuf,len);
+		__atomic_store_n(&pipeHead,head + 1,__ATOMIC_RELEASE);
+		return ERR_NONE;
+	}
+#endif
+
+	if(OP_BLOCK == op) memcpy(hexBuf,parseBuf,len);
+	return hexIssue(op,addr,len,pass);
+}
+
+/* Read the record at *offset, from the mapped text or the decoded records
+   of a compressed file, and move *offset on to the next; an EOF record
+   (type 1) at the end of the data */
+static ErrorCode hexRecord(
+  size_t * const offset,
+  Record * const rec,
+  const char     check)
+{
+	char          *ptr;
+	unsigned char *p;
+	int            checksum,i,end;
+
+	if(hexRecords) {  /* Already checked as decoded */
+		if(*offset >= hexRecordsLen) {
+			rec->type = 1;
+			return ERR_NONE;
+		}
+		p         = &hexRecords[*offset];
+		rec->len  = p[0];
+		rec->type = p[1];
+		rec->addr = p[2] | (p[3] << 8);
+		rec->line = p[4] | (p[5] << 8) | (p[6] << 16) |
+		  ((unsigned int)p[7] << 24);
+		memcpy(rec->data,&p[REC_HEADER],rec->len);
+		*offset  += REC_HEADER + rec->len;
+		return ERR_NONE;
+	}
+
+	if(*offset >= hexFileSize) {  /* No EOF record */
+		rec->type = 1;
+		return ERR_NONE;
+	}
+
+	/* Line start contains length, 16-bit address and type */
+	if(3 != sscanf(&hexFileData[*offset],":%02x%04x%02x",
+	  &rec->len,&rec->addr,&rec->type)) return ERR_HEX_SYNTAX;
+
+	/* Position of %02x checksum at end of line */
+	end = *offset + 9 + rec->len * 2;
+
+	/* Verify checksum if asked (first pass) */
+	if(check) {
+		for(checksum = 0,i = *offset + 1;i < end;
+		  checksum = (checksum + (0x100 - atoh(i))) & 0xff,i += 2);
+		if(atoh(end) != checksum) return ERR_HEX_CHECKSUM;
+	}
+
+	for(i=0;i<(int)rec->len;i++)
+		rec->data[i] = atoh(*offset + 9 + i * 2);
+
+	/* Advance to start of next line (skip CR/LF/etc.) */
+	*offset = (ptr = strchr(&hexFileData[end+2],':')) ?
+	  (size_t)(ptr - hexFileData) : hexFileSize;
+
+	return ERR_NONE;
+}
+
+/* Order index entries by address, then file order */
+static int indexCompare(
+  const void *a,
+  const void *b)
+{
+	const IndexEntry *x = a,*y = b;
+
+	if(x->addr != y->addr) return (x->addr < y->addr) ? -1 : 1;
+	return (x->line < y->line) ? -1 : (x->line > y->line);
+}
+
+/* Build the address index of the open file, if not built already; every
+   line is checked, as by the first pass of a write */
+static ErrorCode hexIndexBuild(void)
+{
+	Record        rec;
+	ErrorCode     status;
+	IndexEntry   *e;
+	size_t        offset = 0,at,counted = 0;
+	unsigned int  addrHi = 0,line = 1;
+	int           max = 0;
+	char         *p;
+
+	if(indexed || opsData) return ERR_NONE;
+
+	for(indexCount=0;;) {
+		/* Lines of text up to this record, counted as they go by */
+		if(!hexRecords) {
+			while((p = memchr(&hexFileData[counted],'\n',offset - counted))) {
+				line++;
+				counted = p - hexFileData + 1;
+			}
+			counted = offset;
+		}
+		at = offset;
+		if((ERR_NONE != (status = hexRecord(&offset,&rec,1))) ||
+		   (1 == rec.type))
+			break;
+		if(4 == rec.type) {
+			if(rec.len < 2) {
+				status = ERR_HEX_SYNTAX;
+				break;
+			}
+			addrHi = (rec.data[0] << 24) | (rec.data[1] << 16);
+		} else if((0 == rec.type) && rec.len) {
+			if(indexCount == max) {
+				max = max ? max * 2 : 1024;
+				if(!(e = realloc(hexIndex,max * sizeof(IndexEntry)))) {
+					status = ERR_HEX_MMAP;
+					break;
+				}
+				hexIndex = e;
+			}
+			e         = &hexIndex[indexCount++];
+			e->addr   = addrHi + rec.addr;
+			e->len    = rec.len;
+			e->line   = hexRecords ? rec.line : line;
+			e->offset = at;
+		} else if((0 != rec.type) && (5 != rec.type)) {
+			status = ERR_HEX_RECORD;
+			break;
+		}
+	}
+	if(ERR_NONE != status) {
+		free(hexIndex);
+		hexIndex   = NULL;
+		indexCount = 0;
+		return status;
+	}
+
+	qsort(hexIndex,indexCount,sizeof(IndexEntry),indexCompare);
+	indexed = 1;
+
+	return ERR_NONE;
+}
+
+/* First index entry that can hold data at or after an address: records
+   are at most 255 bytes, so none starting further back reaches it */
+static int indexFind(const unsigned int addr)
+{
+	unsigned int from = (addr > 255) ? addr - 255 : 0;
+	int          lo = 0,hi = indexCount,mid;
+
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if(hexIndex[mid].addr < from) lo = mid + 1;
+		else                          hi = mid;
+	}
+	return lo;
+}
+
+/* Line of the open file giving the byte at an address (the last to, if
+   several do); 0 if none does */
+static unsigned int hexLine(const unsigned int addr)
+{
+	unsigned int line = 0;
+	int          i;
+
+	if(ERR_NONE != hexIndexBuild())
+		return 0;
+	for(i=indexFind(addr);(i < indexCount) && (hexIndex[i].addr <= addr);i++)
+		if((addr - hexIndex[i].addr < hexIndex[i].len) &&
+		   (hexIndex[i].line > line))
+			line = hexIndex[i].line;
+
+	return line;
+}
+
+/* Next record for hexParse(): the file's next or, with a window set, the
+   next in address order that reaches into it, cut to fit, preceded by an
+   extended address record wherever the upper address changes.  In a
+   window, *offset counts index entries from winFirst. */
+static ErrorCode hexNext(
+  size_t * const offset,
+  Record * const rec,
+  const char     check)
+{
+	ErrorCode     status;
+	IndexEntry   *e;
+	unsigned int  from,to;
+	size_t        at;
+
+	if(!windowed)
+		return hexRecord(offset,rec,check);
+
+	for(;;(*offset)++) {
+		if((winFirst + *offset >= (size_t)indexCount) ||
+		   ((e = &hexIndex[winFirst + *offset])->addr >= winEnd)) {
+			rec->type = 1;
+			return ERR_NONE;
+		}
+		from = (e->addr > winStart) ? e->addr : winStart;
+		to   = (e->addr + e->len < winEnd) ? e->addr + e->len : winEnd;
+		if(from < to) break;
+	}
+
+	if((from & 0xffff0000) != winHi) {
+		winHi        = from & 0xffff0000;
+		rec->type    = 4;
+		rec->len     = 2;
+		rec->data[0] = winHi >> 24;
+		rec->data[1] = winHi >> 16;
+		return ERR_NONE;
+	}
+
+	at = e->offset;  /* Checked as the index was built */
+	if(ERR_NONE != (status = hexRecord(&at,rec,0)))
+		return status;
+	memmove(rec->data,&rec->data[from - e->addr],to - from);
+	rec->addr = from & 0xffff;
+	rec->len  = to - from;
+	(*offset)++;
+
+	return ERR_NONE;
+}
+
+/* Play back a recorded block stream (see hexUseOps()) as hexParse() */
+static ErrorCode opsPlay(const char pass)
+{
+	const unsigned char *p;
+	ErrorCode            status = ERR_NONE;
+
+	for(p=opsData;(p < opsData + opsLen) && (ERR_NONE == status);
+	  p += 6 + p[5]) {
+		memcpy(parseBuf,&p[6],p[5]);
+		status = hexEmit(p[0],p[1] | (p[2] << 8) | (p[3] << 16) |
+		  ((unsigned int)p[4] << 24),p[5],pass);
+	}
+
+	return status;
+}
+
+/****************************************************************************
+ Function    : hexParse
+ Description : Parses the currently-open hex file into blocks, handing each
+               to hexEmit() along with the flushes and run ends that go
+               between them.
  Parameters  : char       Verify (1) vs. write (0).
+               char       If set, also check each line's checksum.
  Returns     : ErrorCode  ERR_NONE on success, else various other values as
                           defined in mphidflash.h.
- Notes       : USB device and hex file are both assumed already open and
-               valid; no checks performed here.
+ Notes       : Touches no USB or verify state itself, so that it can run on
+               a thread of its own.  With a block stream in use (see
+               hexUseOps()) that is played back instead.
  ****************************************************************************/
-ErrorCode hexWrite(const char verify)
+static ErrorCode hexParse(
+  const char pass,
+  const char check)
 {
-	char         *ptr,pass;
+	Record        rec;
 	ErrorCode     status;
-	int           checksum,i,end,offset;
+	size_t        offset;
 	short         bufLen;
-	unsigned int  len,type,addrHi,addrLo,addr32,addrSave;
+	unsigned int  i,addrHi,addr32,addrSave;
 
-	for(pass=0;pass<=verify;pass++) {
-	  offset   = 0; /* Start at beginning of hex file         */
-	  bufLen   = 0; /* Hex buffer initially empty             */
-	  addrHi   = 0; /* Initial address high bits              */
-	  addrSave = 0; /* PIC start addr for hex buffer contents */
-	  addr32   = 0;
+	if(opsData) return opsPlay(pass);
 
-	  if(pass) (void)printf("\nVerifying:");
+	offset   = 0; /* Start at beginning of hex file         */
+	bufLen   = 0; /* Hex buffer initially empty             */
+	addrHi   = 0; /* Initial address high bits              */
+	addrSave = 0; /* PIC start addr for hex buffer contents */
+	addr32   = 0;
+	winHi    = 1; /* Window: no upper address given yet     */
 
-	  for(;;) {  /* Each line in file */
+	for(;;) {  /* Each line in file */
 
-	    /* Line start contains length, 16-bit address and type */
-	    if(3 != sscanf(&hexFileData[offset],":%02x%04x%02x",
-	      &len,&addrLo,&type)) return ERR_HEX_SYNTAX;
+	  if(ERR_NONE != (status = hexNext(&offset,&rec,check)))
+	    return status;
 
-	    /* Position of %02x checksum at end of line */
-	    end = offset + 9 + len * 2;
+	  /* Process different hex record types.  Using if/else rather
+	     than a switch in order to better handle EOF cases (allows
+	     simple 'break' rather than goto or other nasties). */
 
-	    /* Verify checksum on first (write) pass */
-	    if(!pass) {
-	      for(checksum = 0,i = offset + 1;i < end;
-	        checksum = (checksum + (0x100 - atoh(i))) & 0xff,i += 2);
-	      if(atoh(end) != checksum) return ERR_HEX_CHECKSUM;
-	    }
+	  if(0 == rec.type) { /* Data record */
 
-	    /* Process different hex record types.  Using if/else rather
-	       than a switch in order to better handle EOF cases (allows
-	       simple 'break' rather than goto or other nasties). */
-
-	    if(0 == type) { /* Data record */
-
-	      /* If new record address is not contiguous with prior record,
-	         issue accumulated hex data (if any) and start anew. */
-	      if((addrHi + addrLo) != addr32) {
-		// flush previous write
-		if(!Flushed && ERR_NONE != (status = issueBlock(addrSave,0,pass)))
-	          return status;
-	        addr32 = addrHi + addrLo;
-	        if(bufLen) {
-	          if(ERR_NONE != (status = issueBlock(addrSave,bufLen,pass)))
-	            return status;
-	          bufLen = 0;
-	        }
-	        addrSave = addr32;
+	    /* If new record address is not contiguous with prior record,
+	       issue accumulated hex data (if any) and start anew. */
+	    if((addrHi + rec.addr) != addr32) {
+	      // flush previous write
+	      if(ERR_NONE != (status = hexEmit(OP_FLUSH,addrSave,0,pass)))
+		return status;
+	      addr32 = addrHi + rec.addr;
+	      if(bufLen) {
+		if(ERR_NONE != (status = hexEmit(OP_BLOCK,addrSave,bufLen,pass)))
+		  return status;
+		bufLen = 0;
 	      }
+	      if(ERR_NONE != (status = hexEmit(OP_RUNEND,0,0,pass)))
+		return status;
+	      addrSave = addr32;
+	    }
 
-	      /* Parse bytes from line into hexBuf */
-	      for(i = offset + 9;i < end;i += 2) {
-	        hexBuf[bufLen++] = atoh(i); /* Add to hex buffer */
-	        /* If buffer is full, issue block and start anew */
-	        if(sizeof(hexBuf) == bufLen) {
-	          if(ERR_NONE != (status = issueBlock(addrSave,bufLen,pass)))
-	            return status;
-	          bufLen = 0;
-	        }
-
-	        /* Increment address, wraparound as per hexfile spec */
-	        if(0xffffffff == addr32) {
-	          /* Wraparound.  If any hex data, issue and start anew. */
-	          if(bufLen) {
-	            if(ERR_NONE !=
-	              (status = issueBlock(addrSave,bufLen,pass)))
-	                return status;
-	            bufLen = 0;
-	          }
-	          addr32 = 0;
-	        } else {
-	          addr32++;
-	        }
-
-	        /* If issueBlock() used, save new address for next block */
-	        if(!bufLen) addrSave = addr32;
+	    /* Copy bytes from record into parseBuf */
+	    for(i = 0;i < rec.len;i++) {
+	      parseBuf[bufLen++] = rec.data[i]; /* Add to hex buffer */
+	      /* If buffer is full, issue block and start anew */
+	      if(blockSize == bufLen) {
+		if(ERR_NONE != (status = hexEmit(OP_BLOCK,addrSave,bufLen,pass)))
+		  return status;
+		bufLen = 0;
 	      }
 
-	    } else if(1 == type) { /* EOF record */
+	      /* Increment address, wraparound as per hexfile spec */
+	      if(0xffffffff == addr32) {
+		/* Wraparound.  If any hex data, issue and start anew. */
+		if(bufLen) {
+		  if(ERR_NONE !=
+		    (status = hexEmit(OP_BLOCK,addrSave,bufLen,pass)))
+		      return status;
+		  bufLen = 0;
+		}
+		if(ERR_NONE != (status = hexEmit(OP_RUNEND,0,0,pass)))
+		  return status;
+		addr32 = 0;
+	      } else {
+		addr32++;
+	      }
 
-	      break;
+	      /* If block issued, save new address for next block */
+	      if(!bufLen) addrSave = addr32;
+	    }
 
-	    } else if(4 == type) { /* Extended linear address record */
+	  } else if(1 == rec.type) { /* EOF record */
 
-	      if(1 != sscanf(&hexFileData[offset+9],"%04x",&addrHi))
-	        return ERR_HEX_SYNTAX;
-	      addrHi <<= 16;
-	      addr32 = addrHi;
-	      /* Assume this means a noncontiguous address jump; issue block
-	         and start anew.  The prior noncontiguous address code should
-	         already have this covered, but in the freak case of an
-	         extended address record with no subsequent data, make sure
-	         the last of the data is issued. */
-	      // flush previous write
-	      if(!Flushed && ERR_NONE != (status = issueBlock(addrSave,0,pass)))
-	        return status;
-	      if(bufLen) {
-	        if(ERR_NONE != (status = issueBlock(addrSave,bufLen,pass)))
-	          return status;
-	        bufLen   = 0;
-	      }
-	      addrSave = addr32;
+	    break;
 
+	  } else if(4 == rec.type) { /* Extended linear address record */
 
-	    } else if(5 == type) { /* Start address */
+	    if(rec.len < 2) return ERR_HEX_SYNTAX;
+	    addrHi = (rec.data[0] << 24) | (rec.data[1] << 16);
+	    addr32 = addrHi;
+	    /* Assume this means a noncontiguous address jump; issue block
+	       and start anew.  The prior noncontiguous address code should
+	       already have this covered, but in the freak case of an
+	       extended address record with no subsequent data, make sure
+	       the last of the data is issued. */
+	    // flush previous write
+	    if(ERR_NONE != (status = hexEmit(OP_FLUSH,addrSave,0,pass)))
+	      return status;
+	    if(bufLen) {
+	      if(ERR_NONE != (status = hexEmit(OP_BLOCK,addrSave,bufLen,pass)))
+		return status;
+	      bufLen   = 0;
+	    }
+	    if(ERR_NONE != (status = hexEmit(OP_RUNEND,0,0,pass)))
+	      return status;
+	    addrSave = addr32;
 
-	      /* Ignore */
 
-	    } else { /* Unsupported record type */
-	      return ERR_HEX_RECORD;
-	    }
+	  } else if(5 == rec.type) { /* Start address */
 
-	    /* Advance to start of next line (skip CR/LF/etc.), unless EOF */
-	    if(NULL == (ptr = strchr(&hexFileData[end+2],':'))) break;
+	    /* Ignore */
 
-	    offset = ptr - hexFileData;
+	  } else { /* Unsupported record type */
+	    return ERR_HEX_RECORD;
 	  }
 
-	  /* At end of file, issue any residual data (counters reset at top) */
-	  if(bufLen &&
-	    (ERR_NONE != (status = issueBlock(addrSave,bufLen,pass))))
-	      return status;
+	}
+
+	/* At end of file, issue any residual data (counters reset at top) */
+	if(bufLen &&
+	  (ERR_NONE != (status = hexEmit(OP_BLOCK,addrSave,bufLen,pass))))
+	    return status;
+	if(ERR_NONE != (status = hexEmit(OP_RUNEND,0,0,pass)))
+	  return status;
 
-	  /* Make sure last data is flushed */
-	  if(!pass && !Flushed)
-	    return issueBlock(addrSave,0,pass);
+	/* Make sure last data is flushed */
+	if(!pass &&
+	  (ERR_NONE != (status = hexEmit(OP_FLUSH,addrSave,0,pass))))
+	    return status;
 
 #ifdef DEBUG
-	  (void)printf("PASS %d of %d COMPLETE\n",pass,verify);
+	(void)printf("PARSE %d COMPLETE\n",pass);
+#endif
+
+	return ERR_NONE;
+}
+
+#ifndef WIN
+/* Arguments and result of the parser thread */
+typedef struct {
+	char      pass,check;
+	ErrorCode status;
+} ParseJob;
+
+static void *hexParseThread(void *arg)
+{
+	ParseJob *job = arg;
+
+	EV_BEGIN("parse",0);
+	job->status = hexParse(job->pass,job->check);
+	EV_END();
+	(void)hexEmit(OP_END,0,0,job->pass);
+
+	return NULL;
+}
+
+/* USB side of the pipeline: carry out queued requests up to OP_END */
+static ErrorCode hexDrain(const char pass)
+{
+	ErrorCode     status = ERR_NONE;
+	Frame        *f;
+	unsigned int  tail   = 0;
+	int           spins  = 0;
+
+	for(;;) {
+		if(__atomic_load_n(&pipeHead,__ATOMIC_ACQUIRE) == tail) {
+			if(++spins < PIPE_SPINS) (void)sched_yield();
+			else                     (void)usleep(100);
+			continue;
+		}
+		spins = 0;
+		f     = &pipeRing[tail & (PIPE_DEPTH - 1)];
+		if(OP_END == f->op) break;
+		/* After an error, only drain until the parser notices */
+		if(ERR_NONE == status) {
+			if(OP_BLOCK == f->op) memcpy(hexBuf,f->data,f->len);
+			if(ERR_NONE != (status = hexIssue(f->op,f->addr,f->len,pass)))
+				__atomic_store_n(&pipeStatus,status,__ATOMIC_RELEASE);
+		}
+		__atomic_store_n(&pipeTail,++tail,__ATOMIC_RELEASE);
+	}
+
+	return status;
+}
+#endif
+
+/****************************************************************************
+ Function    : hexPass
+ Description : Runs the currently-open hex file through one pass: writing it
+               to the device, or verifying the device against it.  Where
+               threads are available, parsing runs on a thread of its own,
+               up to PIPE_DEPTH blocks ahead of the USB transfers, so that
+               its cost hides behind the time spent waiting on the device.
+ Parameters  : char       Verify (1) vs. write (0).
+               char       If set, also check each line's checksum.
+ Returns     : ErrorCode  ERR_NONE on success, else various other values as
+                          defined in mphidflash.h.  A USB error takes
+                          precedence over a parse error found after it.
+ Notes       : USB device and hex file are both assumed already open and
+               valid; no checks performed here.  USB calls stay on the
+               calling thread.
+ ****************************************************************************/
+static ErrorCode hexPass(
+  const char pass,
+  const char check)
+{
+	ErrorCode status;
+#ifndef WIN
+	ParseJob  job;
+	pthread_t parser;
 #endif
+
+	packetSetup();
+	passBytes = 0;
+
+	sampleRows = sampleHits = sampleForced = 0;
+	sampleFirst = 1;
+	deferLen    = 0;
+	crcLen      = 0;
+
+#ifndef WIN
+	pipeHead   = pipeTail = 0;
+	pipeStatus = ERR_NONE;
+	job.pass   = pass;
+	job.check  = check;
+	pipeActive = 1;
+	if(!pthread_create(&parser,NULL,hexParseThread,&job)) {
+		status = hexDrain(pass);
+		(void)pthread_join(parser,NULL);
+		if(ERR_NONE == status) status = job.status;
+		pipeActive = 0;
+	} else {
+		pipeActive = 0;  /* No thread; parse and transfer in turn */
+		status     = hexParse(pass,check);
 	}
+#else
+	status = hexParse(pass,check);
+#endif
+
+	if(ERR_NONE == status) passTotal = passBytes;
+
+	/* A CRC check covers every block; nothing was sampled */
+	if((ERR_NONE == status) && pass && (sampleRate < 1.0) &&
+	   !(deviceExt & EXT_CRC32))
+		sampleReport();
+
+	return status;
+}
+
+/****************************************************************************
+ Function    : hexRanges
+ Description : Finds the memory the currently-open hex file will write to,
+               as ranges of whole pages.  Only programmable memory counts
+               (see verifyBlockProgrammable()).
+ Parameters  : Range*        Receives ranges, byte addresses, in file order
+                             with overlapping and adjacent ones merged.
+               int*          Receives number of ranges, or -1 if there are
+                             more than will fit.
+               int           Size of range array.
+               unsigned int  Page size in bytes, a power of two.
+ Returns     : ErrorCode     ERR_NONE on success, else as for hexWrite()
+                             (line checksums are checked).
+ Notes       : The device must have been queried; nothing is sent to it.
+               With a size of 0 (and a NULL array) the file is only
+               checked.
+ ****************************************************************************/
+ErrorCode hexRanges(
+  Range * const      range,
+  int * const        count,
+  const int          max,
+  const unsigned int page)
+{
+	ErrorCode status;
+
+	packetSetup();
+	scanRange = range;
+	scanCount = 0;
+	scanMax   = max;
+	scanPage  = page;
+	scanning  = 1;
+	passBytes = 0;
+	status    = hexParse(0,1);
+	scanning  = 0;
+	*count    = scanCount;
+	if(ERR_NONE == status) passTotal = passBytes;
+
+	return status;
+}
+
+/****************************************************************************
+ Function    : hexOps
+ Description : Parses the currently-open hex file into the block stream a
+               write would send, for building into a self-contained flasher
+               (pack.c).
+ Parameters  : unsigned char**  Receives the stream; valid until the next
+                                call.
+               size_t*          Receives its length in bytes.
+ Returns     : ErrorCode        ERR_NONE on success, else as for hexWrite()
+                                (line checksums are checked).
+ Notes       : Blocks are sized for the device's memory map (deviceQuery()
+               or deviceLoadMap()); nothing is sent to it.
+ ****************************************************************************/
+ErrorCode hexOps(
+  unsigned char ** const ops,
+  size_t * const         len)
+{
+	ErrorCode status;
+
+	packetSetup();
+	opsBufLen = 0;
+	packing   = 1;
+	status    = hexParse(0,1);
+	packing   = 0;
+	*ops      = opsBuf;
+	*len      = opsBufLen;
+
+	return status;
+}
+
+/****************************************************************************
+ Function    : hexUseOps
+ Description : Makes a block stream from hexOps() the image to write and
+               verify, in place of opening a hex file.  hexClose() when done.
+ Parameters  : unsigned char*      Block stream; must stay in place.
+               size_t              Its length in bytes.
+               unsigned long long  hexGetHash() of the file it came from.
+ Returns     : Nothing (void)
+ ****************************************************************************/
+void hexUseOps(
+  const unsigned char * const ops,
+  const size_t                len,
+  const unsigned long long    hash)
+{
+	opsData = ops;
+	opsLen  = len;
+	hexHash = hash;
+}
+
+/****************************************************************************
+ Function    : hexSetWindow
+ Description : Limits passes over the open hex file (write, verify, erase
+               ranges, block stream) to a window of addresses, found from
+               an address index of its records, without parsing the rest.
+ Parameters  : unsigned int  Start, a byte address as in the hex file.
+               unsigned int  End: the first address past the window.
+ Returns     : ErrorCode     ERR_NONE on success, else as for hexWrite()
+                             (line checksums are checked as the index is
+                             built).
+ Notes       : Lasts until hexClose().  A built-in image (hexUseOps()) is
+               always played back whole.
+ ****************************************************************************/
+ErrorCode hexSetWindow(
+  const unsigned int start,
+  const unsigned int end)
+{
+	ErrorCode status;
+
+	if(ERR_NONE != (status = hexIndexBuild()))
+		return status;
+	winStart  = start;
+	winEnd    = end;
+	winFirst  = indexFind(start);
+	windowed  = 1;
+	passTotal = 0;
 
 	return ERR_NONE;
 }
 
+/****************************************************************************
+ Function    : hexWindowReport
+ Description : Lists the lines of the open hex file that give the data in
+               the window set by hexSetWindow(), and where it has none.
+ Parameters  : None (void)
+ Returns     : Nothing (void)
+ Notes       : Where lines give the same bytes, the later one's are the
+               ones written, and the span says which it overrides.
+ ****************************************************************************/
+void hexWindowReport(void)
+{
+	IndexEntry   *e;
+	unsigned int  at,from,to,prev = 0,bytes = 0;
+	int           i,lines = 0,spans = 0;
+
+	/* Totals first, then the spans */
+	for(i=winFirst,at=winStart;(i < indexCount) &&
+	  ((e = &hexIndex[i])->addr < winEnd);i++) {
+		from = (e->addr > at) ? e->addr : at;
+		to   = (e->addr + e->len < winEnd) ? e->addr + e->len : winEnd;
+		if(e->addr + e->len <= winStart) continue;
+		lines++;
+		if(from < to) {
+			bytes += to - from;
+			at     = to;
+		}
+	}
+	(void)printf("Range %08x-%08x: %u bytes from %d line%s\n",winStart,
+	  winEnd - 1,bytes,lines,(lines == 1) ? "" : "s");
+
+	for(i=winFirst,at=winStart;(i < indexCount) &&
+	  ((e = &hexIndex[i])->addr < winEnd);i++) {
+		from = (e->addr > winStart) ? e->addr : winStart;
+		to   = (e->addr + e->len < winEnd) ? e->addr + e->len : winEnd;
+		if(from >= to) continue;
+		if((from > at) && (spans++ < WINDOW_LIST))
+			(void)printf("  %08x-%08x  no data\n",at,from - 1);
+		if(spans++ < WINDOW_LIST) {
+			(void)printf("  %08x-%08x  line %u",from,to - 1,e->line);
+			if(from < at) (void)printf(" (over line %u)",prev);
+			(void)putchar('\n');
+		}
+		if(to > at) at = to;
+		prev = e->line;
+	}
+	if((at < winEnd) && (spans++ < WINDOW_LIST))
+		(void)printf("  %08x-%08x  no data\n",at,winEnd - 1);
+	if(spans > WINDOW_LIST)
+		(void)printf("  (%d more)\n",spans - WINDOW_LIST);
+}
+
+/* Data bytes a pass will handle, for progress in the metrics file: as
+   counted on an earlier pass over the file (the erase scan, or the write
+   before a verify), else from its address index if one was built anyway
+   (for --range).  Nothing is parsed for it; 0 if not known yet. */
+static unsigned long hexDataBytes(void)
+{
+	const unsigned char *p;
+	unsigned long        bytes = 0;
+	unsigned int         from,to;
+	int                  i;
+
+	if(!metricsOn) return 0;
+	if(opsData) {
+		for(p=opsData;p < opsData + opsLen;p += 6 + p[5])
+			if(OP_BLOCK == p[0]) bytes += p[5];
+		return bytes;
+	}
+	if(passTotal) return passTotal;
+	if(!indexed)  return 0;
+	if(!windowed) {
+		for(i=0;i<indexCount;i++) bytes += hexIndex[i].len;
+		return bytes;
+	}
+	for(i=winFirst;(i < indexCount) && (hexIndex[i].addr < winEnd);i++) {
+		from = (hexIndex[i].addr > winStart) ? hexIndex[i].addr : winStart;
+		to   = (hexIndex[i].addr + hexIndex[i].len < winEnd) ?
+		  hexIndex[i].addr + hexIndex[i].len : winEnd;
+		if(from < to) bytes += to - from;
+	}
+	return bytes;
+}
+
+/****************************************************************************
+ Function    : hexWrite
+ Description : Writes (and optionally verifies) currently-open hex file to
+               device.
+ Parameters  : char       Verify (1) vs. write (0).
+ Returns     : ErrorCode  ERR_NONE on success, else various other values as
+                          defined in mphidflash.h.
+ Notes       : USB device and hex file are both assumed already open and
+               valid; no checks performed here.
+ ****************************************************************************/
+ErrorCode hexWrite(const char verify)
+{
+	ErrorCode          status;
+	unsigned long long start = traceClock();
+
+	metricsPhase(PHASE_WRITE,hexDataBytes());
+	EV_BEGIN("write pass",0);
+	status = hexPass(0,1);
+	EV_END();
+	telemetryPhase(PHASE_WRITE,traceClock() - start);
+
+	if((ERR_NONE == status) && verify) {
+		(void)printf("\nVerifying:");
+		start = traceClock();
+		metricsPhase(PHASE_VERIFY,hexDataBytes());
+		EV_BEGIN("verify pass",0);
+		status = hexPass(1,0);
+		EV_END();
+		telemetryPhase(PHASE_VERIFY,traceClock() - start);
+	}
+
+	return status;
+}
+
+/****************************************************************************
+ Function    : hexVerify
+ Description : Verifies currently-open hex file against device contents
+               without writing anything.
+ Parameters  : None (void)
+ Returns     : ErrorCode  ERR_NONE on success, ERR_VERIFY on mismatch, else
+                          various other values as defined in mphidflash.h.
+ Notes       : USB device and hex file are both assumed already open and
+               valid; no checks performed here.
+ ****************************************************************************/
+ErrorCode hexVerify(void)
+{
+	ErrorCode          status;
+	unsigned long long start = traceClock();
+
+	metricsPhase(PHASE_VERIFY,hexDataBytes());
+	EV_BEGIN("verify pass",0);
+	status = hexPass(1,1);
+	EV_END();
+	telemetryPhase(PHASE_VERIFY,traceClock() - start);
+
+	return status;
+}
+
 /****************************************************************************
  Function    : hexClose
- Description : Unmaps and closes previously-opened hex file.
+ Description : Unmaps (or frees, if it was compressed) and closes
+               previously-opened hex file.
  Parameters  : None (void)
  Returns     : Nothing (void)
  Notes       : File is assumed to have already been successfully opened
@@ -436,12 +1720,21 @@ ErrorCode hexWrite(const char verify)
  ****************************************************************************/
 void hexClose(void)
 {
-#ifndef WIN
-	(void)munmap(hexFileData,hexFileSize);
-#else
-	UnmapViewOfFile(hexFileData);
-#endif
-	hexFileData = NULL;
+	free(hexIndex);
+	hexIndex   = NULL;
+	indexCount = 0;
+	indexed    = windowed = 0;
+	passTotal  = 0;
+	if(opsData) {  /* Built in; nothing to close */
+		opsData = NULL;
+		return;
+	}
+	if(hexRecords) {
+		free(hexRecords);
+		hexRecords = NULL;
+	} else {
+		hexUnmap();
+	}
 	(void)close(hexFd);
 }
 
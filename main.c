@@ -38,20 +38,13 @@
 #include <string.h>
 #include "mphidflash.h"
 
-sQuery devQuery;
-
-extern unsigned char * usbBuf;  /* In usb code */
-
-/* Program's actions aren't necessarily performed in command-line order.
-   Bit flags keep track of options set or cleared during input parsing,
-   then are singularly checked as actions are performed.  Some actions
-   (such as writing) don't have corresponding bits here; certain non-NULL
-   string values indicate such actions should occur. */
-#define ACTION_UNLOCK (1 << 0)
-#define ACTION_ERASE  (1 << 1)
-#define ACTION_VERIFY (1 << 2)
-#define ACTION_RESET  (1 << 3)
-#define ACTION_SIGN   (1 << 4)
+#ifndef WIN
+extern char          * replayFile;  /* In usb-replay.c */
+extern char            replayConform;
+extern ErrorCode       replayCheck(void);
+extern char          * simFlash;    /* In usb-sim.c */
+extern char            simStock;
+#endif
 
 /****************************************************************************
  Function    : main
@@ -64,12 +57,46 @@ int main(
   char *argv[])
 {
 	char        *hexFile   = NULL,
+	            *traceFile = NULL,
+	            *script    = NULL,
+	            *serve     = NULL,   /* Socket to serve jobs on     */
+	            *server    = NULL,   /* Socket to send a job to     */
+	            *job       = NULL,   /* Commands for that job       */
+	            *appSerial = NULL,   /* Application serial number   */
+	            *logFile   = NULL,   /* Run log to append to        */
+	            *history   = NULL,   /* Run log to report on        */
+	            *audit     = NULL,   /* Known images to audit for   */
+	            *check     = NULL,   /* Hex files to check          */
+	            *mapFile   = NULL,   /* Memory map in place of device */
+	            *saveMap   = NULL,   /* Memory map to save          */
+	            *packFile  = NULL,   /* C source to pack image into */
+	            *faults    = NULL,   /* USB faults to inject        */
+	            *transport = NULL,   /* NULL = first to find device */
+	            *verifyFile = NULL,  /* Hex file to verify, not write */
+	            *dumpFile  = NULL,   /* File to save --range into   */
+	            *metricsFile = NULL, /* Live state for dashboards   */
+#ifdef EVTRACE
+	            *eventFile = NULL,
+#endif
 	             actions   = ACTION_VERIFY,
+	             watch     = 0,  /* Re-flash hex file when it changes */
+	             tune      = 0,  /* Calibrate and save device profile */
 	             eol;        /* 1 = last command-line arg */
 	ErrorCode    status    = ERR_NONE;
-	int          i;
+	int          i,
+	             slots     = 0,  /* Per bus segment; 0 = unscheduled */
+	             appWait   = 10000,  /* ms */
+	             sample    = 100,    /* Percent of blocks verified */
+	             seed      = -1,
+	             faultSeed = -1,
+	             jobs      = 0;      /* Files checked at once; 0 = CPUs */
 	unsigned int vendorID  = 0x04d8,
-	             productID = 0x003c;
+	             productID = 0x003c,
+	             rangeStart,
+	             rangeEnd  = 0,  /* Past the range; 0 = no --range */
+	             appVendor = 0,  /* 0 = don't wait for application */
+	             appProduct;
+	unsigned long long resetAt = 0;  /* traceClock() when reset sent */
 
 	const char * const errorString[ERR_EOL] = {
 		"Missing or malformed command-line argument",
@@ -86,7 +113,30 @@ int main(
 		"Unrecognized or invalid hex file syntax",
 		"Bad end-of-line checksum in hex file",
 		"Unsupported record type in hex file",
-		"Verify failed"
+		"Verify failed",
+		"Could not open USB trace file",
+		"USB operation timed out (device not responding)",
+		"Could not open script file",
+		"Could not write memory dump file",
+		"Flash server socket error (is the server running?)",
+		"Could not open event trace file",
+		"Application did not enumerate after reset",
+		"Could not open run log",
+		"Could not decompress hex file",
+		"Could not watch hex file's directory",
+		"Could not read or write memory map file",
+		"Could not write packed image source file",
+		"Built-in image is damaged",
+		"Device does not match the built-in image's memory map",
+		"Session does not conform to recording",
+		"Could not read list of known images",
+		"Not every device carries a known image",
+		"Could not read list of hex files to check",
+		"Not every hex file passed its checks",
+		"Device can't erase part of its memory, as --range with -w needs",
+		"Could not write metrics file",
+		"Could not read or write tuning profiles file",
+		"Flash server job request not received in time"
 	};
 
 	/* To create a sensible sequence of operations, all command-line
@@ -104,16 +154,217 @@ int main(
 	   The precedence of commands (first to last) is:
 
 	   -v and -p <hex>  USB vendor and/or product IDs
+	   --history <file> Report on run log in place of all below
+	   --audit <file>   Identify image on every device in place of all
+	                    below
+	   --check <file>   Check hex files without a device in place of all
+	                    below
+	   --trace <file>   Record USB session
+	   --metrics <file> Keep live metrics file
+	   --tune           Calibrate device and save its profile; else
+	                    load any profile saved for it
+	   --probe          Measure link latency and throughput
+	   --sched <n>      Wait for bus segment slot before working
+	   --serve <sock>   Serve jobs on socket in place of all below
+	   --connect <sock> <cmds>
+	                    Send job to server in place of all below
+	   --watch          Flash hex file each time it changes, with the
+	                    options below, in place of the rest
+	   --map <file>     Memory map in place of device, for...
+	   --pack <file>    Pack -w image into C source in place of all below
+	   --save-map <file>
+	                    Save device's memory map
+	   --script <file>  Run script commands in place of those below
 	   -u               Unlock configuration memory
 	   -e               Erase program memory
 	   -n               No verify after write
+	   --range <s:e>    Limit -w or --verify to addresses s to e
 	   -w <file>        Write program memory
+	   --verify <file>  Verify program memory, in place of -w
+	   --dump <file>    Save --range of memory
 	   -s               Sign code
-	   -r               Reset */
+	   -r               Reset
+	   --log <file>     Append record of run to log
+	   --app <vid:pid>  Wait for application to enumerate after reset */
+
+#ifdef PACKED
+	/* A self-contained flasher writes its built-in image, as the options
+	   it was packed with say, plus any given here. */
+	actions = packImage.actions;
+#endif
 
 	for(i=1;(i < argc) && (ERR_NONE == status);i++) {
 		eol = (i >= (argc - 1));
-		if(!strncasecmp(argv[i],"-v",2)) {
+		if(!strcasecmp(argv[i],"--trace")) {
+			if(eol)
+				status    = ERR_CMD_ARG;
+			else
+				traceFile = argv[++i];
+#ifdef EVTRACE
+		} else if(!strcasecmp(argv[i],"--events")) {
+			if(eol)
+				status    = ERR_CMD_ARG;
+			else
+				eventFile = argv[++i];
+#endif
+		} else if(!strcasecmp(argv[i],"--metrics")) {
+			if(eol)
+				status      = ERR_CMD_ARG;
+			else
+				metricsFile = argv[++i];
+		} else if(!strcasecmp(argv[i],"--log")) {
+			if(eol)
+				status  = ERR_CMD_ARG;
+			else
+				logFile = argv[++i];
+		} else if(!strcasecmp(argv[i],"--station")) {
+			if(eol)
+				status  = ERR_CMD_ARG;
+			else
+				telemetryStation = argv[++i];
+		} else if(!strcasecmp(argv[i],"--history")) {
+			if(eol)
+				status  = ERR_CMD_ARG;
+			else
+				history = argv[++i];
+		} else if(!strcasecmp(argv[i],"--map")) {
+			if(eol)
+				status   = ERR_CMD_ARG;
+			else
+				mapFile  = argv[++i];
+		} else if(!strcasecmp(argv[i],"--save-map")) {
+			if(eol)
+				status   = ERR_CMD_ARG;
+			else
+				saveMap  = argv[++i];
+		} else if(!strcasecmp(argv[i],"--pack")) {
+			if(eol)
+				status   = ERR_CMD_ARG;
+			else
+				packFile = argv[++i];
+		} else if(!strcasecmp(argv[i],"--probe")) {
+			actions |= ACTION_PROBE;
+		} else if(!strcasecmp(argv[i],"--tune")) {
+			tune     = 1;
+		} else if(!strcasecmp(argv[i],"--profiles")) {
+			if(eol)
+				status   = ERR_CMD_ARG;
+			else
+				tuneFile = argv[++i];
+		} else if(!strcasecmp(argv[i],"--no-profile")) {
+			tuneOff  = 1;
+		} else if(!strcasecmp(argv[i],"--erase-timeout")) {
+			if(eol || (1 != sscanf(argv[++i],"%d",&eraseTimeout)) ||
+			   (eraseTimeout < 1))
+				status = ERR_CMD_ARG;
+		} else if(!strcasecmp(argv[i],"--script")) {
+			if(eol)
+				status = ERR_CMD_ARG;
+			else
+				script = argv[++i];
+#ifndef WIN
+		} else if(!strcasecmp(argv[i],"--serve")) {
+			if(eol)
+				status  = ERR_CMD_ARG;
+			else
+				serve   = argv[++i];
+		} else if(!strcasecmp(argv[i],"--connect")) {
+			if(i >= (argc - 2)) {
+				status  = ERR_CMD_ARG;
+			} else {
+				server  = argv[++i];
+				job     = argv[++i];
+			}
+		} else if(!strcasecmp(argv[i],"--audit")) {
+			if(eol)
+				status  = ERR_CMD_ARG;
+			else
+				audit   = argv[++i];
+		} else if(!strcasecmp(argv[i],"--check")) {
+			if(eol)
+				status  = ERR_CMD_ARG;
+			else
+				check   = argv[++i];
+		} else if(!strcasecmp(argv[i],"--jobs")) {
+			if(eol || (1 != sscanf(argv[++i],"%d",&jobs)) || (jobs < 1))
+				status  = ERR_CMD_ARG;
+#endif
+#ifdef __linux__
+		} else if(!strcasecmp(argv[i],"--watch")) {
+			watch = 1;
+#endif
+		} else if(!strcasecmp(argv[i],"--app")) {
+			if(eol || (2 != sscanf(argv[++i],"%x:%x",&appVendor,
+			  &appProduct)) || !appVendor)
+				status   = ERR_CMD_ARG;
+			else
+				actions |= ACTION_RESET;
+		} else if(!strcasecmp(argv[i],"--app-serial")) {
+			if(eol)
+				status    = ERR_CMD_ARG;
+			else
+				appSerial = argv[++i];
+		} else if(!strcasecmp(argv[i],"--app-timeout")) {
+			if(eol || (1 != sscanf(argv[++i],"%d",&appWait)) ||
+			   (appWait < 1))
+				status = ERR_CMD_ARG;
+		} else if(!strcasecmp(argv[i],"--verify-sample")) {
+			if(eol || (1 != sscanf(argv[++i],"%d",&sample)) ||
+			   (sample < 1) || (sample > 100))
+				status = ERR_CMD_ARG;
+		} else if(!strcasecmp(argv[i],"--verify-seed")) {
+			if(eol || (1 != sscanf(argv[++i],"%d",&seed)) || (seed < 0))
+				status = ERR_CMD_ARG;
+		} else if(!strcasecmp(argv[i],"--faults")) {
+			if(eol)
+				status = ERR_CMD_ARG;
+			else
+				faults = argv[++i];
+		} else if(!strcasecmp(argv[i],"--fault-seed")) {
+			if(eol || (1 != sscanf(argv[++i],"%d",&faultSeed)) ||
+			   (faultSeed < 0))
+				status = ERR_CMD_ARG;
+		} else if(!strcasecmp(argv[i],"--no-extensions")) {
+			deviceExtensions = 0;
+		} else if(!strcasecmp(argv[i],"--sched")) {
+			if(eol || (1 != sscanf(argv[++i],"%d",&slots)) || (slots < 1))
+				status = ERR_CMD_ARG;
+		} else if(!strcasecmp(argv[i],"--range")) {
+			if(eol || (2 != sscanf(argv[++i],"%x:%x",&rangeStart,
+			  &rangeEnd)) || (rangeEnd <= rangeStart))
+				status     = ERR_CMD_ARG;
+		} else if(!strcasecmp(argv[i],"--verify")) {
+			if(eol)
+				status     = ERR_CMD_ARG;
+			else
+				verifyFile = argv[++i];
+		} else if(!strcasecmp(argv[i],"--dump")) {
+			if(eol)
+				status   = ERR_CMD_ARG;
+			else
+				dumpFile = argv[++i];
+		} else if(!strcasecmp(argv[i],"--transport")) {
+			if(eol)
+				status    = ERR_CMD_ARG;
+			else
+				transport = argv[++i];
+#ifndef WIN
+		} else if(!strcasecmp(argv[i],"--replay")) {
+			if(eol)
+				status     = ERR_CMD_ARG;
+			else
+				replayFile = argv[++i];
+		} else if(!strcasecmp(argv[i],"--conform")) {
+			replayConform = 1;
+		} else if(!strcasecmp(argv[i],"--sim-flash")) {
+			if(eol)
+				status   = ERR_CMD_ARG;
+			else
+				simFlash = argv[++i];
+		} else if(!strcasecmp(argv[i],"--sim-stock")) {
+			simStock = 1;
+#endif
+		} else if(!strncasecmp(argv[i],"-v",2)) {
 			if(eol || (1 != sscanf(argv[++i],"%x",&vendorID)))
 				status = ERR_CMD_ARG;
 		} else if(!strncasecmp(argv[i],"-p",2)) {
@@ -122,7 +373,7 @@ int main(
 		} else if(!strncasecmp(argv[i],"-u",2)) {
 			actions |= ACTION_UNLOCK;
 		} else if(!strncasecmp(argv[i],"-e",2)) {
-			actions |= ACTION_ERASE;
+			actions |= ACTION_ERASE | ACTION_WIPE;
 		} else if(!strncasecmp(argv[i],"-n",2)) {
 			actions &= ~ACTION_VERIFY;
 		} else if(!strncasecmp(argv[i],"-w",2)) {
@@ -144,6 +395,7 @@ int main(
 "-------------------------------------------------------------------------\n"
 "-w <file>  Write hex file to device (will erase first)      None\n"
 "-e         Erase device code space (implicit if -w)         No erase\n"
+"           With -w, erase all of it, not just what's written\n"
 "-r         Reset device on program exit                     No reset\n"
 "-n         No verify after write                            Verify on\n"
 "-u         Unlock configuration memory before erase/write   Config locked\n"
@@ -151,98 +403,316 @@ int main(
 "           versions of the bootloader.\n"
 "-v <hex>   USB device vendor ID                             %04x\n"
 "-p <hex>   USB device product ID                            %04x\n"
-"-h or -?   Help\n", VERSION_MAIN, VERSION_SUB, vendorID, productID);
+"-h or -?   Help\n"
+"--verify <file>\n"
+"           Verify device against hex file, writing nothing  None\n"
+"--range <start>:<end>\n"
+"           Limit -w or --verify to hex file addresses from  Whole file\n"
+"           start up to end; list the lines giving the data\n"
+"--dump <file>\n"
+"           Save --range of device memory as raw binary      None\n"
+"--trace <file>\n"
+"           Record all USB reports to binary trace file      No trace\n"
+#ifdef EVTRACE
+"--events <file>\n"
+"           Write event timeline as Chrome trace JSON        No events\n"
+#endif
+"--probe    Measure USB round-trip time and report rate      No probe\n"
+"--tune     Calibrate device; save profile used from then on No tuning\n"
+"--profiles <file>\n"
+#ifndef WIN
+"           Tuning profiles file             ~/.mphidflash-profiles\n"
+#else
+"           Tuning profiles file       %%APPDATA%%\\mphidflash-profiles\n"
+#endif
+"--no-profile\n"
+"           Don't load device's tuning profile               Load if saved\n"
+"--transport <name>\n"
+"           Reach device by one of: %-24s First found\n"
+"--erase-timeout <ms>\n"
+"           Time allowed for erase to complete               %d\n"
+"--no-extensions\n"
+"           Use only the stock bootloader protocol           Use if offered\n"
+"--sched <n>\n"
+"           Limit concurrent jobs per shared USB hub/port    Unlimited\n"
+"--verify-sample <percent>\n"
+"           Verify only a random sample of blocks            100\n"
+"--verify-seed <n>\n"
+"           Seed choosing sampled blocks                     Random\n"
+"--faults <spec>\n"
+"           Inject USB faults (percent of reports), e.g.     None\n"
+"           drop=1,delay=2:80,short=1,unplug=0.1,corrupt=1\n"
+"--fault-seed <n>\n"
+"           Seed choosing faulty reports                     Random\n"
+"--app <vid:pid>\n"
+"           Reset, then time application's enumeration       No wait\n"
+"--app-serial <serial>\n"
+"           Application must also have this serial number    Any\n"
+"--app-timeout <ms>\n"
+"           Time allowed for application to enumerate        %d\n"
+"--script <file>\n"
+"           Run commands from file in one device session     None\n"
+"--save-map <file>\n"
+"           Save device's memory map to file                 None\n"
+"--map <file>\n"
+"           Use saved memory map in place of a device        Device\n"
+"--pack <file>\n"
+"           Write -w image for --map as C source for a       None\n"
+"           self-contained flasher (make mphidflash-packed)\n"
+#ifdef __linux__
+"--watch    Keep device open; re-flash -w file on change     No watch\n"
+#endif
+"--log <file>\n"
+"           Append timing record of run to log file          No log\n"
+"--metrics <file>\n"
+"           Keep live Prometheus metrics in file             None\n"
+"--station <name>\n"
+"           Station name recorded in log                     Host name\n"
+"--history <file>\n"
+"           Report rolling times and slow runs from log      None\n"
+#ifndef WIN
+"--serve <socket>\n"
+"           Keep device open, taking jobs on Unix socket     No server\n"
+"--connect <socket> <commands>\n"
+"           Run ';'-separated script commands on server      None\n"
+"--audit <file>\n"
+"           Read all devices; name known hex file each has   No audit\n"
+"--check <file>\n"
+"           Check listed hex files (and fit to maps)         No check\n"
+"--jobs <n> Files checked at once                            Processors\n"
+#endif
+#ifndef WIN
+"--replay <file>\n"
+"           Play back trace file in place of device          None\n"
+"--conform  Fail if reports sent differ from --replay file   Report only\n"
+"--sim-flash <file>\n"
+"           Keep simulated device's memory in file           Erased\n"
+"--sim-stock\n"
+"           Simulate stock bootloader (no extensions)        Extensions\n"
+#endif
+, VERSION_MAIN, VERSION_SUB, vendorID, productID, usbTransportName(),
+  eraseTimeout, appWait);
 			return 0;
 		} else {
 			status = ERR_CMD_UNKNOWN;
 		}
 	}
 
-	/* After successful command-line parsage, find/open USB device. */
+#ifdef PACKED
+	hexFile = (char *)packImage.name;
+	if(rangeEnd) status = ERR_CMD_ARG;  /* Image is written whole */
+#endif
+
+	/* A range is of a hex file or of memory to dump, and a write to
+	   part of the device can't erase the whole of it. */
+	if(verifyFile && hexFile)
+		status = ERR_CMD_ARG;
+	if((rangeEnd && !hexFile && !verifyFile && !dumpFile) ||
+	   (rangeEnd && ((actions & ACTION_WIPE) || watch)) ||
+	   (dumpFile && !rangeEnd))
+		status = ERR_CMD_ARG;
+	/* Tuning needs the device itself, and gets it only in a plain run */
+	if(tune && (mapFile || serve || server || watch || history || audit ||
+	   check || tuneOff))
+		status = ERR_CMD_ARG;
+
+#ifndef WIN
+	/* Playing back a trace, or simulating a device, says which
+	   transport to use without --transport */
+	if(!transport && replayFile)             transport = "replay";
+	if(!transport && (simFlash || simStock)) transport = "sim";
+#endif
+	if((ERR_NONE == status) && transport)
+		status = usbSelect(transport);
+
+	/* Each sampled run checks different blocks unless told otherwise;
+	   the seed is printed so that any run can be repeated. */
+	if(sample < 100)
+		hexSetSample(sample,(seed >= 0) ? (unsigned int)seed :
+		  (unsigned int)(traceClock() / 1000) & 0x7fffffff);
+	/* Faults likewise */
+	if((ERR_NONE == status) && faults)
+		status = faultSet(faults,(faultSeed >= 0) ? (unsigned int)faultSeed :
+		  (unsigned int)(traceClock() / 1000) & 0x7fffffff);
+
+	/* A script replaces the write/erase/etc. options rather than
+	   mixing with them, and is checked in full before the device is
+	   touched. */
+	if((ERR_NONE == status) && script) {
+		if(hexFile || verifyFile || dumpFile ||
+		  (actions & (ACTION_UNLOCK | ACTION_ERASE |
+		  ACTION_SIGN | ACTION_RESET)))
+			status = ERR_CMD_ARG;
+		else
+			status = scriptRun(script,0);
+	}
+
+	/* After successful command-line parsage, start trace (if requested)
+	   before anything is sent, then find/open USB device. */
+
+	/* Reporting on the run log needs no device */
+	if((ERR_NONE == status) && history)
+		status = telemetryReport(history);
+
+	/* Nor does packing an image, given a saved memory map to pack it
+	   for; the image is checked and packed, not written. */
+	if((ERR_NONE == status) && packFile &&
+	   (!hexFile || !mapFile || script))
+		status = ERR_CMD_ARG;
+	if((ERR_NONE == status) && mapFile &&
+	   (ERR_NONE == (status = deviceLoadMap(mapFile)))) {
+		deviceInfo();
+		(void)putchar('\n');
+	}
+	if((ERR_NONE == status) && packFile &&
+	   (ERR_NONE == (status = hexOpen(hexFile)))) {
+		status = packWrite(packFile,hexFile,actions & ~ACTION_PROBE);
+		hexClose();
+	}
+	/* Or, for a range, listing the lines that give the data in it */
+	if((ERR_NONE == status) && mapFile && rangeEnd && !packFile &&
+	   (hexFile || verifyFile) &&
+	   (ERR_NONE == (status = hexOpen(hexFile ? hexFile : verifyFile)))) {
+		if(ERR_NONE == (status = hexSetWindow(rangeStart,rangeEnd)))
+			hexWindowReport();
+		hexClose();
+	}
+
+	if((ERR_NONE == status) && traceFile && !server && !history && !audit &&
+	   !check)
+		status = traceOpen(traceFile);
+#ifdef EVTRACE
+	if((ERR_NONE == status) && eventFile)
+		status = evtraceOpen(eventFile);
+#endif
+	if((ERR_NONE == status) && metricsFile && !server && !history &&
+	   !audit && !check)
+		status = metricsOpen(metricsFile);
+
+#ifndef WIN
+	/* A job for a flash server needs no device here at all, and the
+	   server opens (and after a reset, reopens) the device itself. */
+	if((ERR_NONE == status) && server)
+		status = serveClient(server,job);
+	if((ERR_NONE == status) && serve)
+		status = serveRun(serve,vendorID,productID);
+#endif
+#ifdef __linux__
+	/* Likewise watch mode, which holds the device open between
+	   flashes and reopens it after a reset. */
+	if((ERR_NONE == status) && watch) {
+		if(!hexFile || script)
+			status = ERR_CMD_ARG;
+		else
+			status = watchRun(hexFile,vendorID,productID,actions);
+	}
+#endif
+#ifndef WIN
+	/* An audit opens every device, each in a process of its own */
+	if((ERR_NONE == status) && audit)
+		status = auditRun(audit,vendorID,productID);
+	/* Checking hex files needs no device at all */
+	if((ERR_NONE == status) && check && !audit)
+		status = checkRun(check,jobs);
+#endif
 
-	if((ERR_NONE == status) &&
+	if((ERR_NONE == status) && !serve && !server && !history && !watch &&
+	   !mapFile && !audit && !check &&
 	   (ERR_NONE == (status = usbOpen(vendorID,productID)))) {
 
 		/* And start doing stuff... */
 
-		(void)printf("USB HID device found\n");
-		usbBuf[0] = QUERY_DEVICE;
-		if(ERR_NONE == (status = usbWrite(1,1))) {
-			memcpy( &devQuery, usbBuf, 64 );
-			i = 0;
-			while ( devQuery.mem[ i ].Type != TypeEndOfTypeList ) i++;
-			devQuery.memBlocks = i;
-			
-            (void)printf("Device family: ");
- 			switch (devQuery.DeviceFamily)
-				{
-				case DEVICE_FAMILY_PIC18:
-					hexSetBytesPerAddress(1);
-					(void)printf("PIC18\n");
-					break;
-				case DEVICE_FAMILY_PIC24:
-					hexSetBytesPerAddress(2);
-					(void)printf("PIC24\n");
-					break;
-				case DEVICE_FAMILY_PIC32:
-					hexSetBytesPerAddress(1);
-					(void)printf("PIC32\n");
-					break;
-				default:
-					hexSetBytesPerAddress(1);
-					(void)printf("Unknown. Bytes per address set to 1.\n");
-					break;
-			}
-            (void)printf("Memory");   
-            for ( i = 0; i < devQuery.memBlocks; i++ ) {
-			  devQuery.mem[i].Address = convertEndian(devQuery.mem[i].Address);
-			  devQuery.mem[i].Length = convertEndian(devQuery.mem[i].Length);
-			  if(devQuery.mem[i].Type == TypeProgramMemory) {
-                (void)printf(": %d bytes free, addr: %04x, total %d\n",devQuery.mem[i].Length*hexGetBytesPerAddress(),devQuery.mem[i].Address,devQuery.memBlocks);  
-			    }
-			}
-		}
+		(void)printf("USB HID device found (%s)\n",usbTransportName());
+		if(ERR_NONE == (status = deviceQuery()))
+			deviceInfo();
 		(void)putchar('\n');
+		telemetryDevice();
+
+		if((ERR_NONE == status) && saveMap)
+			status = deviceSaveMap(saveMap);
+
+		/* Calibrate for this kind of device, or use what an earlier
+		   calibration found */
+		if((ERR_NONE == status) && tune) {
+			EV_BEGIN("tune",0);
+			status = tuneRun(vendorID,productID);
+			EV_END();
+			(void)putchar('\n');
+		} else if(ERR_NONE == status) {
+			status = tuneLoad(vendorID,productID);
+		}
 
-		if((ERR_NONE == status) && (actions & ACTION_UNLOCK)) {
-			(void)puts("Unlocking configuration memory...");
-			usbBuf[0] = UNLOCK_CONFIG;
-			usbBuf[1] = UNLOCKCONFIG;
-			status    = usbWrite(2,0);
+		if((ERR_NONE == status) && (actions & ACTION_PROBE)) {
+			EV_BEGIN("probe",0);
+			status = probeRun();
+			EV_END();
+			(void)putchar('\n');
 		}
-		// disable all configuration blocks in devQuery if locked
-		if ( !( actions & ACTION_UNLOCK ) ) {
-			for ( i = 0; i < devQuery.memBlocks; i++ )
-			    if ( devQuery.mem[ i ].Type == TypeConfigWords )
-				devQuery.mem[ i ].Type = 0;
+
+		/* When many boards are flashed at once, wait for our turn
+		   on the part of the bus this one shares with others. */
+		if((ERR_NONE == status) && slots) {
+			EV_BEGIN("sched wait",0);
+			schedAcquire(slots);
+			EV_END();
 		}
 
+		/* Time logged is the board's own, not the wait for the bus */
+		telemetryStart();
+
+		if((ERR_NONE == status) && script) {
+			EV_BEGIN("script",0);
+			status = scriptRun(script,1);
+			EV_END();
+		}
+
+		if((ERR_NONE == status) && (actions & ACTION_UNLOCK))
+			status = deviceUnlock();
+
 		/* Although the next actual operation is ACTION_ERASE,
 		   if we anticipate hex-writing in a subsequent step,
                    attempt opening file now so we can display any error
 		   message quickly rather than waiting through the whole
 		   erase operation (it's usually a simple filename typo). */
+		if(verifyFile)
+			hexFile = verifyFile;
 		if((ERR_NONE == status) && hexFile &&
+#ifdef PACKED
+		   (ERR_NONE != (status = packOpen())))
+#else
 		   (ERR_NONE != (status = hexOpen(hexFile))))
+#endif
 			hexFile = NULL;  /* Open or mmap error */
 
+		/* A write to part of the image erases only the pages it
+		   touches, so it takes in the rest of each. */
+		if((ERR_NONE == status) && hexFile && rangeEnd) {
+			if(verifyFile)
+				status = hexSetWindow(rangeStart,rangeEnd);
+			else if(!(deviceExt & EXT_ERASE_RANGE))
+				status = ERR_RANGE_ERASE;
+			else
+				status = hexSetWindow(rangeStart & ~(devicePage - 1),
+				  (rangeEnd + devicePage - 1) & ~(devicePage - 1));
+			if(ERR_NONE == status)
+				hexWindowReport();
+		}
+
+		/* A device that can erase by range needs only the pages
+		   being written erased, unless told to erase it all. */
 		if((ERR_NONE == status) && (actions & ACTION_ERASE)) {
-			(void)puts("Erasing...");
-			usbBuf[0] = ERASE_DEVICE;
-			status    = usbWrite(1,0);
-			/* The query here isn't needed for any technical
-			   reason, just makes the presentation better.
-			   The ERASE_DEVICE command above returns
-			   immediately...subsequent commands can be made
-			   but will pause until the erase cycle completes.
-			   So this query just keeps the "Writing" message
-			   or others from being displayed prematurely. */
-			usbBuf[0] = QUERY_DEVICE;
-			status    = usbWrite(1,1);
+			if(hexFile && !(actions & ACTION_WIPE))
+				status = deviceEraseImage();
+			else
+				status = deviceErase();
 		}
 
 		if(hexFile) {
-			if(ERR_NONE == status) {
+			if((ERR_NONE == status) && verifyFile) {
+			  (void)printf("Verifying hex file '%s':",hexFile);
+			  status = hexVerify();
+			  (void)putchar('\n');
+			} else if(ERR_NONE == status) {
 			  (void)printf("Writing hex file '%s':",hexFile);
 			  status = hexWrite((actions & ACTION_VERIFY) != 0);
 			  (void)putchar('\n');
@@ -250,21 +720,48 @@ int main(
 			hexClose();
 		}
 
-		if((ERR_NONE == status) && (actions & ACTION_SIGN)) {
-			(void)puts("Signing flash...");
-			usbBuf[0] = SIGN_FLASH;
-			status = usbWrite(1,0);
-		}
+		if((ERR_NONE == status) && dumpFile)
+			status = deviceDump(rangeStart / hexGetBytesPerAddress(),
+			  rangeEnd - rangeStart,dumpFile);
+
+		if((ERR_NONE == status) && (actions & ACTION_SIGN))
+			status = deviceSign();
 
 		if((ERR_NONE == status) && (actions & ACTION_RESET)) {
-			(void)puts("Resetting device...");
-			usbBuf[0] = RESET_DEVICE;
-			status = usbWrite(1,0);
+			resetAt = traceClock();
+			status  = deviceReset();
 		}
 
+		schedRelease();
+#ifndef WIN
+		if((ERR_NONE == status) && replayFile)
+			status = replayCheck();
+#endif
 		usbClose();
+
+		/* Failed runs are logged too; a log error only shows if
+		   nothing else went wrong. */
+		if(logFile && (ERR_NONE != telemetryLog(logFile,status)) &&
+		   (ERR_NONE == status))
+			status = ERR_LOG_OPEN;
+
+		/* Rather than a fixed sleep in the calling script, wait
+		   for the application to come up, timing its boot. */
+		if((ERR_NONE == status) && appVendor)
+			status = usbWaitApp(appVendor,appProduct,appSerial,appWait,
+			  resetAt);
 	}
 
+	faultReport(status);
+	/* Servers and watchers count each job or flash as they finish it */
+	if(!serve && !watch)
+		metricsEnd(status);
+	metricsClose();
+	traceClose();
+#ifdef EVTRACE
+	evtraceClose();
+#endif
+
 	if(ERR_NONE != status) {
 		(void)printf("%s Error",argv[0]);
 		if(status <= ERR_EOL)
@@ -0,0 +1,318 @@
+/****************************************************************************
+ File        : metrics.c
+ Description : Live state for fleet dashboards.  With --metrics <file>, a
+               Prometheus text-format file (as read by node_exporter's
+               textfile collector, or served by any web server) is kept up
+               to date while the program runs, whether for one run or
+               under --serve or --watch: the phase, data bytes done in the
+               pass and its total, throughput, USB errors, the last
+               round-trip time and when the device last answered, so that
+               a stalled station shows at once.
+
+               The USB side only stores to counters, each changed by that
+               thread alone, with atomic stores and no locks.  A writer
+               thread loads them every METRICS_MS and rewrites the file:
+               to a temporary file beside it, renamed over it, so that a
+               reader never sees half a file.  Throughput is worked out
+               there, from the bytes done since the last rewrite.  Windows
+               has no writer thread; the file is rewritten in line instead,
+               at most every METRICS_MS and at each change of phase.
+
+ License     : This file is part of 'mphidflash' program.
+
+               'mphidflash' is free software: you can redistribute it and/or
+               modify it under the terms of the GNU General Public License
+               as published by the Free Software Foundation, either version
+               3 of the License, or (at your option) any later version.
+
+               'mphidflash' is distributed in the hope that it will be useful,
+               but WITHOUT ANY WARRANTY; without even the implied warranty
+               of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+               See the GNU General Public License for more details.
+
+               You should have received a copy of the GNU General Public
+               License along with 'mphidflash' source code.  If not,
+               see <http://www.gnu.org/licenses/>.
+
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef WIN
+#include <unistd.h>
+#include <pthread.h>
+#define GET(v)    __atomic_load_n(&(v),__ATOMIC_RELAXED)
+#define SET(v,x)  __atomic_store_n(&(v),(x),__ATOMIC_RELAXED)
+#else
+#include <windows.h>
+#define GET(v)    (v)
+#define SET(v,x)  ((v) = (x))
+#endif
+
+#include "mphidflash.h"
+
+#define METRICS_MS  500  /* Time between rewrites of the file            */
+
+/* Phases as timed for the run log, then the states between them */
+enum { STATE_IDLE = PHASE_COUNT, STATE_DONE, STATE_FAILED, STATES };
+
+static const char * const stateName[STATES] = {
+	"erase","write","verify","idle","done","failed"
+};
+
+char                      metricsOn = 0;
+static char              *metricsPath = NULL,
+                         *metricsTemp = NULL;
+static int                state = STATE_IDLE;
+static unsigned long long bytesDone,bytesTotal, /* This pass             */
+                          bytesAll  = 0,        /* Every pass            */
+                          lastRtt   = 0,        /* ns                    */
+                          lastSeen  = 0,        /* traceClock()          */
+                          usbErrors = 0,
+                          runs      = 0,
+                          runsFailed = 0;
+
+#ifndef WIN
+static int                stopping;
+static pthread_t          writer;
+#else
+static unsigned long long lastWrite = 0;
+#endif
+
+/* One metric, with its help and type lines */
+static void metricsLine(
+  FILE * const       fp,
+  const char * const name,
+  const char * const type,
+  const char * const help,
+  const double       value)
+{
+	(void)fprintf(fp,"# HELP mphidflash_%s %s\n# TYPE mphidflash_%s %s\n"
+	  "mphidflash_%s %.15g\n",name,help,name,type,name,value);
+}
+
+/* Write the file afresh from the counters; 1 on success */
+static int metricsWrite(void)
+{
+	static unsigned long long prevAll = 0,prevAt = 0;
+	unsigned long long        now  = traceClock(),all = GET(bytesAll),
+	                          seen = GET(lastSeen);
+	double                    rate = 0.0;
+	FILE                     *fp;
+	int                       i,s = GET(state),ok;
+
+	if(prevAt && (now > prevAt))
+		rate = (all - prevAll) * 1e9 / (now - prevAt);
+	prevAll = all;
+	prevAt  = now;
+
+	if(!(fp = fopen(metricsTemp,"w")))
+		return 0;
+	(void)fprintf(fp,"# HELP mphidflash_phase Phase the run is in.\n"
+	  "# TYPE mphidflash_phase gauge\n");
+	for(i=0;i<STATES;i++)
+		(void)fprintf(fp,"mphidflash_phase{phase=\"%s\"} %d\n",stateName[i],
+		  i == s);
+	metricsLine(fp,"bytes_done","gauge",
+	  "Data bytes written or verified so far in this phase.",
+	  (double)GET(bytesDone));
+	metricsLine(fp,"bytes_total","gauge",
+	  "Data bytes this phase writes or verifies; 0 if not known.",
+	  (double)GET(bytesTotal));
+	metricsLine(fp,"throughput_bytes_per_second","gauge",
+	  "Data bytes per second since the file was last written.",rate);
+	metricsLine(fp,"transferred_bytes_total","counter",
+	  "Data bytes written or verified, all phases.",(double)all);
+	metricsLine(fp,"usb_errors_total","counter",
+	  "USB operations failed (timeouts included).",
+	  (double)GET(usbErrors));
+	metricsLine(fp,"last_rtt_seconds","gauge",
+	  "Round-trip time of the last command answered.",GET(lastRtt) / 1e9);
+	metricsLine(fp,"last_response_timestamp_seconds","gauge",
+	  "When the device last answered, as Unix time; 0 if never.",
+	  seen ? (double)time(NULL) - (now - seen) / 1e9 : 0.0);
+	metricsLine(fp,"runs_total","counter",
+	  "Runs, jobs or flashes finished.",(double)GET(runs));
+	metricsLine(fp,"runs_failed_total","counter",
+	  "Of those, the ones that failed.",(double)GET(runsFailed));
+	ok = !ferror(fp);
+	if(fclose(fp) || !ok) {
+		(void)remove(metricsTemp);
+		return 0;
+	}
+
+#ifndef WIN
+	return !rename(metricsTemp,metricsPath);
+#else
+	return MoveFileEx(metricsTemp,metricsPath,MOVEFILE_REPLACE_EXISTING) != 0;
+#endif
+}
+
+#ifndef WIN
+/* Writer thread: rewrite the file every METRICS_MS until told to stop */
+static void *metricsWriter(void *arg)
+{
+	int i;
+
+	while(!__atomic_load_n(&stopping,__ATOMIC_ACQUIRE)) {
+		(void)metricsWrite();
+		for(i=0;(i < METRICS_MS / 10) &&
+		  !__atomic_load_n(&stopping,__ATOMIC_ACQUIRE);i++)
+			(void)usleep(10000);
+	}
+
+	return NULL;
+}
+
+#define metricsTick(force)
+#else
+/* Rewrite the file in line, if it's due or forced */
+static void metricsTick(const char force)
+{
+	unsigned long long now = traceClock();
+
+	if(force || (now - lastWrite >= METRICS_MS * 1000000ULL)) {
+		(void)metricsWrite();
+		lastWrite = now;
+	}
+}
+#endif
+
+/****************************************************************************
+ Function    : metricsOpen
+ Description : Starts keeping a metrics file up to date.
+ Parameters  : char*      File name; its directory must be writable, for
+                          the temporary file renamed over it.
+ Returns     : ErrorCode  ERR_NONE on success, ERR_METRICS_OPEN if the file
+                          can't be written.
+ ****************************************************************************/
+ErrorCode metricsOpen(const char * const filename)
+{
+	if(!(metricsTemp = malloc(strlen(filename) + 5)))
+		return ERR_METRICS_OPEN;
+	(void)sprintf(metricsTemp,"%s.tmp",filename);
+	metricsPath = (char *)filename;
+
+	if(!metricsWrite()) {
+		free(metricsTemp);
+		metricsTemp = NULL;
+		return ERR_METRICS_OPEN;
+	}
+
+#ifndef WIN
+	stopping = 0;
+	if(pthread_create(&writer,NULL,metricsWriter,NULL)) {
+		free(metricsTemp);
+		metricsTemp = NULL;
+		return ERR_METRICS_OPEN;
+	}
+#endif
+	metricsOn = 1;
+
+	return ERR_NONE;
+}
+
+/****************************************************************************
+ Function    : metricsPhase
+ Description : Notes the start of a phase of the run.
+ Parameters  : Phase          PHASE_ERASE, PHASE_WRITE or PHASE_VERIFY.
+               unsigned long  Data bytes the phase will handle; 0 if not
+                              known (erase).
+ Returns     : Nothing (void)
+ ****************************************************************************/
+void metricsPhase(
+  const Phase         phase,
+  const unsigned long total)
+{
+	if(!metricsOn) return;
+
+	SET(bytesDone,0);
+	SET(bytesTotal,total);
+	SET(state,phase);
+	metricsTick(1);
+}
+
+/****************************************************************************
+ Function    : metricsBlock
+ Description : Counts one block of data written or verified.
+ Parameters  : int  Bytes in the block.
+ Returns     : Nothing (void)
+ Notes       : Called for every block; does no more than two stores.
+ ****************************************************************************/
+void metricsBlock(const int len)
+{
+	if(!metricsOn) return;
+
+	SET(bytesDone,bytesDone + len);
+	SET(bytesAll,bytesAll + len);
+	metricsTick(0);
+}
+
+/****************************************************************************
+ Function    : metricsSample
+ Description : Notes a response from the device.
+ Parameters  : unsigned long long  Its round-trip time, ns.
+ Returns     : Nothing (void)
+ ****************************************************************************/
+void metricsSample(const unsigned long long rtt)
+{
+	if(!metricsOn) return;
+
+	SET(lastRtt,rtt);
+	SET(lastSeen,traceClock());
+}
+
+/****************************************************************************
+ Function    : metricsError
+ Description : Counts a failed USB operation.
+ Parameters  : None (void)
+ Returns     : Nothing (void)
+ ****************************************************************************/
+void metricsError(void)
+{
+	if(!metricsOn) return;
+
+	SET(usbErrors,usbErrors + 1);
+}
+
+/****************************************************************************
+ Function    : metricsEnd
+ Description : Notes the end of a run (or job, or flash) and how it went.
+ Parameters  : ErrorCode  Its outcome.
+ Returns     : Nothing (void)
+ ****************************************************************************/
+void metricsEnd(const ErrorCode status)
+{
+	if(!metricsOn) return;
+
+	SET(runs,runs + 1);
+	if(ERR_NONE != status)
+		SET(runsFailed,runsFailed + 1);
+	SET(state,(ERR_NONE == status) ? STATE_DONE : STATE_FAILED);
+	metricsTick(1);
+}
+
+/****************************************************************************
+ Function    : metricsClose
+ Description : Writes the file a last time and stops updating it.  Safe to
+               call when there's no metrics file.
+ Parameters  : None (void)
+ Returns     : Nothing (void)
+ Notes       : The file is left in place, showing how the run ended.
+ ****************************************************************************/
+void metricsClose(void)
+{
+	if(!metricsOn) return;
+
+#ifndef WIN
+	__atomic_store_n(&stopping,1,__ATOMIC_RELEASE);
+	(void)pthread_join(writer,NULL);
+#endif
+	(void)metricsWrite();
+	metricsOn = 0;
+	free(metricsTemp);
+	metricsTemp = NULL;
+}
@@ -43,6 +43,17 @@
 #define DEBUGMSG(str)
 #endif /* DEBUG */
 
+/* Event timeline trace points (evtrace.c); free unless built with EVTRACE */
+#ifdef EVTRACE
+#define EV_BEGIN(name,arg) evtraceEvent('B',name,arg)
+#define EV_END()           evtraceEvent('E',NULL,0)
+#define EV_MARK(name,arg)  evtraceEvent('i',name,arg)
+#else
+#define EV_BEGIN(name,arg)
+#define EV_END()
+#define EV_MARK(name,arg)
+#endif /* EVTRACE */
+
 /* On Intel architectures, can make some crass endianism optimizations */
 
 #if defined(i386) || defined(__x86_64__)
@@ -68,6 +79,14 @@
 
 /* Values derived from Microchip HID Bootloader source */
 
+/* Largest report supported: a high-speed interrupt endpoint's maximum
+   packet size.  Full-speed devices use 64; the actual size in use is
+   found from the device's endpoint when it is opened (usbReportSize). */
+#define USB_MAX_REPORT    1024
+
+/* Longest memory map text (deviceMapText()) */
+#define DEVICE_MAP        512
+
 /* Bootloader commands */
 #define	QUERY_DEVICE      0x02
 #define	UNLOCK_CONFIG     0x03
@@ -78,6 +97,23 @@
 #define RESET_DEVICE      0x08
 #define SIGN_FLASH        0x09
 
+/* Protocol extensions, for bootloaders that offer them.  Such a bootloader
+   puts EXT_SIGNATURE at EXT_SIGNATURE_POS in its QUERY_DEVICE response
+   (bytes the stock bootloader doesn't set), and QUERY_EXTENSIONS returns
+   which of the EXT_ bits it supports, plus its erase page size in bytes
+   at offset 2.  CRC32_RANGE and ERASE_RANGE take an address (in device
+   address units) at offset 1 and a length in bytes at offset 5;
+   CRC32_RANGE echoes both and returns the CRC-32 (as zlib's crc32()) at
+   offset 9.  ERASE_RANGE erases every page the range touches, with no
+   response; like ERASE_DEVICE, later commands wait for it to finish. */
+#define	QUERY_EXTENSIONS  0x20
+#define	CRC32_RANGE       0x21
+#define ERASE_RANGE       0x22
+#define EXT_SIGNATURE     "MPX\x01"
+#define EXT_SIGNATURE_POS 60
+#define EXT_CRC32         0x01
+#define EXT_ERASE_RANGE   0x02
+
 /* Sub-commands for the ERASE_DEVICE command */
 #define UNLOCKCONFIG      0x00
 #define LOCKCONFIG        0x01
@@ -88,11 +124,29 @@
 #define TypeConfigWords   0x03
 #define TypeEndOfTypeList 0xFF
 
+/* Direction of a report in a USB session trace (trace.c) */
+#define TRACE_VERSION     0x01
+#define TRACE_OUT         0x01
+#define TRACE_IN          0x02
+
 /* Device family */
 #define DEVICE_FAMILY_PIC18 0x01
 #define DEVICE_FAMILY_PIC24 0x02
 #define DEVICE_FAMILY_PIC32 0x03
 
+/* Program's actions aren't necessarily performed in command-line order.
+   Bit flags keep track of options set or cleared during input parsing,
+   then are singularly checked as actions are performed.  Some actions
+   (such as writing) don't have corresponding bits here; certain non-NULL
+   string values indicate such actions should occur. */
+#define ACTION_UNLOCK (1 << 0)
+#define ACTION_ERASE  (1 << 1)
+#define ACTION_VERIFY (1 << 2)
+#define ACTION_RESET  (1 << 3)
+#define ACTION_SIGN   (1 << 4)
+#define ACTION_PROBE  (1 << 5)
+#define ACTION_WIPE   (1 << 6)  /* Whole device, even if range erase works */
+
 /* Error codes returned by various functions */
 
 typedef enum
@@ -113,22 +167,225 @@ typedef enum
 	ERR_HEX_CHECKSUM,
 	ERR_HEX_RECORD,
 	ERR_VERIFY,
+	ERR_TRACE_OPEN,
+	ERR_USB_TIMEOUT,
+	ERR_SCRIPT_OPEN,
+	ERR_DUMP_WRITE,
+	ERR_SERVE_SOCKET,
+	ERR_EVENTS_OPEN,
+	ERR_APP_TIMEOUT,
+	ERR_LOG_OPEN,
+	ERR_HEX_UNPACK,
+	ERR_WATCH,
+	ERR_MAP_FILE,
+	ERR_PACK_WRITE,
+	ERR_PACK_DAMAGED,
+	ERR_PACK_TARGET,
+	ERR_CONFORM,
+	ERR_AUDIT_LIST,
+	ERR_AUDIT,
+	ERR_CHECK_LIST,
+	ERR_CHECK,
+	ERR_RANGE_ERASE,
+	ERR_METRICS_OPEN,
+	ERR_PROFILE_FILE,
+	ERR_SERVE_REQUEST,
 	ERR_EOL              /* End-of-list, not actual error code */
 } ErrorCode;
 
+/* Phases of a run timed for the run log (telemetry.c) */
+
+typedef enum
+{
+	PHASE_ERASE = 0,
+	PHASE_WRITE,
+	PHASE_VERIFY,
+	PHASE_COUNT          /* Number of phases, not an actual phase */
+} Phase;
+
+/* A span of memory, in bytes as addressed in hex files */
+
+typedef struct
+{
+	unsigned int addr;
+	unsigned int len;
+} Range;
+
+/* Image built into a self-contained flasher (pack.c) */
+
+typedef struct
+{
+	const char          *name;     /* Hex file it was packed from       */
+	unsigned long long   hash;     /* hexGetHash() of that file         */
+	char                 actions;  /* ACTION_ bits it was packed with   */
+	const char          *map;      /* Target, as from deviceMapText()   */
+	const unsigned char *ops;      /* Block stream, as from hexOps()    */
+	unsigned long        len;      /* Length of block stream            */
+	unsigned int         crc;      /* hexCrc32() of block stream        */
+} PackImage;
+
+/* A way of reaching the device (usb-*.c), chosen at run time with
+   --transport or, of those marked to probe, the first that finds one.
+   Report buffers belong to the caller: usbReportSize bytes, with one
+   byte more before the start for transports that send a report number
+   ahead of the report. */
+
+typedef struct
+{
+	const char *name;
+	char        probe;      /* Tried when none is chosen              */
+	ErrorCode (*open)(const unsigned short,const unsigned short);
+	ErrorCode (*send)(unsigned char * const,const int,const int);
+	ErrorCode (*recv)(unsigned char * const,const int);
+	int       (*location)(int *,int *);
+	int       (*find)(const unsigned short,const unsigned short,
+	            const char * const);
+	int       (*serial)(char * const,const int);
+	void      (*close)(void);
+} Transport;
+
+/* Parser output: what hexParse() asks to have done next (see hexIssue()
+   in hex.c); also the op byte of each entry in a block stream (hexOps()) */
+
+#define OP_BLOCK  0   /* Write or verify one block of data               */
+#define OP_FLUSH  1   /* PROGRAM_COMPLETE, if a short write is pending   */
+#define OP_RUNEND 2   /* End of a contiguous run of data                 */
+#define OP_END    3   /* Parser finished (pipeline only)                 */
+
+/* Compressed hex file formats (unpack.c) */
+
+#define UNPACK_NONE 0
+#define UNPACK_GZIP 1
+#define UNPACK_XZ   2
+#define UNPACK_ZSTD 3
+
 
 /* Function prototypes */
 
 extern ErrorCode
 	hexOpen(char * const),
+	hexOpenFd(const int),
 	hexWrite(const char),
+	hexVerify(void),
+	hexRanges(Range * const,int * const,const int,const unsigned int),
+	hexOps(unsigned char ** const,size_t * const),
+	hexSetWindow(const unsigned int,const unsigned int),
 	usbOpen(const unsigned short,const unsigned short),
-	usbWrite(const char,const char);
+	usbWrite(const int,const char),
+	usbPacket(unsigned char * const,const int,unsigned char * const),
+	usbSend(unsigned char * const,const int,const int),
+	usbRecv(unsigned char * const,const int),
+	usbSelect(const char * const),
+	faultSet(const char * const,const unsigned int),
+	faultSend(unsigned char * const,const int,const int),
+	faultRecv(unsigned char * const,const int),
+	metricsOpen(const char * const),
+	tuneLoad(const unsigned short,const unsigned short),
+	tuneRun(const unsigned short,const unsigned short),
+	traceOpen(char * const),
+	probeRun(void),
+	deviceQuery(void),
+	deviceUnlock(void),
+	deviceErase(void),
+	deviceEraseImage(void),
+	deviceDump(const unsigned int,const unsigned int,const char * const),
+	deviceSign(void),
+	deviceReset(void),
+	deviceSaveMap(const char * const),
+	deviceLoadMap(const char * const),
+	deviceUseMap(const char * const),
+	packWrite(const char * const,const char * const,const char),
+	packOpen(void),
+	scriptLine(char * const,const char),
+	scriptRun(const char * const,const char),
+	serveRun(const char * const,const unsigned short,const unsigned short),
+	serveClient(const char * const,const char * const),
+	usbWaitApp(const unsigned short,const unsigned short,const char * const,
+	  const int,const unsigned long long),
+	telemetryLog(const char * const,const ErrorCode),
+	telemetryReport(const char * const),
+	watchRun(const char * const,const unsigned short,const unsigned short,
+	  const char),
+	auditRun(const char * const,const unsigned short,const unsigned short),
+	checkRun(const char * const,int),
+	unpackOpen(const unsigned char * const,const size_t),
+	unpackRead(char * const,const int,int * const);
 extern void
 	hexClose(void),
 	usbClose(void),
-	hexSetBytesPerAddress(unsigned char);
+	hexSetBytesPerAddress(unsigned char),
+	hexSetSample(const int,const unsigned int),
+	hexSetCrcSpan(const unsigned int),
+	hexWindowReport(void),
+	tracePacket(const unsigned char,const unsigned char *,const int,
+	  const unsigned long long),
+	traceClose(void),
+	schedAcquire(const int),
+	schedRelease(void),
+	watchdogSample(const unsigned long long),
+	watchdogFloor(const int),
+	watchdogErase(const char),
+	watchdogBudget(const int),
+	watchdogArm(const int,const char * const),
+	watchdogResident(void),
+	faultReport(const ErrorCode),
+	metricsPhase(const Phase,const unsigned long),
+	metricsBlock(const int),
+	metricsSample(const unsigned long long),
+	metricsError(void),
+	metricsEnd(const ErrorCode),
+	metricsClose(void),
+	deviceInfo(void),
+	deviceLock(const char),
+	deviceMapText(char * const,const int),
+	hexUseOps(const unsigned char * const,const size_t,
+	  const unsigned long long),
+	telemetryStart(void),
+	telemetryDevice(void),
+	telemetryPhase(const Phase,const unsigned long long),
+	telemetrySample(const unsigned long long),
+	unpackClose(void),
+	bootsimOpen(const char * const,const char),
+	bootsimClose(void);
 extern unsigned char hexGetBytesPerAddress(void);
+extern int hexGetBlockSize(void),
+	hexMemBlock(const int,Range * const);
+extern unsigned int hexCrc32(unsigned int,const unsigned char * const,
+	const int),
+	devicePage;
+extern unsigned char deviceExt;
+extern char deviceExtensions,
+	metricsOn,
+	tuneOff;
+extern int usbReportSize,
+	scriptFd,
+	eraseTimeout,
+	usbLocation(int *,int *),
+	usbFind(const unsigned short,const unsigned short,const char * const),
+	usbSerial(char * const,const int),
+	schedPort(char * const,const int),
+	watchdogTimeout(void),
+	watchdogDisarm(void),
+	unpackFormat(const unsigned char * const,const size_t),
+	bootsimCommand(const unsigned char * const,unsigned char * const,
+	  const int,unsigned int * const);
+extern const char *usbCommandName(const unsigned char),
+	*usbTransportName(void),
+	*bootsimSerial(void);
+extern unsigned long long traceClock(void),
+	hexGetHash(void);
+extern char *telemetryStation,
+	*tuneFile;
+extern const Transport transportLibusb,transportLibhid,transportHidraw,
+	transportOsx,transportWindows,transportSim,transportReplay;
+#ifdef PACKED
+extern const PackImage packImage;
+#endif
+#ifdef EVTRACE
+extern ErrorCode evtraceOpen(const char * const);
+extern void evtraceEvent(const char,const char * const,const unsigned int),
+	evtraceClose(void);
+#endif
 
 #pragma pack( push )
 #pragma pack( 1 )
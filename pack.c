@@ -0,0 +1,150 @@
+/****************************************************************************
+ File        : pack.c
+ Description : Self-contained flashers, for field updates and contract
+               manufacturers: one executable that writes one image, with
+               no hex file, script or parsing at run time.
+
+               --pack parses a hex file for a target memory map (saved from
+               a device with --save-map) and writes the block stream a
+               write would send (see hexOps()) as a C source file, along
+               with the map, the options given and a CRC of the stream.
+               Built with 'make mphidflash-packed PACKED=<file>', that
+               becomes the flasher: its image is a read-only array, played
+               back in place of parsing once the device has been opened,
+               queried and found to match the map.
+
+               The CRC is checked before anything is erased, so a damaged
+               executable never gets as far as the device; verify then
+               compares the device's memory (by CRC where the bootloader
+               offers it) against the built-in image as usual.
+
+ License     : This file is part of 'mphidflash' program.
+
+               'mphidflash' is free software: you can redistribute it and/or
+               modify it under the terms of the GNU General Public License
+               as published by the Free Software Foundation, either version
+               3 of the License, or (at your option) any later version.
+
+               'mphidflash' is distributed in the hope that it will be useful,
+               but WITHOUT ANY WARRANTY; without even the implied warranty
+               of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+               See the GNU General Public License for more details.
+
+               You should have received a copy of the GNU General Public
+               License along with 'mphidflash' source code.  If not,
+               see <http://www.gnu.org/licenses/>.
+
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include "mphidflash.h"
+
+#define PACK_MAP 512  /* Longest memory map text */
+
+/* Write a string as a C string literal */
+static void packString(
+  FILE * const       fp,
+  const char * const str)
+{
+	const char *p;
+
+	(void)fputc('"',fp);
+	for(p=str;*p;p++) {
+		if(*p == '\n')                    (void)fputs("\\n",fp);
+		else if((*p == '"') || (*p == '\\')) (void)fprintf(fp,"\\%c",*p);
+		else                              (void)fputc(*p,fp);
+	}
+	(void)fputc('"',fp);
+}
+
+/****************************************************************************
+ Function    : packWrite
+ Description : Writes a hex file's image, ready to send, as C source for a
+               self-contained flasher.
+ Parameters  : char*      C source file to write.
+               char*      Hex file, already checked by hexOpen().
+               char       ACTION_ bits the flasher is to carry out (as -u,
+                          -e, -n, -s and -r; it can be given more).
+ Returns     : ErrorCode  ERR_NONE on success, ERR_PACK_WRITE if the source
+                          file can't be written, else as for hexOps().
+ Notes       : The memory map must already be set up, by deviceQuery() or
+               deviceLoadMap().
+ ****************************************************************************/
+ErrorCode packWrite(
+  const char * const cfile,
+  const char * const hexFile,
+  const char         actions)
+{
+	ErrorCode      status;
+	unsigned char *ops;
+	size_t         len,i;
+	char           map[PACK_MAP];
+	FILE          *fp;
+	int            ok;
+
+	if(ERR_NONE != (status = hexOps(&ops,&len)))
+		return status;
+	if(!(fp = fopen(cfile,"w")))
+		return ERR_PACK_WRITE;
+
+	deviceMapText(map,sizeof(map));
+	(void)fprintf(fp,"/* Image for a self-contained mphidflash, from '%s'.\n"
+	  "   Generated by mphidflash --pack; build with\n"
+	  "   'make mphidflash-packed PACKED=%s'. */\n\n"
+	  "#include <stdio.h>\n#include \"mphidflash.h\"\n\n"
+	  "static const unsigned char ops[%lu] = {",hexFile,cfile,
+	  (unsigned long)len);
+	for(i=0;i<len;i++)
+		(void)fprintf(fp,"%s0x%02x",(i % 12) ? "," : (i ? ",\n\t" : "\n\t"),
+		  ops[i]);
+	(void)fprintf(fp,"\n};\n\nconst PackImage packImage = {\n\t");
+	packString(fp,hexFile);
+	(void)fprintf(fp,",\n\t0x%016llxULL,\n\t0x%02x,\n\t",hexGetHash(),
+	  (unsigned char)actions);
+	packString(fp,map);
+	(void)fprintf(fp,",\n\tops,\n\tsizeof(ops),\n\t0x%08x\n};\n",
+	  hexCrc32(0,ops,len));
+	ok = !ferror(fp);
+	if(fclose(fp) || !ok)
+		return ERR_PACK_WRITE;
+
+	(void)printf("Packed %lu bytes of blocks from '%s' into '%s'\n",
+	  (unsigned long)len,hexFile,cfile);
+
+	return ERR_NONE;
+}
+
+#ifdef PACKED
+
+/****************************************************************************
+ Function    : packOpen
+ Description : Makes the built-in image the one to write and verify, once
+               it has been checked against itself and the device.
+ Parameters  : None (void)
+ Returns     : ErrorCode  ERR_NONE on success, ERR_PACK_DAMAGED if the
+                          image's CRC is wrong, ERR_PACK_TARGET if the
+                          device's memory map isn't the one packed for.
+ Notes       : In place of hexOpen(); hexClose() when done.  The device
+               must have been queried.
+ ****************************************************************************/
+ErrorCode packOpen(void)
+{
+	char map[PACK_MAP];
+
+	if(hexCrc32(0,packImage.ops,packImage.len) != packImage.crc)
+		return ERR_PACK_DAMAGED;
+
+	deviceMapText(map,sizeof(map));
+	if(strcmp(map,packImage.map)) {
+		(void)printf("Image was packed for:\n%sThis device is:\n%s",
+		  packImage.map,map);
+		return ERR_PACK_TARGET;
+	}
+
+	hexUseOps(packImage.ops,packImage.len,packImage.hash);
+
+	return ERR_NONE;
+}
+
+#endif /* PACKED */
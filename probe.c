@@ -0,0 +1,123 @@
+/****************************************************************************
+ File        : probe.c
+ Description : Link latency and throughput probe.  Times a long run of
+               QUERY_DEVICE round trips followed by a burst of GET_DATA reads
+               from program memory; neither changes anything on the device.
+               Useful for qualifying hubs, cables and host ports, and as a
+               baseline when comparing changes to the transport code.
+
+ License     : This file is part of 'mphidflash' program.
+
+               'mphidflash' is free software: you can redistribute it and/or
+               modify it under the terms of the GNU General Public License
+               as published by the Free Software Foundation, either version
+               3 of the License, or (at your option) any later version.
+
+               'mphidflash' is distributed in the hope that it will be useful,
+               but WITHOUT ANY WARRANTY; without even the implied warranty
+               of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+               See the GNU General Public License for more details.
+
+               You should have received a copy of the GNU General Public
+               License along with 'mphidflash' source code.  If not,
+               see <http://www.gnu.org/licenses/>.
+
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "mphidflash.h"
+
+#define PROBE_QUERIES 2000  /* QUERY_DEVICE round trips */
+#define PROBE_READS   1000  /* GET_DATA round trips     */
+
+extern unsigned char *usbBuf;  /* In usb.c */
+
+static unsigned long long rtt[PROBE_QUERIES > PROBE_READS ?
+                              PROBE_QUERIES : PROBE_READS];
+
+static int compareRtt(const void *a,const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a,
+	                   y = *(const unsigned long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Print RTT distribution and rate for n samples taken over 'elapsed' ns */
+static void probeReport(
+  const char * const       label,
+  const int                n,
+  const unsigned long long elapsed,
+  const int                bytes)
+{
+	double secs = elapsed / 1e9;
+
+	qsort(rtt,n,sizeof(rtt[0]),compareRtt);
+	(void)printf("%-13s RTT us: min %.1f  median %.1f  p99 %.1f  max %.1f\n",
+	  label,rtt[0] / 1e3,rtt[n / 2] / 1e3,rtt[(n * 99) / 100] / 1e3,
+	  rtt[n - 1] / 1e3);
+	(void)printf("%-13s %d round trips in %.3f s: %.0f reports/s",
+	  "",n,secs,n / secs);
+	if(bytes)
+		(void)printf(", %.1f KB/s",(double)n * bytes / secs / 1024.0);
+	(void)putchar('\n');
+}
+
+/****************************************************************************
+ Function    : probeRun
+ Description : Measures round-trip time and sustained report rate.
+ Parameters  : None (void)
+ Returns     : ErrorCode  ERR_NONE on success, else as returned by usbWrite().
+ Notes       : Device must be open and devQuery already filled in.
+ ****************************************************************************/
+ErrorCode probeRun(void)
+{
+	ErrorCode          status;
+	unsigned long long start,t;
+	unsigned int       addr = 0,size = 0,offset;
+	int                i,block = hexGetBlockSize();
+
+	(void)printf("Probing link: %d QUERY_DEVICE round trips...\n",
+	  PROBE_QUERIES);
+	start = traceClock();
+	for(i=0;i<PROBE_QUERIES;i++) {
+		t         = traceClock();
+		usbBuf[0] = QUERY_DEVICE;
+		if(ERR_NONE != (status = usbWrite(1,1)))
+			return status;
+		rtt[i]    = traceClock() - t;
+	}
+	probeReport("QUERY_DEVICE",PROBE_QUERIES,traceClock() - start,0);
+
+	/* Read back from the start of the first program memory block */
+	for(i=0;i<devQuery.memBlocks;i++) {
+		if(devQuery.mem[i].Type == TypeProgramMemory) {
+			addr = devQuery.mem[i].Address;
+			size = devQuery.mem[i].Length * hexGetBytesPerAddress();
+			break;
+		}
+	}
+	if(size < block) {
+		(void)puts("No program memory reported; GET_DATA probe skipped");
+		return ERR_NONE;
+	}
+
+	(void)printf("Probing link: %d GET_DATA reads of %d bytes...\n",
+	  PROBE_READS,block);
+	start  = traceClock();
+	offset = 0;
+	for(i=0;i<PROBE_READS;i++) {
+		t         = traceClock();
+		usbBuf[0] = GET_DATA;
+		bufWrite32(usbBuf,1,(addr + offset) / hexGetBytesPerAddress());
+		usbBuf[5] = block;
+		if(ERR_NONE != (status = usbWrite(6,1)))
+			return status;
+		rtt[i]    = traceClock() - t;
+		if((offset += block) + block > size) offset = 0;
+	}
+	probeReport("GET_DATA",PROBE_READS,traceClock() - start,block);
+
+	return ERR_NONE;
+}
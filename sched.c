@@ -0,0 +1,296 @@
+/****************************************************************************
+ File        : sched.c
+ Description : Bus-topology-aware scheduling for stations that flash many
+               boards at once, one mphidflash process per board.  Devices
+               that share a full-speed segment of the bus (everything below
+               a full-speed hub, or below one transaction translator of a
+               high-speed hub) compete for the same 1 ms frames, so running
+               them all at once only makes each slower and provokes
+               timeouts.  Each process therefore looks up where its device
+               sits in the sysfs USB topology and takes one of a fixed
+               number of slots for that segment before starting work;
+               processes on other segments are unaffected.
+
+               Slots are lock files, one per segment and slot number, held
+               with flock() so they are released automatically if a process
+               dies.  A small shared stats file per segment accumulates busy
+               time so the utilisation of each port can be reported.  They
+               live in a directory of the user's own ($XDG_RUNTIME_DIR, else
+               /tmp/mphidflash-sched-<uid>), so processes of one user share
+               slots; a directory anyone else owns, or a symbolic link, is
+               not used.
+
+ License     : This file is part of 'mphidflash' program.
+
+               'mphidflash' is free software: you can redistribute it and/or
+               modify it under the terms of the GNU General Public License
+               as published by the Free Software Foundation, either version
+               3 of the License, or (at your option) any later version.
+
+               'mphidflash' is distributed in the hope that it will be useful,
+               but WITHOUT ANY WARRANTY; without even the implied warranty
+               of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+               See the GNU General Public License for more details.
+
+               You should have received a copy of the GNU General Public
+               License along with 'mphidflash' source code.  If not,
+               see <http://www.gnu.org/licenses/>.
+
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mphidflash.h"
+
+#ifndef WIN
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#define SYSFS_USB    "/sys/bus/usb/devices"
+#define SCHED_IDLE   60000000000ULL  /* ns idle before totals restart */
+
+static char               segment[64];   /* Shared bus segment, e.g. 1-1.4 */
+static char               schedDir[256]; /* Lock and stats files           */
+static int                slotFd = -1;   /* Held slot lock file            */
+static int                slotCount;
+static unsigned long long waitStart,busyStart;
+
+/* Per-segment totals kept in <schedDir>/<segment>.stats */
+typedef struct {
+	unsigned long long first;  /* traceClock() of first job start */
+	unsigned long long last;   /* traceClock() of last job end    */
+	unsigned long long busy;   /* Summed slot hold time, ns       */
+	unsigned long long wait;   /* Summed slot wait time, ns       */
+	unsigned long      jobs;
+} SchedStats;
+
+/* Read a small sysfs attribute as an integer; -1 if absent */
+static int sysfsInt(const char * const dev,const char * const attr)
+{
+	char  path[256];
+	FILE *fp;
+	int   val = -1;
+
+	(void)snprintf(path,sizeof(path),"%s/%s/%s",SYSFS_USB,dev,attr);
+	if((fp = fopen(path,"r"))) {
+		if(1 != fscanf(fp,"%d",&val)) val = -1;
+		(void)fclose(fp);
+	}
+	return val;
+}
+
+/****************************************************************************
+ Function    : schedSegment
+ Description : Finds the bus segment the open device shares with others.
+               The segment is the topmost full-speed hub above the device
+               if there is one, else the hub the device is plugged into,
+               else (device directly on a root port) the root port itself.
+ Parameters  : None (void)
+ Returns     : int  1 if found (result in segment[]), 0 if not.
+ ****************************************************************************/
+static int schedSegment(void)
+{
+	char name[64],*dot;
+
+	if(!schedPort(name,sizeof(name))) return 0;
+
+	/* Default: parent hub, or the root port when there is none */
+	(void)strcpy(segment,name);
+	if((dot = strrchr(segment,'.'))) *dot = 0;
+
+	/* Walk down from the root port; first full-speed hub wins */
+	for(dot = strchr(name,'.');dot;dot = strchr(dot + 1,'.')) {
+		*dot = 0;
+		if(sysfsInt(name,"speed") == 12) {
+			(void)strcpy(segment,name);
+			break;
+		}
+		*dot = '.';
+	}
+
+	return 1;
+}
+
+/* Find, or make, the directory for lock files; 1 if it can be used */
+static int schedDirectory(void)
+{
+	struct stat  st;
+	const char  *run = getenv("XDG_RUNTIME_DIR");
+
+	if(run && *run)
+		(void)snprintf(schedDir,sizeof(schedDir),"%s/mphidflash-sched",run);
+	else
+		(void)snprintf(schedDir,sizeof(schedDir),"/tmp/mphidflash-sched-%u",
+		  (unsigned int)getuid());
+	(void)mkdir(schedDir,0700);
+
+	/* A real directory of our own, not one planted by someone else */
+	return !lstat(schedDir,&st) && S_ISDIR(st.st_mode) &&
+	  (st.st_uid == getuid());
+}
+
+/* Add this job's figures to the segment's shared totals; returns totals */
+static void schedAccount(
+  SchedStats               *total,
+  const unsigned long long  busy,
+  const unsigned long long  wait)
+{
+	char path[sizeof(schedDir) + sizeof(segment) + 16];
+	int  fd;
+
+	memset(total,0,sizeof(*total));
+	(void)snprintf(path,sizeof(path),"%s/%s.stats",schedDir,segment);
+	if((fd = open(path,O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,0600)) < 0)
+		return;
+
+	if(!flock(fd,LOCK_EX)) {
+		if(sizeof(*total) != read(fd,total,sizeof(*total)))
+			memset(total,0,sizeof(*total));
+		/* Start afresh after an idle spell (or a reboot) */
+		if(!total->first || (total->first > busyStart + busy) ||
+		   (busyStart > total->last + SCHED_IDLE)) {
+			memset(total,0,sizeof(*total));
+			total->first = busyStart;
+		}
+		if(total->first > busyStart) total->first = busyStart;
+		if(total->last < busyStart + busy) total->last = busyStart + busy;
+		total->busy += busy;
+		total->wait += wait;
+		total->jobs++;
+		(void)lseek(fd,0,SEEK_SET);
+		(void)write(fd,total,sizeof(*total));
+		(void)flock(fd,LOCK_UN);
+	}
+	(void)close(fd);
+}
+#endif /* !WIN */
+
+/****************************************************************************
+ Function    : schedPort
+ Description : Finds the physical port the open device is plugged into.
+               sysfs names devices by port path ("1-1.4.2" is port 2 of the
+               hub on port 4 of the hub on root port 1 of bus 1), which,
+               unlike the device address, stays the same from one
+               enumeration to the next.
+ Parameters  : char*  Receives the port path, NUL-terminated.
+               int    Size of buffer.
+ Returns     : int    1 if found, 0 if not (or not supported).
+ ****************************************************************************/
+int schedPort(
+  char * const buf,
+  const int    size)
+{
+#ifndef WIN
+	DIR           *dir;
+	struct dirent *ent;
+	int            bus,addr,found = 0;
+
+	if(!usbLocation(&bus,&addr) || !(dir = opendir(SYSFS_USB)))
+		return 0;
+
+	while(!found && (ent = readdir(dir))) {
+		if(!strchr(ent->d_name,'-') || strchr(ent->d_name,':'))
+			continue;  /* Root hubs and interfaces */
+		if((sysfsInt(ent->d_name,"busnum") == bus) &&
+		   (sysfsInt(ent->d_name,"devnum") == addr)) {
+			(void)snprintf(buf,size,"%s",ent->d_name);
+			found = 1;
+		}
+	}
+	(void)closedir(dir);
+
+	return found;
+#else
+	return 0;
+#endif
+}
+
+/****************************************************************************
+ Function    : schedAcquire
+ Description : Waits for a free slot on the open device's bus segment.
+ Parameters  : int   Slots (concurrent jobs) allowed per segment.
+ Returns     : Nothing (void)
+ Notes       : If the topology can't be determined (no sysfs, or a backend
+               that can't report the device's location), or no lock file
+               can be opened, the job simply runs unscheduled.
+ ****************************************************************************/
+void schedAcquire(const int slots)
+{
+#ifndef WIN
+	char path[sizeof(schedDir) + sizeof(segment) + 16];
+	int  i,fd,opened;
+
+	if(!schedSegment()) {
+		(void)puts("Bus topology unknown; running unscheduled");
+		return;
+	}
+	if(!schedDirectory()) {
+		(void)printf("Can't use %s for bus slots; running unscheduled\n",
+		  schedDir);
+		return;
+	}
+
+	slotCount = slots;
+	waitStart = traceClock();
+	for(;;) {
+		for(i=0,opened=0;i<slots;i++) {
+			(void)snprintf(path,sizeof(path),"%s/%s.%d",schedDir,segment,i);
+			if((fd = open(path,O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+			  0600)) < 0)
+				continue;
+			opened++;
+			if(!flock(fd,LOCK_EX | LOCK_NB)) {
+				slotFd    = fd;
+				busyStart = traceClock();
+				(void)printf("Bus segment %s: slot %d of %d",segment,i + 1,
+				  slots);
+				if(busyStart - waitStart >= 100000000ULL)
+					(void)printf(" (waited %.1f s)",
+					  (busyStart - waitStart) / 1e9);
+				(void)putchar('\n');
+				return;
+			}
+			(void)close(fd);
+		}
+		/* Waiting is no use if there's no slot to wait for */
+		if(!opened) {
+			(void)printf("Can't open bus slots in %s; running unscheduled\n",
+			  schedDir);
+			return;
+		}
+		(void)usleep(20000);
+	}
+#endif
+}
+
+/****************************************************************************
+ Function    : schedRelease
+ Description : Frees the slot taken by schedAcquire() and reports the
+               utilisation of the segment's slots since its first job.
+ Parameters  : None (void)
+ Returns     : Nothing (void)
+ ****************************************************************************/
+void schedRelease(void)
+{
+#ifndef WIN
+	SchedStats         total;
+	unsigned long long now;
+
+	if(slotFd < 0) return;
+
+	now = traceClock();
+	schedAccount(&total,now - busyStart,busyStart - waitStart);
+	(void)close(slotFd);  /* Also drops the lock */
+	slotFd = -1;
+
+	if(now > total.first)
+		(void)printf("Bus segment %s: %lu jobs, %.0f%% utilisation of %d "
+		  "slots, mean wait %.2f s\n",segment,total.jobs,
+		  100.0 * total.busy / ((double)(now - total.first) * slotCount),
+		  slotCount,total.wait / 1e9 / total.jobs);
+#endif
+}
@@ -0,0 +1,199 @@
+/****************************************************************************
+ File        : script.c
+ Description : Command scripts: a sequence of bootloader operations run over
+               one open device and one QUERY_DEVICE, for test harnesses that
+               would otherwise pay for a fresh process, enumeration and query
+               per operation.  One command per line:
+
+                 query                     Print cached device information
+                 unlock                    Unlock configuration memory
+                 erase                     Erase device
+                 write <file> [noverify]   Write hex file (no implicit erase)
+                 verify <file>             Verify device against hex file
+                 dump <addr> <len> <file>  Save memory range as raw binary
+                 probe                     Measure link (as --probe)
+                 sign                      Sign flash
+                 reset                     Reset device
+
+               A file name of '-' stands for the hex file whose descriptor
+               is in scriptFd (set by the flash server, serve.c, to an image
+               passed in by its client).
+
+               Blank lines and text from '#' on are ignored.  The whole
+               script is checked before the device is opened, so a typo on
+               the last line doesn't leave a board half programmed.
+
+ License     : This file is part of 'mphidflash' program.
+
+               'mphidflash' is free software: you can redistribute it and/or
+               modify it under the terms of the GNU General Public License
+               as published by the Free Software Foundation, either version
+               3 of the License, or (at your option) any later version.
+
+               'mphidflash' is distributed in the hope that it will be useful,
+               but WITHOUT ANY WARRANTY; without even the implied warranty
+               of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+               See the GNU General Public License for more details.
+
+               You should have received a copy of the GNU General Public
+               License along with 'mphidflash' source code.  If not,
+               see <http://www.gnu.org/licenses/>.
+
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mphidflash.h"
+
+#define SCRIPT_ARGS 4  /* Command plus up to three arguments */
+
+int scriptFd = -1;     /* Hex file named '-' in commands, if any */
+
+/* Parse an unsigned number (decimal, or hex with 0x prefix) */
+static int scriptNumber(
+  const char * const  s,
+  unsigned int       *val)
+{
+	char *end;
+
+	*val = strtoul(s,&end,0);
+	return *s && !*end;
+}
+
+/* Check that a hex file exists and is readable */
+static ErrorCode scriptFile(const char * const filename)
+{
+	FILE *fp;
+
+	if(!strcmp(filename,"-"))
+		return (scriptFd >= 0) ? ERR_NONE : ERR_HEX_OPEN;
+	if(!(fp = fopen(filename,"r")))
+		return ERR_HEX_OPEN;
+	(void)fclose(fp);
+	return ERR_NONE;
+}
+
+/* Open, write and/or verify, and close a hex file */
+static ErrorCode scriptHex(
+  char * const filename,
+  const char   first,
+  const char   last)
+{
+	ErrorCode status;
+
+	/* hexClose() closes the descriptor; keep scriptFd for reuse */
+	if(!strcmp(filename,"-"))
+		status = hexOpenFd(dup(scriptFd));
+	else
+		status = hexOpen(filename);
+	if(ERR_NONE != status)
+		return status;
+	if(first) {
+		(void)printf("Verifying hex file '%s':",filename);
+		status = hexVerify();
+	} else {
+		(void)printf("Writing hex file '%s':",filename);
+		status = hexWrite(last);
+	}
+	(void)putchar('\n');
+	hexClose();
+
+	return status;
+}
+
+/****************************************************************************
+ Function    : scriptLine
+ Description : Checks or executes one script command.
+ Parameters  : char*      Command line; modified (split into words).
+               char       1 to execute, 0 to check syntax and files only.
+ Returns     : ErrorCode  ERR_NONE on success (including blank or comment
+                          lines), ERR_CMD_UNKNOWN or ERR_CMD_ARG on syntax
+                          errors, else as returned by the operation.
+ Notes       : When executing, the device must be open and devQuery filled
+               in by deviceQuery().
+ ****************************************************************************/
+ErrorCode scriptLine(
+  char * const line,
+  const char   execute)
+{
+	ErrorCode     status = ERR_NONE;
+	char         *arg[SCRIPT_ARGS],*p;
+	int           n;
+	unsigned int  addr,len;
+
+	if((p = strchr(line,'#'))) *p = 0;
+	for(n=0,p=strtok(line," \t\r\n");p;p=strtok(NULL," \t\r\n")) {
+		if(n == SCRIPT_ARGS) return ERR_CMD_ARG;
+		arg[n++] = p;
+	}
+	if(!n) return ERR_NONE;
+
+	if(!strcasecmp(arg[0],"query") && (n == 1)) {
+		if(execute) deviceInfo();
+	} else if(!strcasecmp(arg[0],"unlock") && (n == 1)) {
+		if(execute) status = deviceUnlock();
+	} else if(!strcasecmp(arg[0],"erase") && (n == 1)) {
+		if(execute) status = deviceErase();
+	} else if(!strcasecmp(arg[0],"write") && ((n == 2) ||
+	  ((n == 3) && !strcasecmp(arg[2],"noverify")))) {
+		if(!execute) status = scriptFile(arg[1]);
+		else         status = scriptHex(arg[1],0,n == 2);
+	} else if(!strcasecmp(arg[0],"verify") && (n == 2)) {
+		if(!execute) status = scriptFile(arg[1]);
+		else         status = scriptHex(arg[1],1,1);
+	} else if(!strcasecmp(arg[0],"dump") && (n == 4)) {
+		if(!scriptNumber(arg[1],&addr) || !scriptNumber(arg[2],&len))
+			status = ERR_CMD_ARG;
+		else if(execute)
+			status = deviceDump(addr,len,arg[3]);
+	} else if(!strcasecmp(arg[0],"probe") && (n == 1)) {
+		if(execute) status = probeRun();
+	} else if(!strcasecmp(arg[0],"sign") && (n == 1)) {
+		if(execute) status = deviceSign();
+	} else if(!strcasecmp(arg[0],"reset") && (n == 1)) {
+		if(execute) status = deviceReset();
+	} else {
+		status = ERR_CMD_UNKNOWN;
+	}
+
+	return status;
+}
+
+/****************************************************************************
+ Function    : scriptRun
+ Description : Checks or executes every command in a script file, stopping
+               at the first error.
+ Parameters  : char*      Script file name.
+               char       1 to execute, 0 to check only.
+ Returns     : ErrorCode  ERR_NONE on success, ERR_SCRIPT_OPEN if the file
+                          can't be read, else as returned by scriptLine().
+ ****************************************************************************/
+ErrorCode scriptRun(
+  const char * const filename,
+  const char         execute)
+{
+	ErrorCode status = ERR_NONE;
+	FILE     *fp;
+	char      line[1024],*p;
+	int       lineNum;
+
+	if(!(fp = fopen(filename,"r")))
+		return ERR_SCRIPT_OPEN;
+
+	for(lineNum=1;(ERR_NONE == status) && fgets(line,sizeof(line),fp);
+	  lineNum++) {
+		if(execute) {
+			p = line + strspn(line," \t");
+			if(*p && !strchr("#\r\n",*p))
+				(void)printf("> %.*s\n",(int)strcspn(p,"\r\n"),p);
+		}
+		if(ERR_NONE != (status = scriptLine(line,execute)))
+			(void)printf("Script '%s' stopped at line %d\n",filename,
+			  lineNum);
+	}
+	(void)fclose(fp);
+
+	return status;
+}
@@ -0,0 +1,383 @@
+/****************************************************************************
+ File        : serve.c
+ Description : Resident flash server, for development and hardware-in-the-
+               loop setups that re-flash the same board many times an hour.
+               The server opens the device once and keeps it open, taking
+               jobs over a local Unix socket, so a job costs only its USB
+               transfers rather than process start, USB initialisation,
+               enumeration and query every time.
+
+               A job is one connection.  The client sends script commands
+               (see script.c), one per line, then shuts down its side for
+               writing.  A hex image may accompany the request as a file
+               descriptor (SCM_RIGHTS), named '-' in write and verify
+               commands; a memfd holding the image works as well as an open
+               file, and either way the server maps it without copying.  The
+               server streams the job's output back, followed by a NUL byte
+               and a one-byte ErrorCode.  A request not complete within
+               SERVE_TIMEOUT fails, so that one stalled client can't hold
+               up every job after it; descriptors past the first are
+               closed.
+
+               After a reset the device leaves the bootloader and the bus,
+               and after a failed job it may have been unplugged or be
+               wedged; either way the server reopens it when the next job
+               arrives.
+
+ License     : This file is part of 'mphidflash' program.
+
+               'mphidflash' is free software: you can redistribute it and/or
+               modify it under the terms of the GNU General Public License
+               as published by the Free Software Foundation, either version
+               3 of the License, or (at your option) any later version.
+
+               'mphidflash' is distributed in the hope that it will be useful,
+               but WITHOUT ANY WARRANTY; without even the implied warranty
+               of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+               See the GNU General Public License for more details.
+
+               You should have received a copy of the GNU General Public
+               License along with 'mphidflash' source code.  If not,
+               see <http://www.gnu.org/licenses/>.
+
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "mphidflash.h"
+
+#define SERVE_REQUEST 8192  /* Largest job request, bytes       */
+#define SERVE_TIMEOUT 10000 /* ms allowed to receive a request  */
+#define SERVE_FDS     8     /* Descriptors taken per message    */
+
+static char           deviceOpen = 0;
+static unsigned short serveVendor,serveProduct;
+
+/* Open the device and query it, unless still open from an earlier job */
+static ErrorCode serveDevice(void)
+{
+	ErrorCode status;
+
+	if(deviceOpen) return ERR_NONE;
+
+	if(ERR_NONE != (status = usbOpen(serveVendor,serveProduct)))
+		return status;
+	if(ERR_NONE != (status = deviceQuery())) {
+		usbClose();
+		return status;
+	}
+	(void)printf("USB HID device found (%s)\n",usbTransportName());
+	deviceInfo();
+	if(ERR_NONE != (status = tuneLoad(serveVendor,serveProduct))) {
+		usbClose();
+		return status;
+	}
+	deviceOpen = 1;
+
+	return ERR_NONE;
+}
+
+/* Fill in a Unix socket address; 0 if the path is too long */
+static int serveAddress(
+  struct sockaddr_un * const addr,
+  const char * const         path)
+{
+	memset(addr,0,sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(addr->sun_path)) return 0;
+	(void)strcpy(addr->sun_path,path);
+	return 1;
+}
+
+/* Receive a whole request and any file descriptor sent with it; returns
+   its length, or -1 if it didn't all come within SERVE_TIMEOUT */
+static int serveReceive(
+  const int  conn,
+  char      *buf,
+  int       *fd)
+{
+	struct msghdr      msg;
+	struct iovec       iov;
+	struct cmsghdr    *cmsg;
+	struct pollfd      pfd;
+	char               control[CMSG_SPACE(SERVE_FDS * sizeof(int))];
+	int                len = 0,n,i,k,got;
+	unsigned long long now,deadline = traceClock() +
+	                     SERVE_TIMEOUT * 1000000ULL;
+
+	*fd        = -1;
+	pfd.fd     = conn;
+	pfd.events = POLLIN;
+	do {
+		if((now = traceClock()) >= deadline) return -1;
+		if(poll(&pfd,1,(int)((deadline - now + 999999) / 1000000)) <= 0)
+			return -1;
+		memset(&msg,0,sizeof(msg));
+		iov.iov_base       = &buf[len];
+		iov.iov_len        = SERVE_REQUEST - 1 - len;
+		msg.msg_iov        = &iov;
+		msg.msg_iovlen     = 1;
+		msg.msg_control    = control;
+		msg.msg_controllen = sizeof(control);
+		if((n = recvmsg(conn,&msg,MSG_CMSG_CLOEXEC)) < 0) return -1;
+		/* Keep the first descriptor; close any more */
+		for(cmsg=CMSG_FIRSTHDR(&msg);cmsg;cmsg=CMSG_NXTHDR(&msg,cmsg)) {
+			if((cmsg->cmsg_level != SOL_SOCKET) ||
+			   (cmsg->cmsg_type != SCM_RIGHTS))
+				continue;
+			k = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for(i=0;i<k;i++) {
+				memcpy(&got,CMSG_DATA(cmsg) + i * sizeof(int),sizeof(int));
+				if(*fd < 0) *fd = got;
+				else        (void)close(got);
+			}
+		}
+		len += n;
+	} while(n && (len < SERVE_REQUEST - 1));
+	buf[len] = 0;
+
+	return len;
+}
+
+/* Check (execute = 0) or run every line of a request */
+static ErrorCode serveLines(
+  const char * const request,
+  const char         execute)
+{
+	ErrorCode   status = ERR_NONE;
+	char        line[SERVE_REQUEST],word[16];
+	const char *p,*end;
+	int         len,lineNum;
+
+	for(p=request,lineNum=1;*p && (ERR_NONE == status);p=end,lineNum++) {
+		if((end = strchr(p,'\n'))) len = end++ - p;
+		else                       end = p + (len = strlen(p));
+		memcpy(line,p,len);
+		line[len] = 0;
+		word[0]   = 0;
+		if(execute && (1 == sscanf(line,"%15s",word)) && (word[0] != '#'))
+			(void)printf("> %s\n",line);
+		if(ERR_NONE != (status = scriptLine(line,execute)))
+			(void)printf("Job stopped at line %d\n",lineNum);
+		/* The device has left the bootloader; reopen for next job */
+		if(execute && (ERR_NONE == status) && !strcasecmp(word,"reset")) {
+			usbClose();
+			deviceOpen = 0;
+		}
+	}
+
+	return status;
+}
+
+/* Run one job on the given connection */
+static ErrorCode serveJob(const int conn)
+{
+	ErrorCode status;
+	char      request[SERVE_REQUEST],result[2];
+	int       out;
+
+	status = (serveReceive(conn,request,&scriptFd) < 0) ?
+	  ERR_SERVE_REQUEST : ERR_NONE;
+
+	/* Job output goes to the client rather than the server's console */
+	(void)fflush(stdout);
+	out = dup(STDOUT_FILENO);
+	(void)dup2(conn,STDOUT_FILENO);
+
+	if((ERR_NONE == status) &&
+	   (ERR_NONE == (status = serveLines(request,0))) &&
+	   (ERR_NONE == (status = serveDevice()))) {
+		deviceLock(1);
+		/* A failed job may have left the device unplugged or wedged;
+		   open it afresh for the next job, as watch mode does */
+		if((ERR_NONE != (status = serveLines(request,1))) && deviceOpen) {
+			usbClose();
+			deviceOpen = 0;
+		}
+	}
+
+	(void)fflush(stdout);
+	(void)dup2(out,STDOUT_FILENO);
+	(void)close(out);
+
+	if(scriptFd >= 0) {
+		(void)close(scriptFd);
+		scriptFd = -1;
+	}
+
+	result[0] = 0;
+	result[1] = status;
+	(void)write(conn,result,sizeof(result));
+
+	return status;
+}
+
+/****************************************************************************
+ Function    : serveRun
+ Description : Runs the flash server on the given socket until killed.
+ Parameters  : char*           Socket path; any existing file is replaced.
+               unsigned short  Vendor ID of device to serve.
+               unsigned short  Product ID of device to serve.
+ Returns     : ErrorCode       ERR_SERVE_SOCKET if the socket can't be set
+                               up; doesn't return otherwise.
+ ****************************************************************************/
+ErrorCode serveRun(
+  const char * const   path,
+  const unsigned short vendorID,
+  const unsigned short productID)
+{
+	struct sockaddr_un addr;
+	ErrorCode          status;
+	unsigned long      jobs = 0;
+	unsigned long long start;
+	int                sock,conn;
+
+	if(!serveAddress(&addr,path) ||
+	   ((sock = socket(AF_UNIX,SOCK_STREAM,0)) < 0))
+		return ERR_SERVE_SOCKET;
+	(void)unlink(path);
+	if(bind(sock,(struct sockaddr *)&addr,sizeof(addr)) ||
+	   listen(sock,8)) {
+		(void)close(sock);
+		return ERR_SERVE_SOCKET;
+	}
+
+	/* A client going away mid-job mustn't take the server with it */
+	(void)signal(SIGPIPE,SIG_IGN);
+	/* Nor a hung device: that fails the job, not the server */
+	watchdogResident();
+
+	serveVendor  = vendorID;
+	serveProduct = productID;
+	if(ERR_NONE != serveDevice())
+		(void)puts("Device not found yet; will retry for each job");
+	(void)printf("Serving jobs on %s\n",path);
+	(void)fflush(stdout);
+
+	for(;;) {
+		if((conn = accept(sock,NULL,NULL)) < 0)
+			continue;
+		start  = traceClock();
+		status = serveJob(conn);
+		(void)close(conn);
+		metricsEnd(status);
+		(void)printf("Job %lu: %.1f ms, status %d\n",++jobs,
+		  (traceClock() - start) / 1e6,status);
+		(void)fflush(stdout);
+	}
+}
+
+/****************************************************************************
+ Function    : serveClient
+ Description : Sends a job to a flash server and relays its output.
+ Parameters  : char*      Socket path.
+               char*      Script commands, separated by ';'.  The hex file
+                          named in write and verify commands is opened here
+                          and passed to the server, so paths are relative
+                          to the client; at most one file per job.
+ Returns     : ErrorCode  Status of the job on the server, ERR_SERVE_SOCKET
+                          if the server can't be reached or drops the job,
+                          ERR_CMD_ARG for more than one hex file, or
+                          ERR_HEX_OPEN if the file can't be opened.
+ ****************************************************************************/
+ErrorCode serveClient(
+  const char * const path,
+  const char * const commands)
+{
+	struct sockaddr_un addr;
+	struct msghdr      msg;
+	struct iovec       iov;
+	struct cmsghdr    *cmsg;
+	char               control[CMSG_SPACE(sizeof(int))],
+	                   request[SERVE_REQUEST],copy[SERVE_REQUEST],
+	                   buf[1024],*line,*word,*cmd,*hexName = NULL,
+	                   *lineSave,*wordSave;
+	int                sock,fd = -1,n,i,arg,gotNul = 0;
+	ErrorCode          status = ERR_SERVE_SOCKET;
+
+	/* Rewrite as one command per line, with the hex file named '-' */
+	if(strlen(commands) >= sizeof(copy)) return ERR_CMD_ARG;
+	(void)strcpy(copy,commands);
+	request[0] = 0;
+	for(line=strtok_r(copy,";",&lineSave);line;
+	  line=strtok_r(NULL,";",&lineSave)) {
+		for(arg=0,cmd=word=strtok_r(line," \t",&wordSave);word;
+		  arg++,word=strtok_r(NULL," \t",&wordSave)) {
+			if((arg == 1) && strcmp(word,"-") &&
+			   (!strcasecmp(cmd,"write") || !strcasecmp(cmd,"verify"))) {
+				if(hexName && strcmp(hexName,word)) {
+					if(fd >= 0) (void)close(fd);
+					return ERR_CMD_ARG;
+				}
+				if(!hexName) {
+					if((fd = open(word,O_RDONLY)) < 0)
+						return ERR_HEX_OPEN;
+					hexName = word;
+				}
+				word = "-";
+			}
+			(void)snprintf(request + strlen(request),
+			  sizeof(request) - strlen(request),"%s%s",arg ? " " : "",word);
+		}
+		(void)snprintf(request + strlen(request),
+		  sizeof(request) - strlen(request),"\n");
+	}
+
+	if(!serveAddress(&addr,path) ||
+	   ((sock = socket(AF_UNIX,SOCK_STREAM,0)) < 0)) {
+		if(fd >= 0) (void)close(fd);
+		return ERR_SERVE_SOCKET;
+	}
+	if(connect(sock,(struct sockaddr *)&addr,sizeof(addr))) {
+		(void)close(sock);
+		if(fd >= 0) (void)close(fd);
+		return ERR_SERVE_SOCKET;
+	}
+
+	memset(&msg,0,sizeof(msg));
+	iov.iov_base   = request;
+	iov.iov_len    = strlen(request);
+	msg.msg_iov    = &iov;
+	msg.msg_iovlen = 1;
+	if(fd >= 0) {
+		msg.msg_control      = control;
+		msg.msg_controllen   = sizeof(control);
+		cmsg                 = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level     = SOL_SOCKET;
+		cmsg->cmsg_type      = SCM_RIGHTS;
+		cmsg->cmsg_len       = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg),&fd,sizeof(int));
+	}
+	n = sendmsg(sock,&msg,0);
+	if(fd >= 0) (void)close(fd);
+	if(n != (int)iov.iov_len) {
+		(void)close(sock);
+		return ERR_SERVE_SOCKET;
+	}
+	(void)shutdown(sock,SHUT_WR);
+
+	/* Relay output up to the NUL, then take the status byte after it */
+	while((n = read(sock,buf,sizeof(buf))) > 0) {
+		for(i=0;i<n;i++) {
+			if(gotNul) {
+				status = buf[i];
+				break;
+			} else if(!buf[i]) {
+				gotNul = 1;
+			} else {
+				(void)putchar(buf[i]);
+			}
+		}
+		(void)fflush(stdout);
+		if(i < n) break;
+	}
+	(void)close(sock);
+
+	return status;
+}
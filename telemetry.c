@@ -0,0 +1,370 @@
+/****************************************************************************
+ File        : telemetry.c
+ Description : Run log for production stations.  Each run can append one
+               line to a local log file: when and where it ran (station and
+               physical USB port), which board (device serial number) and
+               image (hash of the hex file), how it ended, how long the
+               erase, write and verify phases took and the spread of USB
+               round-trip times seen.  Many stations may share one log
+               file; each record goes out in a single append.
+
+               --history reads the log back and reports rolling duration
+               percentiles per station and port, then lists runs that were
+               markedly slower than the runs before them on the same
+               station, port and image: a failing hub, cable or fixture
+               shows up there long before it fails outright.
+
+               One record per line, fields separated by spaces, '-' where a
+               value is unknown:
+
+                 time station port serial image status total erase write
+                 verify rtt50 rtt90 rtt99 rtts
+
+               time is seconds since 1970, image the 64-bit FNV-1a hash of
+               the hex file (hexGetHash()), status the ErrorCode, phase
+               times in milliseconds and round-trip percentiles in
+               microseconds over rtts samples.
+
+ License     : This file is part of 'mphidflash' program.
+
+               'mphidflash' is free software: you can redistribute it and/or
+               modify it under the terms of the GNU General Public License
+               as published by the Free Software Foundation, either version
+               3 of the License, or (at your option) any later version.
+
+               'mphidflash' is distributed in the hope that it will be useful,
+               but WITHOUT ANY WARRANTY; without even the implied warranty
+               of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+               See the GNU General Public License for more details.
+
+               You should have received a copy of the GNU General Public
+               License along with 'mphidflash' source code.  If not,
+               see <http://www.gnu.org/licenses/>.
+
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef WIN
+#include <unistd.h>
+#endif
+
+#include "mphidflash.h"
+
+#define TELEM_BUCKET     10  /* us per round-trip histogram bucket         */
+#define TELEM_BUCKETS 10000  /* Covers 0-100 ms; slower goes in the last   */
+#define TELEM_WINDOW     50  /* Earlier runs making up a baseline          */
+#define TELEM_MIN        10  /* Runs needed before a baseline is trusted   */
+#define TELEM_Z         3.0  /* Robust z-score above which a run is slow   */
+
+char                      *telemetryStation = NULL; /* Set by --station    */
+
+static unsigned long long  phaseTime[PHASE_COUNT];  /* ns                  */
+static unsigned long       rttHist[TELEM_BUCKETS],rttCount = 0;
+static unsigned long long  runStart = 0;
+static char                devSerial[64] = "-",
+                           devPort[64]   = "-";
+
+/* One parsed log record */
+typedef struct {
+	long long          time;
+	char               station[64],port[64],serial[64];
+	unsigned long long image;
+	int                status;
+	double             total,phase[PHASE_COUNT],rtt[3];
+	unsigned long      rtts;
+} Record;
+
+/* Replace anything that would split a field */
+static void telemetryField(char * const s)
+{
+	char *p;
+
+	if(!*s) (void)strcpy(s,"-");
+	for(p=s;*p;p++)
+		if((*p <= ' ') || (*p > '~')) *p = '_';
+}
+
+/* Round-trip time at the given percentile of samples so far, us */
+static unsigned long telemetryRtt(const int percent)
+{
+	unsigned long want = (rttCount * percent + 99) / 100,seen = 0;
+	int           i;
+
+	for(i=0;i<TELEM_BUCKETS;i++)
+		if((seen += rttHist[i]) >= want) break;
+	return (unsigned long)i * TELEM_BUCKET;
+}
+
+/****************************************************************************
+ Function    : telemetryStart
+ Description : Starts timing the run.
+ Parameters  : None (void)
+ Returns     : Nothing (void)
+ ****************************************************************************/
+void telemetryStart(void)
+{
+	runStart = traceClock();
+}
+
+/****************************************************************************
+ Function    : telemetryDevice
+ Description : Notes the open device's serial number and port for the log.
+ Parameters  : None (void)
+ Returns     : Nothing (void)
+ ****************************************************************************/
+void telemetryDevice(void)
+{
+	if(!usbSerial(devSerial,sizeof(devSerial))) (void)strcpy(devSerial,"-");
+	if(!schedPort(devPort,sizeof(devPort)))     (void)strcpy(devPort,"-");
+	telemetryField(devSerial);
+	telemetryField(devPort);
+}
+
+/****************************************************************************
+ Function    : telemetryPhase
+ Description : Adds time spent in one phase of the run.
+ Parameters  : Phase               PHASE_ERASE, PHASE_WRITE or PHASE_VERIFY.
+               unsigned long long  Time taken, ns.
+ Returns     : Nothing (void)
+ ****************************************************************************/
+void telemetryPhase(
+  const Phase              phase,
+  const unsigned long long ns)
+{
+	phaseTime[phase] += ns;
+}
+
+/****************************************************************************
+ Function    : telemetrySample
+ Description : Adds one USB round-trip time to the run's distribution.
+ Parameters  : unsigned long long  Round-trip time, ns.
+ Returns     : Nothing (void)
+ ****************************************************************************/
+void telemetrySample(const unsigned long long rtt)
+{
+	unsigned long long i = rtt / (TELEM_BUCKET * 1000);
+
+	rttHist[(i < TELEM_BUCKETS) ? i : TELEM_BUCKETS - 1]++;
+	rttCount++;
+}
+
+/****************************************************************************
+ Function    : telemetryLog
+ Description : Appends the run's record to the log file.
+ Parameters  : char*      Log file name.
+               ErrorCode  Outcome of the run.
+ Returns     : ErrorCode  ERR_NONE on success, ERR_LOG_OPEN if the log can't
+                          be written.
+ ****************************************************************************/
+ErrorCode telemetryLog(
+  const char * const filename,
+  const ErrorCode    status)
+{
+	char               station[64],line[512];
+	unsigned long long image = hexGetHash();
+	FILE              *fp;
+	int                n;
+
+	if(telemetryStation)
+		(void)snprintf(station,sizeof(station),"%s",telemetryStation);
+#ifndef WIN
+	else if(gethostname(station,sizeof(station)))
+		station[0] = 0;
+#else
+	else
+		(void)snprintf(station,sizeof(station),"%s",
+		  getenv("COMPUTERNAME") ? getenv("COMPUTERNAME") : "");
+#endif
+	station[sizeof(station) - 1] = 0;
+	telemetryField(station);
+
+	n = snprintf(line,sizeof(line),"%lld %s %s %s ",(long long)time(NULL),
+	  station,devPort,devSerial);
+	if(image)
+		n += snprintf(&line[n],sizeof(line) - n,"%016llx",image);
+	else
+		n += snprintf(&line[n],sizeof(line) - n,"-");
+	n += snprintf(&line[n],sizeof(line) - n," %d %.1f %.1f %.1f %.1f",
+	  status,(traceClock() - runStart) / 1e6,phaseTime[PHASE_ERASE] / 1e6,
+	  phaseTime[PHASE_WRITE] / 1e6,phaseTime[PHASE_VERIFY] / 1e6);
+	if(rttCount)
+		(void)snprintf(&line[n],sizeof(line) - n," %lu %lu %lu %lu\n",
+		  telemetryRtt(50),telemetryRtt(90),telemetryRtt(99),rttCount);
+	else
+		(void)snprintf(&line[n],sizeof(line) - n," - - - 0\n");
+
+	/* One fputs of a short line in append mode is one write(), so
+	   records from stations sharing the file don't interleave. */
+	if(!(fp = fopen(filename,"a")))
+		return ERR_LOG_OPEN;
+	n = (EOF == fputs(line,fp));
+	if(fclose(fp) || n)
+		return ERR_LOG_OPEN;
+
+	return ERR_NONE;
+}
+
+/* Parse one log line; 0 if malformed */
+static int telemetryParse(
+  char * const  line,
+  Record       *r)
+{
+	char image[20],rtt[3][16];
+	int  i;
+
+	if(14 != sscanf(line,"%lld %63s %63s %63s %19s %d %lf %lf %lf %lf "
+	  "%15s %15s %15s %lu",&r->time,r->station,r->port,r->serial,image,
+	  &r->status,&r->total,&r->phase[PHASE_ERASE],&r->phase[PHASE_WRITE],
+	  &r->phase[PHASE_VERIFY],rtt[0],rtt[1],rtt[2],&r->rtts))
+		return 0;
+	r->image = strtoull(image,NULL,16);
+	for(i=0;i<3;i++)
+		r->rtt[i] = strtod(rtt[i],NULL);
+	return 1;
+}
+
+static int telemetryCompare(const void *a,const void *b)
+{
+	double x = *(const double *)a,y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of n values; sorts them */
+static double telemetryPercentile(
+  double    *v,
+  const int  n,
+  const int  percent)
+{
+	int i = (n * percent + 99) / 100;
+
+	qsort(v,n,sizeof(double),telemetryCompare);
+	return v[(i > 0) ? i - 1 : 0];
+}
+
+/****************************************************************************
+ Function    : telemetryReport
+ Description : Reports rolling statistics from a run log, per station and
+               port, and lists runs that were slow against their baseline:
+               the median of up to TELEM_WINDOW earlier successful runs on
+               the same station, port and image, with at least TELEM_MIN
+               such runs.  A run is slow when its total time exceeds that
+               median by more than TELEM_Z times the baseline's spread
+               (median absolute deviation, scaled to match a standard
+               deviation, and no less than 1% of the median).
+ Parameters  : char*      Log file name.
+ Returns     : ErrorCode  ERR_NONE on success, ERR_LOG_OPEN if the log can't
+                          be read.
+ ****************************************************************************/
+ErrorCode telemetryReport(const char * const filename)
+{
+	FILE         *fp;
+	Record       *rec = NULL,*r,*more;
+	char          line[512],when[32];
+	double       *v,*dev,median,spread;
+	int           count = 0,alloc = 0,bad = 0,slow = 0,i,j,k,n,runs,fails,
+	              *done;
+	time_t        t;
+
+	if(!(fp = fopen(filename,"r")))
+		return ERR_LOG_OPEN;
+	while(fgets(line,sizeof(line),fp)) {
+		if(count == alloc) {
+			alloc = alloc ? alloc * 2 : 256;
+			if(!(more = realloc(rec,alloc * sizeof(Record)))) break;
+			rec = more;
+		}
+		if(telemetryParse(line,&rec[count])) count++;
+		else                                 bad++;
+	}
+	(void)fclose(fp);
+
+	v    = malloc((count + 1) * sizeof(double));
+	dev  = malloc((TELEM_WINDOW + 1) * sizeof(double));
+	done = calloc(count + 1,sizeof(int));
+	if(!v || !dev || !done) {
+		free(rec); free(v); free(dev); free(done);
+		return ERR_LOG_OPEN;
+	}
+
+	(void)printf("%d runs in '%s'",count,filename);
+	if(bad) (void)printf(" (%d malformed lines skipped)",bad);
+	(void)printf("\n\nRolling total time, last %d good runs (ms):\n"
+	  "Station          Port          Runs Fails     p50     p90     p99"
+	  "  RTT p50 us\n",TELEM_WINDOW);
+
+	/* One line per station and port, in order of first appearance */
+	for(i=0;i<count;i++) {
+		if(done[i]) continue;
+		for(j=count - 1,n=runs=fails=0;j>=i;j--) {
+			r = &rec[j];
+			if(strcmp(r->station,rec[i].station) ||
+			   strcmp(r->port,rec[i].port))
+				continue;
+			done[j] = 1;
+			runs++;
+			if(r->status)             fails++;
+			else if(n < TELEM_WINDOW) v[n++] = r->total;
+		}
+		(void)printf("%-16.16s %-12.12s %5d %5d",rec[i].station,rec[i].port,
+		  runs,fails);
+		if(n) {
+			(void)printf(" %7.0f",telemetryPercentile(v,n,50));
+			(void)printf(" %7.0f",telemetryPercentile(v,n,90));
+			(void)printf(" %7.0f",telemetryPercentile(v,n,99));
+			/* Median of the per-run RTT medians, same runs */
+			for(j=count - 1,k=0;(j>=i) && (k < n);j--) {
+				r = &rec[j];
+				if(!r->status && r->rtts &&
+				   !strcmp(r->station,rec[i].station) &&
+				   !strcmp(r->port,rec[i].port))
+					v[k++] = r->rtt[0];
+			}
+			if(k) (void)printf(" %11.0f",telemetryPercentile(v,k,50));
+		}
+		(void)putchar('\n');
+	}
+
+	/* Each good run against the good runs before it on the same
+	   station, port and image */
+	(void)printf("\nSlow runs (total more than %.0f x spread above "
+	  "baseline median):\n",TELEM_Z);
+	for(i=0;i<count;i++) {
+		if(rec[i].status) continue;
+		for(j=i - 1,n=0;(j >= 0) && (n < TELEM_WINDOW);j--) {
+			r = &rec[j];
+			if(!r->status && (r->image == rec[i].image) &&
+			   !strcmp(r->station,rec[i].station) &&
+			   !strcmp(r->port,rec[i].port))
+				v[n++] = r->total;
+		}
+		if(n < TELEM_MIN) continue;
+		median = telemetryPercentile(v,n,50);
+		for(k=0;k<n;k++)
+			dev[k] = (v[k] > median) ? v[k] - median : median - v[k];
+		spread = 1.4826 * telemetryPercentile(dev,n,50);
+		if(spread < median / 100) spread = median / 100;
+		if(rec[i].total <= median + TELEM_Z * spread) continue;
+
+		t = (time_t)rec[i].time;
+		(void)strftime(when,sizeof(when),"%Y-%m-%d %H:%M:%S",
+		  localtime(&t));
+		(void)printf("%s %s %s serial %s: %.0f ms vs %.0f ms "
+		  "(%.1f x spread, %d runs)\n",when,rec[i].station,rec[i].port,
+		  rec[i].serial,rec[i].total,median,
+		  (rec[i].total - median) / spread,n);
+		slow++;
+	}
+	if(!slow) (void)puts("None");
+
+	free(rec);
+	free(v);
+	free(dev);
+	free(done);
+
+	return ERR_NONE;
+}
@@ -0,0 +1,241 @@
+/****************************************************************************
+ File        : trace.c
+ Description : Compact binary capture of every report exchanged with the
+               device, for later replay (see usb-replay.c).  Unlike the
+               DEBUG hex dumps this is cheap enough to leave enabled on a
+               production station: the USB path only copies each report
+               into a lock-free ring buffer, and a separate writer thread
+               drains the ring to disk.
+
+               Trace file layout (all multi-byte fields little-endian):
+
+                 header  4 bytes  "MPHT"
+                         1 byte   format version (TRACE_VERSION)
+                         3 bytes  reserved, zero
+                 record  4 bytes  microseconds since start of previous
+                                  record (first record: since trace open)
+                         4 bytes  microseconds the operation itself took
+                                  (write call for OUT, read wait for IN)
+                         1 byte   direction, TRACE_OUT or TRACE_IN
+                         2 bytes  report length in bytes
+                         n bytes  report data
+
+               All timestamps come from a monotonic clock.
+
+ License     : This file is part of 'mphidflash' program.
+
+               'mphidflash' is free software: you can redistribute it and/or
+               modify it under the terms of the GNU General Public License
+               as published by the Free Software Foundation, either version
+               3 of the License, or (at your option) any later version.
+
+               'mphidflash' is distributed in the hope that it will be useful,
+               but WITHOUT ANY WARRANTY; without even the implied warranty
+               of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+               See the GNU General Public License for more details.
+
+               You should have received a copy of the GNU General Public
+               License along with 'mphidflash' source code.  If not,
+               see <http://www.gnu.org/licenses/>.
+
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+
+#ifndef WIN
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#else
+#include <windows.h>
+#endif
+
+#include "mphidflash.h"
+
+#define RING_SIZE (1 << 18)               /* Must be a power of two     */
+#define RING_MASK (RING_SIZE - 1)
+
+static FILE              *traceFp = NULL;  /* Open trace file, if any    */
+static unsigned long long lastStart;       /* Start of previous record   */
+static unsigned long      dropped;         /* Records lost to full ring  */
+
+#ifndef WIN
+static unsigned char      ring[RING_SIZE];
+static unsigned int       ringHead = 0;    /* Written by USB thread only */
+static unsigned int       ringTail = 0;    /* Written by drain thread    */
+static int                stopping;
+static pthread_t          drainThread;
+#endif
+
+/****************************************************************************
+ Function    : traceClock
+ Description : Monotonic clock shared by all timing code.
+ Parameters  : None (void)
+ Returns     : unsigned long long  Nanoseconds from an arbitrary epoch.
+ ****************************************************************************/
+unsigned long long traceClock(void)
+{
+#ifndef WIN
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+	LARGE_INTEGER count,freq;
+
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (unsigned long long)((double)count.QuadPart * 1e9 /
+	  (double)freq.QuadPart);
+#endif
+}
+
+#ifndef WIN
+/****************************************************************************
+ Function    : traceDrain
+ Description : Writer thread; copies whatever the USB thread has queued in
+               the ring out to the trace file, until told to stop and the
+               ring is empty.
+ ****************************************************************************/
+static void *traceDrain(void *arg)
+{
+	unsigned int head,tail,n;
+
+	for(;;) {
+		head = __atomic_load_n(&ringHead,__ATOMIC_ACQUIRE);
+		tail = ringTail;
+		if(head == tail) {
+			if(__atomic_load_n(&stopping,__ATOMIC_ACQUIRE)) break;
+			(void)usleep(1000);
+			continue;
+		}
+		/* Up to the physical end of the ring, then wrap on next loop */
+		n = head - tail;
+		if(n > RING_SIZE - (tail & RING_MASK))
+			n = RING_SIZE - (tail & RING_MASK);
+		(void)fwrite(&ring[tail & RING_MASK],1,n,traceFp);
+		__atomic_store_n(&ringTail,tail + n,__ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+/* Copy bytes into the ring at the given (unmasked) position */
+static void ringPut(unsigned int pos,const unsigned char *src,int len)
+{
+	unsigned int n = RING_SIZE - (pos & RING_MASK);
+
+	if(n > (unsigned int)len) n = len;
+	memcpy(&ring[pos & RING_MASK],src,n);
+	memcpy(ring,&src[n],len - n);
+}
+#endif
+
+/****************************************************************************
+ Function    : traceOpen
+ Description : Create trace file and start recording.
+ Parameters  : char*      Filename (must be non-NULL).
+ Returns     : ErrorCode  ERR_NONE on success, ERR_TRACE_OPEN on error.
+ ****************************************************************************/
+ErrorCode traceOpen(char * const filename)
+{
+	static const unsigned char header[8] =
+	  { 'M','P','H','T',TRACE_VERSION,0,0,0 };
+
+	if(!(traceFp = fopen(filename,"wb")))
+		return ERR_TRACE_OPEN;
+
+	(void)fwrite(header,1,sizeof(header),traceFp);
+	lastStart = traceClock();
+	dropped   = 0;
+
+#ifndef WIN
+	ringHead = ringTail = 0;
+	stopping = 0;
+	if(pthread_create(&drainThread,NULL,traceDrain,NULL)) {
+		(void)fclose(traceFp);
+		traceFp = NULL;
+		return ERR_TRACE_OPEN;
+	}
+#endif
+
+	return ERR_NONE;
+}
+
+/****************************************************************************
+ Function    : tracePacket
+ Description : Record one report.  Never blocks on file I/O; if the ring
+               is full the record is counted as dropped instead.
+ Parameters  : unsigned char       TRACE_OUT or TRACE_IN.
+               unsigned char*      Report data.
+               int                 Report length in bytes.
+               unsigned long long  traceClock() value when the operation
+                                   started; completion time is now.
+ Returns     : Nothing (void)
+ ****************************************************************************/
+void tracePacket(
+  const unsigned char        dir,
+  const unsigned char       *buf,
+  const int                  len,
+  const unsigned long long   start)
+{
+	unsigned char      rec[11];
+	unsigned long long now;
+	unsigned int       delta,dur;
+
+	if(!traceFp) return;
+
+	now       = traceClock();
+	delta     = (unsigned int)((start - lastStart) / 1000);
+	dur       = (unsigned int)((now - start) / 1000);
+	lastStart = start;
+
+	bufWrite32(rec,0,delta);
+	bufWrite32(rec,4,dur);
+	rec[8]  = dir;
+	rec[9]  = len & 0xff;
+	rec[10] = (len >> 8) & 0xff;
+
+#ifndef WIN
+	{
+		unsigned int head = ringHead,
+		             tail = __atomic_load_n(&ringTail,__ATOMIC_ACQUIRE);
+
+		if(RING_SIZE - (head - tail) < sizeof(rec) + len) {
+			dropped++;
+			return;
+		}
+		ringPut(head,rec,sizeof(rec));
+		ringPut(head + sizeof(rec),buf,len);
+		__atomic_store_n(&ringHead,head + sizeof(rec) + len,
+		  __ATOMIC_RELEASE);
+	}
+#else
+	(void)fwrite(rec,1,sizeof(rec),traceFp);
+	(void)fwrite(buf,1,len,traceFp);
+#endif
+}
+
+/****************************************************************************
+ Function    : traceClose
+ Description : Flush any queued records and close the trace file.  Safe to
+               call when no trace is open.
+ Parameters  : None (void)
+ Returns     : Nothing (void)
+ ****************************************************************************/
+void traceClose(void)
+{
+	if(!traceFp) return;
+
+#ifndef WIN
+	__atomic_store_n(&stopping,1,__ATOMIC_RELEASE);
+	(void)pthread_join(drainThread,NULL);
+#endif
+	(void)fclose(traceFp);
+	traceFp = NULL;
+
+	if(dropped)
+		(void)printf("Warning: %lu trace records dropped (ring full)\n",
+		  dropped);
+}
@@ -0,0 +1,381 @@
+/****************************************************************************
+ File        : tune.c
+ Description : Tuning profiles, so that each kind of device is driven the
+               way that suits it best rather than one way for all.  With
+               --tune, a short sweep is run against the open device, only
+               reading from it: QUERY_DEVICE and GET_DATA round trips, and
+               CRC32_RANGE over the same memory in spans of several sizes.
+               From it come the three things that differ from one
+               bootloader to the next and that this program can choose:
+
+               verify   By CRC32_RANGE or by reading back with GET_DATA,
+                        whichever covers memory faster.  A bootloader with
+                        a slow CRC can lose to plain reads.
+               span     The most bytes one CRC32_RANGE checks.  Long spans
+                        save round trips, but each keeps the device busy
+                        longer; past a point nothing is gained, and a miss
+                        is found less exactly.
+               timeout  The floor of the adaptive USB timeout (see
+                        watchdog.c), from the slowest round trip seen: low
+                        enough that a wedged device is given up on quickly,
+                        high enough to cover a whole CRC span.
+
+               The result is stored in a profiles file, keyed by vendor
+               and product ID, device family and a hash of the memory map
+               (deviceMapText()) and extensions, and is loaded after
+               QUERY_DEVICE on every later run with a device that matches.
+               A device without a profile is driven as before.
+
+               The file is text, one profile to a "profile" line and the
+               lines after it; tuning again replaces the profile for the
+               device and leaves the others as they were.
+
+ License     : This file is part of 'mphidflash' program.
+
+               'mphidflash' is free software: you can redistribute it and/or
+               modify it under the terms of the GNU General Public License
+               as published by the Free Software Foundation, either version
+               3 of the License, or (at your option) any later version.
+
+               'mphidflash' is distributed in the hope that it will be useful,
+               but WITHOUT ANY WARRANTY; without even the implied warranty
+               of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+               See the GNU General Public License for more details.
+
+               You should have received a copy of the GNU General Public
+               License along with 'mphidflash' source code.  If not,
+               see <http://www.gnu.org/licenses/>.
+
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mphidflash.h"
+
+#define TUNE_QUERIES  200       /* QUERY_DEVICE round trips            */
+#define TUNE_READ     0x4000    /* Bytes read back with GET_DATA       */
+#define TUNE_REGION   0x10000   /* Most bytes checked at each CRC span */
+#define TUNE_SPAN     1024      /* Shortest CRC span tried; then x4    */
+#define TUNE_BETTER   1.1       /* A longer span must be this much
+                                   faster to be chosen                 */
+#define TUNE_RTT      10        /* Floor = TUNE_RTT x slowest RTT...   */
+#define TUNE_CRC      3         /* ...or TUNE_CRC x slowest span       */
+#define TUNE_FLOOR    20        /* ms, lowest floor set                */
+#define TUNE_CEILING  5000      /* ms, the timeout's ceiling           */
+#define TUNE_MAP      512       /* Longest memory map text             */
+
+char       *tuneFile = NULL;    /* Set by --profiles; NULL = default   */
+char        tuneOff  = 0;       /* Set by --no-profile                 */
+
+extern unsigned char *usbBuf;   /* In usb.c */
+
+/* Profiles file: as given, or in the user's home directory */
+static const char *tunePath(void)
+{
+	static char path[1024];
+	const char *dir;
+
+	if(tuneFile) return tuneFile;
+#ifndef WIN
+	if(!(dir = getenv("HOME"))) return NULL;
+	(void)snprintf(path,sizeof(path),"%s/.mphidflash-profiles",dir);
+#else
+	if(!(dir = getenv("APPDATA"))) return NULL;
+	(void)snprintf(path,sizeof(path),"%s\\mphidflash-profiles",dir);
+#endif
+	return path;
+}
+
+/* Hash of the memory map and extensions of the device just queried */
+static unsigned int tuneMapHash(void)
+{
+	char map[TUNE_MAP];
+	int  n;
+
+	deviceMapText(map,sizeof(map));
+	n = strlen(map);
+	(void)snprintf(&map[n],sizeof(map) - n,"extensions %d %u\n",deviceExt,
+	  devicePage);
+
+	return hexCrc32(0,(unsigned char *)map,strlen(map));
+}
+
+/* Use a profile's settings, and say so */
+static void tuneApply(
+  char               crc,
+  const unsigned int span,
+  const int          floor)
+{
+	if(crc && !(deviceExt & EXT_CRC32))
+		crc = 0;
+	if(!crc)
+		deviceExt &= ~EXT_CRC32;
+	hexSetCrcSpan(span);
+	watchdogFloor(floor);
+
+	if(crc)
+		(void)printf("Tuned: verify by CRC in %u-byte spans, ",span);
+	else
+		(void)printf("Tuned: verify by reading back, ");
+	(void)printf("timeout floor %d ms\n",floor);
+}
+
+/****************************************************************************
+ Function    : tuneLoad
+ Description : Looks up the open device in the profiles file and, if it's
+               there, uses the profile tuned for it.
+ Parameters  : unsigned short  Vendor ID the device was opened by.
+               unsigned short  Product ID the device was opened by.
+ Returns     : ErrorCode       ERR_NONE on success (profile or not),
+                               ERR_PROFILE_FILE if the file is there but
+                               isn't a profiles file.
+ Notes       : Call after deviceQuery().  Does nothing with --no-profile,
+               or if there's no profiles file yet.
+ ****************************************************************************/
+ErrorCode tuneLoad(
+  const unsigned short vendorID,
+  const unsigned short productID)
+{
+	FILE         *fp;
+	const char   *path;
+	char          line[256],word[16],how[16];
+	unsigned int  vid,pid,hash,mapHash,n,span = 0;
+	int           family,ms,floor = 0,match = 0,crc = 0;
+	ErrorCode     status = ERR_NONE;
+
+	if(tuneOff || !(path = tunePath()) || !(fp = fopen(path,"r")))
+		return ERR_NONE;
+
+	mapHash = tuneMapHash();
+	while((ERR_NONE == status) && fgets(line,sizeof(line),fp)) {
+		if((1 != sscanf(line,"%15s",word)) || (word[0] == '#'))
+			continue;
+		if(!strcmp(word,"profile")) {
+			if(4 != sscanf(line,"%*s %x:%x %d %x",&vid,&pid,&family,&hash))
+				status = ERR_PROFILE_FILE;
+			match = (vid == vendorID) && (pid == productID) &&
+			  (family == devQuery.DeviceFamily) && (hash == mapHash);
+		} else if(!strcmp(word,"verify")) {
+			n = 0;
+			if((1 > sscanf(line,"%*s %15s %u",how,&n)) ||
+			   (strcmp(how,"read") && (strcmp(how,"crc") || !n)))
+				status = ERR_PROFILE_FILE;
+			else if(match) {
+				crc  = !strcmp(how,"crc");
+				span = n;
+			}
+		} else if(!strcmp(word,"timeout")) {
+			if((1 != sscanf(line,"%*s %d",&ms)) || (ms < 1))
+				status = ERR_PROFILE_FILE;
+			else if(match)
+				floor = ms;
+		} else {
+			status = ERR_PROFILE_FILE;
+		}
+	}
+	(void)fclose(fp);
+
+	/* A profile without a timeout is of no use; take it as none */
+	if((ERR_NONE == status) && floor)
+		tuneApply(crc,span,floor);
+
+	return status;
+}
+
+/* Write a profile into the file, in place of any for the same device */
+static ErrorCode tuneSave(
+  const char * const path,
+  const char * const key,
+  const char * const profile)
+{
+	FILE   *fp;
+	char    line[256],*kept = NULL,*p;
+	size_t  len = 0,max = 0,n;
+	int     skip = 0,ok;
+
+	/* Keep the rest of the file, if there is one */
+	if((fp = fopen(path,"r"))) {
+		while(fgets(line,sizeof(line),fp)) {
+			if(!strncmp(line,"profile ",8))
+				skip = !strncmp(&line[8],key,strlen(key));
+			if(skip) continue;
+			n = strlen(line);
+			if(len + n + 1 > max) {
+				max = max ? max * 2 : 4096;
+				if(!(p = realloc(kept,max))) {
+					free(kept);
+					(void)fclose(fp);
+					return ERR_PROFILE_FILE;
+				}
+				kept = p;
+			}
+			memcpy(&kept[len],line,n + 1);
+			len += n;
+		}
+		(void)fclose(fp);
+	}
+
+	if(!(fp = fopen(path,"w"))) {
+		free(kept);
+		return ERR_PROFILE_FILE;
+	}
+	if(kept)
+		(void)fputs(kept,fp);
+	else
+		(void)fputs("# mphidflash tuning profiles\n",fp);
+	(void)fprintf(fp,"profile %s\n%s",key,profile);
+	free(kept);
+	ok = !ferror(fp);
+
+	return (!fclose(fp) && ok) ? ERR_NONE : ERR_PROFILE_FILE;
+}
+
+/* Time CRC32_RANGE over 'region' bytes in commands of 'span' bytes;
+   returns bytes per second, 0 if the device gave a bad response */
+static double tuneCrc(
+  const unsigned int         addr,
+  const unsigned int         region,
+  const unsigned int         span,
+  unsigned long long * const slowest)
+{
+	ErrorCode          status;
+	unsigned long long start = traceClock(),t;
+	unsigned int       offset;
+	int                bpa = hexGetBytesPerAddress();
+
+	for(offset=0;offset < region;offset += span) {
+		t         = traceClock();
+		usbBuf[0] = CRC32_RANGE;
+		bufWrite32(usbBuf,1,(addr + offset) / bpa);
+		bufWrite32(usbBuf,5,span);
+		if((ERR_NONE != (status = usbWrite(9,1))) ||
+		   (usbBuf[0] != CRC32_RANGE))
+			return 0.0;
+		if((t = traceClock() - t) > *slowest)
+			*slowest = t;
+	}
+
+	return region * 1e9 / (traceClock() - start);
+}
+
+/****************************************************************************
+ Function    : tuneRun
+ Description : Runs the calibration sweep on the open device, saves the
+               best settings found as its profile and uses them for the
+               rest of the run.
+ Parameters  : unsigned short  Vendor ID the device was opened by.
+               unsigned short  Product ID the device was opened by.
+ Returns     : ErrorCode       ERR_NONE on success, ERR_PROFILE_FILE if the
+                               profile can't be saved, else as returned by
+                               usbWrite().
+ Notes       : Device must be open and devQuery already filled in.  Only
+               reads the device; nothing is erased or written.
+ ****************************************************************************/
+ErrorCode tuneRun(
+  const unsigned short vendorID,
+  const unsigned short productID)
+{
+	ErrorCode          status;
+	const char        *path;
+	char               key[64],profile[128];
+	unsigned long long t,start,slowRtt = 0,slowCrc = 0,slowest;
+	unsigned int       addr = 0,size = 0,region,span,bestSpan = 0,offset;
+	int                i,n,floor,block = hexGetBlockSize(),
+	                   bpa = hexGetBytesPerAddress();
+	double             rate,readRate,crcRate = 0.0;
+	Range              mem;
+	char               crc;
+
+	if(!(path = tunePath()))
+		return ERR_PROFILE_FILE;
+
+	/* Measure as the program behaves untuned */
+	hexSetCrcSpan(0);
+	watchdogFloor(0);
+
+	(void)printf("Tuning: %d QUERY_DEVICE round trips...\n",TUNE_QUERIES);
+	for(i=0;i<TUNE_QUERIES;i++) {
+		t         = traceClock();
+		usbBuf[0] = QUERY_DEVICE;
+		if(ERR_NONE != (status = usbWrite(1,1)))
+			return status;
+		if((t = traceClock() - t) > slowRtt) slowRtt = t;
+	}
+
+	/* From the start of the first program memory block */
+	for(i=0;i<devQuery.memBlocks;i++) {
+		if((devQuery.mem[i].Type == TypeProgramMemory) &&
+		   hexMemBlock(i,&mem)) {
+			addr = mem.addr;
+			size = mem.len;
+			break;
+		}
+	}
+	if(size < block) {
+		(void)puts("No program memory reported; can't tune");
+		return ERR_NONE;
+	}
+
+	n = ((size < TUNE_READ) ? size : TUNE_READ) / block;
+	(void)printf("Tuning: %d GET_DATA reads of %d bytes...",n,block);
+	start = traceClock();
+	for(i=0,offset=0;i<n;i++,offset += block) {
+		t         = traceClock();
+		usbBuf[0] = GET_DATA;
+		bufWrite32(usbBuf,1,(addr + offset) / bpa);
+		usbBuf[5] = block;
+		if(ERR_NONE != (status = usbWrite(6,1)))
+			return status;
+		if((t = traceClock() - t) > slowRtt) slowRtt = t;
+	}
+	readRate = (double)n * block * 1e9 / (traceClock() - start);
+	(void)printf(" %.1f KB/s\n",readRate / 1024.0);
+
+	/* A span takes as long as it takes; give each the erase budget while
+	   it's timed, so that a slow one isn't cut short */
+	region = (size < TUNE_REGION) ? size : TUNE_REGION;
+	for(span=TUNE_SPAN;(deviceExt & EXT_CRC32) && (span <= region);
+	  span *= 4) {
+		(void)printf("Tuning: CRC32_RANGE over %u bytes in %u-byte spans...",
+		  region - region % span,span);
+		slowest = 0;
+		watchdogErase(1);
+		rate = tuneCrc(addr,region - region % span,span,&slowest);
+		watchdogErase(0);
+		if(rate == 0.0) {
+			(void)puts(" no response");
+			break;
+		}
+		(void)printf(" %.1f KB/s, slowest %.1f ms\n",rate / 1024.0,
+		  slowest / 1e6);
+		/* No use if no sane timeout covers it */
+		if(slowest * TUNE_CRC / 1000000ULL > TUNE_CEILING) break;
+		if(rate > crcRate * TUNE_BETTER) {
+			crcRate  = rate;
+			bestSpan = span;
+			slowCrc  = slowest;
+		}
+	}
+
+	crc   = (crcRate > readRate);
+	floor = (int)(slowRtt * TUNE_RTT / 1000000ULL);
+	if(crc && (slowCrc * TUNE_CRC / 1000000ULL > (unsigned long long)floor))
+		floor = (int)(slowCrc * TUNE_CRC / 1000000ULL);
+	if(floor < TUNE_FLOOR) floor = TUNE_FLOOR;
+
+	(void)snprintf(key,sizeof(key),"%04x:%04x %d %08x",vendorID,productID,
+	  devQuery.DeviceFamily,tuneMapHash());
+	if(crc)
+		(void)snprintf(profile,sizeof(profile),"verify crc %u\ntimeout %d\n",
+		  bestSpan,floor);
+	else
+		(void)snprintf(profile,sizeof(profile),"verify read\ntimeout %d\n",
+		  floor);
+	if(ERR_NONE != (status = tuneSave(path,key,profile)))
+		return status;
+	(void)printf("Profile %s saved to %s\n",key,path);
+	tuneApply(crc,bestSpan,floor);
+
+	return ERR_NONE;
+}
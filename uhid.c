@@ -0,0 +1,268 @@
+/****************************************************************************
+ File        : uhid.c
+ Description : mphidflash-uhid, a virtual bootloader for benchmarking USB
+               code end to end on a Linux box with no board attached.  It
+               creates a HID device through /dev/uhid with the bootloader's
+               vendor and product IDs and a 64-byte vendor-defined report
+               descriptor like the real one's, and answers it with the
+               simulated bootloader of bootsim.c.  Reports travel through
+               the kernel's HID core and hidraw just as a real device's do;
+               only the wire itself is missing.
+
+               --latency <us> delays each response, standing in for the
+               link (a full-speed device answers in the next 1 ms frame);
+               erasing holds up the next command for as long as the
+               simulation says, as on a real device.  --sim-flash and
+               --sim-stock are as for mphidflash's sim transport.
+
+               Needs write access to /dev/uhid, usually root; Linux only.
+               The device appears as a HID class device (/dev/hidrawN),
+               not a USB one, so it can be reached by hidraw-based code
+               but not by libusb's device enumeration.
+
+ License     : This file is part of 'mphidflash' program.
+
+               'mphidflash' is free software: you can redistribute it and/or
+               modify it under the terms of the GNU General Public License
+               as published by the Free Software Foundation, either version
+               3 of the License, or (at your option) any later version.
+
+               'mphidflash' is distributed in the hope that it will be useful,
+               but WITHOUT ANY WARRANTY; without even the implied warranty
+               of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+               See the GNU General Public License for more details.
+
+               You should have received a copy of the GNU General Public
+               License along with 'mphidflash' source code.  If not,
+               see <http://www.gnu.org/licenses/>.
+
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/input.h>
+#include <linux/uhid.h>
+#include "mphidflash.h"
+
+#define UHID_REPORT 64  /* Report size, as a full-speed bootloader's */
+
+/* Vendor-defined page, one 64-byte input and one 64-byte output report,
+   no report IDs: as the Microchip HID bootloader's */
+static const unsigned char descriptor[] = {
+	0x06, 0x00, 0xff,  /* Usage Page (Vendor Defined 0xFF00) */
+	0x09, 0x01,        /* Usage (1)                          */
+	0xa1, 0x01,        /* Collection (Application)           */
+	0x19, 0x01,        /*   Usage Minimum (1)                */
+	0x29, 0x40,        /*   Usage Maximum (64)               */
+	0x15, 0x00,        /*   Logical Minimum (0)              */
+	0x26, 0xff, 0x00,  /*   Logical Maximum (255)            */
+	0x75, 0x08,        /*   Report Size (8)                  */
+	0x95, UHID_REPORT, /*   Report Count (64)                */
+	0x81, 0x02,        /*   Input (Data,Var,Abs)             */
+	0x19, 0x01,        /*   Usage Minimum (1)                */
+	0x29, 0x40,        /*   Usage Maximum (64)               */
+	0x91, 0x02,        /*   Output (Data,Var,Abs)            */
+	0xc0               /* End Collection                     */
+};
+
+static volatile sig_atomic_t stop = 0;
+
+static void uhidStop(int sig)
+{
+	stop = 1;
+}
+
+/* Sleep for a number of microseconds, or until a signal */
+static void uhidSleep(const unsigned long long us)
+{
+	struct timespec ts;
+
+	if(!us) return;
+	ts.tv_sec  = us / 1000000ULL;
+	ts.tv_nsec = (us % 1000000ULL) * 1000;
+	(void)nanosleep(&ts,NULL);
+}
+
+/* Send one uhid event, all or nothing */
+static int uhidSend(
+  const int                      fd,
+  const struct uhid_event * const ev)
+{
+	return write(fd,ev,sizeof(*ev)) == sizeof(*ev);
+}
+
+/* Create the virtual device */
+static int uhidCreate(
+  const int            fd,
+  const unsigned short vendorID,
+  const unsigned short productID)
+{
+	struct uhid_event ev;
+
+	memset(&ev,0,sizeof(ev));
+	ev.type = UHID_CREATE2;
+	(void)snprintf((char *)ev.u.create2.name,sizeof(ev.u.create2.name),
+	  "mphidflash virtual bootloader");
+	(void)snprintf((char *)ev.u.create2.uniq,sizeof(ev.u.create2.uniq),
+	  "%s",bootsimSerial());
+	memcpy(ev.u.create2.rd_data,descriptor,sizeof(descriptor));
+	ev.u.create2.rd_size = sizeof(descriptor);
+	ev.u.create2.bus     = BUS_USB;
+	ev.u.create2.vendor  = vendorID;
+	ev.u.create2.product = productID;
+
+	return uhidSend(fd,&ev);
+}
+
+/* Carry out one output report (a command) and send any response */
+static int uhidCommand(
+  const int                   fd,
+  const unsigned char        *data,
+  int                         size,
+  const unsigned long long    latency)
+{
+	unsigned char     cmd[UHID_REPORT];
+	struct uhid_event ev;
+	unsigned int      busyMs;
+
+	/* hidraw passes the report number first; 0 when there are none */
+	if((size == UHID_REPORT + 1) && !data[0]) {
+		data++;
+		size--;
+	}
+	memset(cmd,0,sizeof(cmd));
+	memcpy(cmd,data,(size < UHID_REPORT) ? size : UHID_REPORT);
+
+	memset(&ev,0,sizeof(ev));
+	ev.type = UHID_INPUT2;
+	if(bootsimCommand(cmd,ev.u.input2.data,UHID_REPORT,&busyMs)) {
+		uhidSleep(latency);
+		ev.u.input2.size = UHID_REPORT;
+		if(!uhidSend(fd,&ev)) return 0;
+	}
+
+	/* The bootloader takes nothing more until the erase is done */
+	uhidSleep(busyMs * 1000ULL);
+
+	return 1;
+}
+
+/* Refuse a GET_REPORT or SET_REPORT request; the bootloader has no feature
+   reports, and the kernel waits for an answer */
+static int uhidRefuse(
+  const int                       fd,
+  const struct uhid_event * const req)
+{
+	struct uhid_event ev;
+
+	memset(&ev,0,sizeof(ev));
+	if(UHID_GET_REPORT == req->type) {
+		ev.type                   = UHID_GET_REPORT_REPLY;
+		ev.u.get_report_reply.id  = req->u.get_report.id;
+		ev.u.get_report_reply.err = EIO;
+	} else {
+		ev.type                   = UHID_SET_REPORT_REPLY;
+		ev.u.set_report_reply.id  = req->u.set_report.id;
+		ev.u.set_report_reply.err = EIO;
+	}
+
+	return uhidSend(fd,&ev);
+}
+
+int main(
+  int   argc,
+  char *argv[])
+{
+	unsigned int       vendorID  = 0x04d8,
+	                   productID = 0x003c;
+	unsigned long long latency   = 1000;
+	char              *flashFile = NULL,
+	                   stock     = 0;
+	struct uhid_event  ev;
+	struct sigaction   sa;
+	int                fd,i,n,eol,ok = 1;
+
+	for(i=1;i<argc;i++) {
+		eol = (i == (argc - 1));
+		if(!strcasecmp(argv[i],"--latency")) {
+			if(eol || (1 != sscanf(argv[++i],"%llu",&latency)))
+				ok = 0;
+		} else if(!strcasecmp(argv[i],"--sim-flash")) {
+			if(eol) ok = 0;
+			else    flashFile = argv[++i];
+		} else if(!strcasecmp(argv[i],"--sim-stock")) {
+			stock = 1;
+		} else if(!strncasecmp(argv[i],"-v",2)) {
+			if(eol || (1 != sscanf(argv[++i],"%x",&vendorID)))
+				ok = 0;
+		} else if(!strncasecmp(argv[i],"-p",2)) {
+			if(eol || (1 != sscanf(argv[++i],"%x",&productID)))
+				ok = 0;
+		} else {
+			ok = 0;
+		}
+	}
+	if(!ok) {
+		(void)printf(
+"usage: mphidflash-uhid [--latency <us>] [--sim-flash <file>] [--sim-stock]\n"
+"                       [-v <hex>] [-p <hex>]\n"
+"--latency <us>      Delay before each response (default 1000)\n"
+"--sim-flash <file>  Load memory from file, and save it on exit\n"
+"--sim-stock         Offer only the stock protocol, no extensions\n"
+"-v <hex>            USB device vendor ID (default 04d8)\n"
+"-p <hex>            USB device product ID (default 003c)\n");
+		return ERR_CMD_ARG;
+	}
+
+	if((fd = open("/dev/uhid",O_RDWR | O_CLOEXEC)) < 0) {
+		(void)printf("Can't open /dev/uhid: %s\n",strerror(errno));
+		return ERR_USB_OPEN;
+	}
+
+	bootsimOpen(flashFile,stock);
+	if(!uhidCreate(fd,vendorID,productID)) {
+		(void)printf("Can't create device: %s\n",strerror(errno));
+		(void)close(fd);
+		return ERR_USB_OPEN;
+	}
+	(void)printf("Virtual bootloader %04x:%04x created; ^C to remove\n",
+	  vendorID,productID);
+	(void)fflush(stdout);
+
+	/* No SA_RESTART: a signal ends the read below */
+	memset(&sa,0,sizeof(sa));
+	sa.sa_handler = uhidStop;
+	(void)sigaction(SIGINT,&sa,NULL);
+	(void)sigaction(SIGTERM,&sa,NULL);
+
+	while(!stop && ok) {
+		if((n = read(fd,&ev,sizeof(ev))) <= 0) {
+			ok = (n < 0) && (EINTR == errno);
+			continue;
+		}
+		switch(ev.type) {
+			case UHID_OUTPUT:
+				ok = uhidCommand(fd,ev.u.output.data,ev.u.output.size,
+				  latency);
+				break;
+			case UHID_GET_REPORT:
+			case UHID_SET_REPORT:
+				ok = uhidRefuse(fd,&ev);
+				break;
+		}
+	}
+
+	memset(&ev,0,sizeof(ev));
+	ev.type = UHID_DESTROY;
+	(void)uhidSend(fd,&ev);
+	(void)close(fd);
+	bootsimClose();
+
+	return ok ? ERR_NONE : ERR_USB_WRITE;
+}
@@ -0,0 +1,256 @@
+/****************************************************************************
+ File        : unpack.c
+ Description : Decompression of hex files kept compressed: gzip (.hex.gz),
+               xz (.hex.xz) and Zstandard (.hex.zst), recognised by their
+               magic bytes rather than by name, so that a file descriptor
+               passed to the flash server works as well as a file.  The
+               compressed file is read from memory as mapped by hex.c and
+               decoded a piece at a time, never all at once.
+
+               Each format needs its library and is compiled in with its
+               own flag: USE_ZLIB (zlib), USE_LZMA (liblzma) and
+               USE_ZSTD (libzstd).  A file in a format that wasn't
+               compiled in is recognised, and refused with a message
+               saying so.
+
+ License     : This file is part of 'mphidflash' program.
+
+               'mphidflash' is free software: you can redistribute it and/or
+               modify it under the terms of the GNU General Public License
+               as published by the Free Software Foundation, either version
+               3 of the License, or (at your option) any later version.
+
+               'mphidflash' is distributed in the hope that it will be useful,
+               but WITHOUT ANY WARRANTY; without even the implied warranty
+               of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+               See the GNU General Public License for more details.
+
+               You should have received a copy of the GNU General Public
+               License along with 'mphidflash' source code.  If not,
+               see <http://www.gnu.org/licenses/>.
+
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef USE_LZMA
+#include <lzma.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+#include "mphidflash.h"
+
+static const struct {
+	const char          *name;
+	const unsigned char  magic[6];
+	int                  magicLen;
+} formats[] = {
+	{ NULL,   { 0 },                                0 },  /* UNPACK_NONE */
+	{ "gzip", { 0x1f,0x8b },                        2 },  /* UNPACK_GZIP */
+	{ "xz",   { 0xfd,'7','z','X','Z',0x00 },        6 },  /* UNPACK_XZ   */
+	{ "zstd", { 0x28,0xb5,0x2f,0xfd },              4 }   /* UNPACK_ZSTD */
+};
+
+static int                  format = UNPACK_NONE; /* Of stream being read */
+static char                 done;                 /* Reached the end      */
+#ifdef USE_ZLIB
+static z_stream             gz;
+#endif
+#ifdef USE_LZMA
+static lzma_stream          xz = LZMA_STREAM_INIT;
+#endif
+#ifdef USE_ZSTD
+static ZSTD_DStream        *zst = NULL;
+static ZSTD_inBuffer        zstIn;
+#endif
+
+/****************************************************************************
+ Function    : unpackFormat
+ Description : Recognises compressed data by its magic bytes.
+ Parameters  : unsigned char*  Start of file.
+               size_t          File size in bytes.
+ Returns     : int             UNPACK_GZIP, UNPACK_XZ or UNPACK_ZSTD, or
+                               UNPACK_NONE for anything else (such as hex
+                               text, which starts with ':').
+ ****************************************************************************/
+int unpackFormat(
+  const unsigned char * const data,
+  const size_t                size)
+{
+	int f;
+
+	for(f=UNPACK_GZIP;f<=UNPACK_ZSTD;f++)
+		if((size >= (size_t)formats[f].magicLen) &&
+		   !memcmp(data,formats[f].magic,formats[f].magicLen))
+			return f;
+
+	return UNPACK_NONE;
+}
+
+/****************************************************************************
+ Function    : unpackOpen
+ Description : Starts decoding compressed data.
+ Parameters  : unsigned char*  Compressed data; must stay in place until
+                               unpackClose().
+               size_t          Size in bytes.
+ Returns     : ErrorCode       ERR_NONE on success, ERR_HEX_UNPACK if the
+                               format isn't recognised or not compiled in.
+ ****************************************************************************/
+ErrorCode unpackOpen(
+  const unsigned char * const data,
+  const size_t                size)
+{
+	done = 0;
+
+	switch(format = unpackFormat(data,size)) {
+#ifdef USE_ZLIB
+		case UNPACK_GZIP:
+			memset(&gz,0,sizeof(gz));
+			/* 16 + window bits: gzip header and trailer, not zlib's */
+			if(Z_OK != inflateInit2(&gz,16 + MAX_WBITS)) break;
+			gz.next_in  = (unsigned char *)data;
+			gz.avail_in = size;
+			return ERR_NONE;
+#endif
+#ifdef USE_LZMA
+		case UNPACK_XZ:
+			if(LZMA_OK != lzma_stream_decoder(&xz,UINT64_MAX,
+			  LZMA_CONCATENATED)) break;
+			xz.next_in  = data;
+			xz.avail_in = size;
+			return ERR_NONE;
+#endif
+#ifdef USE_ZSTD
+		case UNPACK_ZSTD:
+			if(!(zst = ZSTD_createDStream())) break;
+			(void)ZSTD_initDStream(zst);
+			zstIn.src  = data;
+			zstIn.size = size;
+			zstIn.pos  = 0;
+			return ERR_NONE;
+#endif
+		case UNPACK_NONE:
+			break;
+		default:
+			(void)printf("Hex file is %s-compressed; this build can't "
+			  "decompress it\n",formats[format].name);
+			break;
+	}
+	format = UNPACK_NONE;
+
+	return ERR_HEX_UNPACK;
+}
+
+/****************************************************************************
+ Function    : unpackRead
+ Description : Decodes the next piece of the compressed data.
+ Parameters  : char*      Buffer receiving decoded data.
+               int        Size of buffer in bytes.
+               int*       Receives number of bytes decoded; 0 at the end
+                          of the data.
+ Returns     : ErrorCode  ERR_NONE on success, ERR_HEX_UNPACK if the data
+                          is corrupt or ends early.
+ Notes       : gzip files of several members (as from concatenating .gz
+               files) are read as one, as gunzip does, and likewise for xz
+               and Zstandard.
+ ****************************************************************************/
+ErrorCode unpackRead(
+  char * const buf,
+  const int    size,
+  int * const  len)
+{
+	*len = 0;
+	if(done) return ERR_NONE;
+
+	switch(format) {
+#ifdef USE_ZLIB
+		case UNPACK_GZIP: {
+			int ret;
+
+			gz.next_out  = (unsigned char *)buf;
+			gz.avail_out = size;
+			do {
+				ret = inflate(&gz,Z_NO_FLUSH);
+				if((Z_STREAM_END == ret) && gz.avail_in &&
+				   (Z_OK == inflateReset(&gz)))
+					ret = Z_OK;  /* Another member follows */
+			} while((Z_OK == ret) && gz.avail_out);
+			*len = size - gz.avail_out;
+			done = (Z_STREAM_END == ret);
+			/* Z_BUF_ERROR: input used up partway through a member */
+			return ((Z_OK == ret) || done) ? ERR_NONE : ERR_HEX_UNPACK;
+		}
+#endif
+#ifdef USE_LZMA
+		case UNPACK_XZ: {
+			lzma_ret ret;
+
+			xz.next_out  = (unsigned char *)buf;
+			xz.avail_out = size;
+			do {
+				ret = lzma_code(&xz,xz.avail_in ? LZMA_RUN : LZMA_FINISH);
+			} while((LZMA_OK == ret) && xz.avail_out);
+			*len = size - xz.avail_out;
+			done = (LZMA_STREAM_END == ret);
+			return ((LZMA_OK == ret) || done) ? ERR_NONE : ERR_HEX_UNPACK;
+		}
+#endif
+#ifdef USE_ZSTD
+		case UNPACK_ZSTD: {
+			ZSTD_outBuffer out = { buf,size,0 };
+			size_t         ret,inPos,outPos;
+
+			/* Stop when the output is full or no progress is made */
+			do {
+				inPos  = zstIn.pos;
+				outPos = out.pos;
+				if(ZSTD_isError(ret = ZSTD_decompressStream(zst,&out,&zstIn)))
+					return ERR_HEX_UNPACK;
+			} while((out.pos < out.size) &&
+			        ((zstIn.pos > inPos) || (out.pos > outPos)));
+			*len = out.pos;
+			if(!*len && (zstIn.pos == zstIn.size)) {
+				done = 1;
+				/* ret: bytes still wanted to finish the frame */
+				if(ret) return ERR_HEX_UNPACK;
+			}
+			return ERR_NONE;
+		}
+#endif
+	}
+
+	return ERR_HEX_UNPACK;
+}
+
+/****************************************************************************
+ Function    : unpackClose
+ Description : Frees the decoder.  Safe to call if unpackOpen() failed.
+ Parameters  : None (void)
+ Returns     : Nothing (void)
+ ****************************************************************************/
+void unpackClose(void)
+{
+	switch(format) {
+#ifdef USE_ZLIB
+		case UNPACK_GZIP:
+			(void)inflateEnd(&gz);
+			break;
+#endif
+#ifdef USE_LZMA
+		case UNPACK_XZ:
+			lzma_end(&xz);
+			break;
+#endif
+#ifdef USE_ZSTD
+		case UNPACK_ZSTD:
+			(void)ZSTD_freeDStream(zst);
+			zst = NULL;
+			break;
+#endif
+	}
+	format = UNPACK_NONE;
+}
@@ -0,0 +1,330 @@
+/****************************************************************************
+ File        : usb-hidraw.c
+ Description : The "hidraw" transport: the bootloader reached through
+               Linux's own HID driver and its /dev/hidrawN nodes, needing
+               no USB library and leaving the kernel driver attached (it
+               also reaches the uhid virtual device, which has no USB side
+               at all).  Devices are matched, and serial numbers and bus
+               locations found, from sysfs without opening anything.
+
+               A node open here is locked, so that processes sharing out
+               devices between them (--audit, one process per board) each
+               get one of their own, as with libusb's interface claim.
+
+               Needs read and write access to the hidraw node, which a
+               udev rule usually gives.  Linux only.
+
+ License     : This file is part of 'mphidflash' program.
+
+               'mphidflash' is free software: you can redistribute it and/or
+               modify it under the terms of the GNU General Public License
+               as published by the Free Software Foundation, either version
+               3 of the License, or (at your option) any later version.
+
+               'mphidflash' is distributed in the hope that it will be useful,
+               but WITHOUT ANY WARRANTY; without even the implied warranty
+               of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+               See the GNU General Public License for more details.
+
+               You should have received a copy of the GNU General Public
+               License along with 'mphidflash' source code.  If not,
+               see <http://www.gnu.org/licenses/>.
+
+ ****************************************************************************/
+
+#ifdef __linux__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+#include "mphidflash.h"
+
+#define SYSFS_HIDRAW "/sys/class/hidraw"
+
+static int  fd = -1;
+static char node[NAME_MAX + 1];  /* Open node, e.g. "hidraw0" */
+
+/* One line of a node's HID uevent, after "<key>=", e.g. HID_ID or HID_UNIQ */
+static int hidrawEvent(
+  const char * const name,
+  const char * const key,
+  char * const       buf,
+  const int          size)
+{
+	FILE *fp;
+	char  path[PATH_MAX],line[256];
+	int   n = strlen(key),found = 0;
+
+	(void)snprintf(path,sizeof(path),SYSFS_HIDRAW "/%s/device/uevent",name);
+	if(!(fp = fopen(path,"r")))
+		return 0;
+	while(!found && fgets(line,sizeof(line),fp)) {
+		if(strncmp(line,key,n) || (line[n] != '=')) continue;
+		line[strcspn(line,"\n")] = 0;
+		(void)snprintf(buf,size,"%s",&line[n + 1]);
+		found = 1;
+	}
+	(void)fclose(fp);
+
+	return found;
+}
+
+/* Whether a node is a HID device with the given IDs and (if not NULL)
+   serial number */
+static int hidrawMatch(
+  const char * const   name,
+  const unsigned short vendorID,
+  const unsigned short productID,
+  const char * const   serial)
+{
+	char         buf[128];
+	unsigned int bus,vid,pid;
+
+	if(!hidrawEvent(name,"HID_ID",buf,sizeof(buf)) ||
+	   (3 != sscanf(buf,"%x:%x:%x",&bus,&vid,&pid)) ||
+	   (vid != vendorID) || (pid != productID))
+		return 0;
+
+	return !serial ||
+	  (hidrawEvent(name,"HID_UNIQ",buf,sizeof(buf)) && !strcmp(buf,serial));
+}
+
+/* Input report size from the report descriptor: Report Size times Report
+   Count in force at the first Input item; 64 if it can't be found */
+static int hidrawReportSize(void)
+{
+	struct hidraw_report_descriptor desc;
+	unsigned int                    i,k,n,value,size = 0,count = 0,bytes;
+
+	if((ioctl(fd,HIDIOCGRDESCSIZE,&desc.size) < 0) ||
+	   (ioctl(fd,HIDIOCGRDESC,&desc) < 0))
+		return 64;
+
+	for(i=0;i<desc.size;i += 1 + n) {
+		if(desc.value[i] == 0xfe) {         /* Long item: size, tag, data */
+			n = (i + 1 < desc.size) ? 2 + desc.value[i + 1] : 0;
+			continue;
+		}
+		n = desc.value[i] & 3;              /* Short item: 0, 1, 2 or 4 */
+		if(n == 3) n = 4;
+		if(i + n >= desc.size) break;
+		for(value=0,k=n;k;k--)              /* Little-endian data */
+			value = (value << 8) | desc.value[i + k];
+		switch(desc.value[i] & 0xfc) {
+			case 0x74: size  = value; break;  /* Report Size  */
+			case 0x94: count = value; break;  /* Report Count */
+			case 0x80:                        /* Input        */
+				bytes = size * count / 8;
+				return ((bytes < 1) || (bytes > USB_MAX_REPORT)) ?
+				  64 : (int)bytes;
+		}
+	}
+
+	return 64;
+}
+
+/****************************************************************************
+ Function    : hidrawOpen
+ Description : Opens the first hidraw node with the given IDs that no
+               other process has open here.
+ Parameters  : unsigned short  Vendor ID to search for.
+               unsigned short  Product ID to search for.
+ Returns     : ErrorCode       ERR_NONE on success, ERR_DEVICE_NOT_FOUND if
+                               there's no such device (or all are taken),
+                               ERR_USB_OPEN if one was found but couldn't
+                               be opened (usually permissions).
+ ****************************************************************************/
+static ErrorCode hidrawOpen(
+  const unsigned short vendorID,
+  const unsigned short productID)
+{
+	ErrorCode      status = ERR_DEVICE_NOT_FOUND;
+	DIR           *dir;
+	struct dirent *d;
+	char           path[PATH_MAX];
+
+	if(!(dir = opendir(SYSFS_HIDRAW)))
+		return ERR_DEVICE_NOT_FOUND;
+	while((fd < 0) && (d = readdir(dir))) {
+		if((d->d_name[0] == '.') ||
+		   !hidrawMatch(d->d_name,vendorID,productID,NULL))
+			continue;
+		(void)snprintf(path,sizeof(path),"/dev/%s",d->d_name);
+		if((fd = open(path,O_RDWR | O_CLOEXEC)) < 0) {
+			status = ERR_USB_OPEN;
+			continue;
+		}
+		if(flock(fd,LOCK_EX | LOCK_NB)) {
+			(void)close(fd);
+			fd = -1;
+			continue;
+		}
+		(void)snprintf(node,sizeof(node),"%s",d->d_name);
+	}
+	(void)closedir(dir);
+	if(fd < 0)
+		return status;
+
+	usbReportSize = hidrawReportSize();
+
+	return ERR_NONE;
+}
+
+/****************************************************************************
+ Function    : hidrawSend
+ Description : Writes one report to the open device.
+ Parameters  : char*      Report buffer.
+               int        Size of data in bytes (max usbReportSize).
+               int        Timeout in milliseconds (the kernel has its own).
+ Returns     : ErrorCode  ERR_NONE on success, ERR_USB_WRITE on error.
+ Notes       : hidraw takes the report number first, 0 for a device without
+               numbered reports, in the byte before the report; and always
+               a whole report, as the device's descriptor gives its size.
+ ****************************************************************************/
+static ErrorCode hidrawSend(
+  unsigned char * const buf,
+  const int             len,
+  const int             timeout)
+{
+	buf[-1] = 0;
+	if(write(fd,&buf[-1],usbReportSize + 1) != usbReportSize + 1)
+		return ERR_USB_WRITE;
+
+	return ERR_NONE;
+}
+
+/****************************************************************************
+ Function    : hidrawRecv
+ Description : Reads one report from the open device.
+ Parameters  : char*      Report buffer.
+               int        Timeout in milliseconds.
+ Returns     : ErrorCode  ERR_NONE on success, ERR_USB_READ on error,
+                          ERR_USB_TIMEOUT if nothing arrived in time.
+ ****************************************************************************/
+static ErrorCode hidrawRecv(
+  unsigned char * const buf,
+  const int             timeout)
+{
+	struct pollfd p;
+
+	p.fd     = fd;
+	p.events = POLLIN;
+	switch(poll(&p,1,timeout)) {
+		case 0:  return ERR_USB_TIMEOUT;
+		case 1:  break;
+		default: return ERR_USB_READ;
+	}
+	if(read(fd,buf,usbReportSize) <= 0)
+		return ERR_USB_READ;
+
+	return ERR_NONE;
+}
+
+/****************************************************************************
+ Function    : hidrawLocation
+ Description : Reports where the open device sits on the USB bus.
+ Parameters  : int*  Receives bus number.
+               int*  Receives device address on that bus.
+ Returns     : int   1 on success, 0 if not on USB (e.g. a uhid device).
+ Notes       : The node's device is a HID interface's child; the USB device
+               with busnum and devnum is two levels up.
+ ****************************************************************************/
+static int hidrawLocation(
+  int *bus,
+  int *addr)
+{
+	char  path[PATH_MAX],real[PATH_MAX],*p;
+	FILE *fp;
+	int   i,ok;
+
+	(void)snprintf(path,sizeof(path),SYSFS_HIDRAW "/%s/device",node);
+	if((fd < 0) || !realpath(path,real))
+		return 0;
+	for(i=0;i<2;i++) {
+		if(!(p = strrchr(real,'/'))) return 0;
+		*p = 0;
+	}
+
+	if((snprintf(path,sizeof(path),"%s/busnum",real) >= (int)sizeof(path))
+	  || !(fp = fopen(path,"r")))
+		return 0;
+	ok = (1 == fscanf(fp,"%d",bus));
+	(void)fclose(fp);
+	if(!ok || (snprintf(path,sizeof(path),"%s/devnum",real) >=
+	  (int)sizeof(path)) || !(fp = fopen(path,"r")))
+		return 0;
+	ok = (1 == fscanf(fp,"%d",addr));
+	(void)fclose(fp);
+
+	return ok;
+}
+
+/****************************************************************************
+ Function    : hidrawFind
+ Description : Looks for a HID device, without opening it.
+ Parameters  : unsigned short  Vendor ID to search for.
+               unsigned short  Product ID to search for.
+               char*           Serial number to match, or NULL for any.
+ Returns     : int             1 if present, 0 if not.
+ Notes       : Only HID devices have hidraw nodes; an application of any
+               other class is never found this way.
+ ****************************************************************************/
+static int hidrawFind(
+  const unsigned short vendorID,
+  const unsigned short productID,
+  const char * const   serial)
+{
+	DIR           *dir;
+	struct dirent *d;
+	int            found = 0;
+
+	if(!(dir = opendir(SYSFS_HIDRAW)))
+		return 0;
+	while(!found && (d = readdir(dir)))
+		found = (d->d_name[0] != '.') &&
+		  hidrawMatch(d->d_name,vendorID,productID,serial);
+	(void)closedir(dir);
+
+	return found;
+}
+
+/****************************************************************************
+ Function    : hidrawSerial
+ Description : The open device's serial number, as the HID driver has it.
+ Parameters  : char*  Receives the serial number, NUL-terminated.
+               int    Size of buffer.
+ Returns     : int    1 on success, 0 if the device has none.
+ ****************************************************************************/
+static int hidrawSerial(
+  char * const buf,
+  const int    size)
+{
+	return (fd >= 0) && hidrawEvent(node,"HID_UNIQ",buf,size) && buf[0];
+}
+
+/****************************************************************************
+ Function    : hidrawClose
+ Description : Closes the open device, releasing its lock.
+ Parameters  : None (void)
+ Returns     : Nothing (void)
+ ****************************************************************************/
+static void hidrawClose(void)
+{
+	if(fd >= 0) (void)close(fd);
+	fd = -1;
+}
+
+const Transport transportHidraw = {
+	"hidraw",1,hidrawOpen,hidrawSend,hidrawRecv,hidrawLocation,hidrawFind,
+	hidrawSerial,hidrawClose
+};
+
+#endif /* __linux__ */
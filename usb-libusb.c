@@ -29,15 +29,35 @@
 
  ****************************************************************************/
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <usb.h>
 
 #include "mphidflash.h"
 
-unsigned char usbBufX[64];
-unsigned char * usbBuf = usbBufX;
-usb_dev_handle *usbdevice = NULL;
+static usb_dev_handle *usbdevice = NULL;
 
-ErrorCode usbOpen(
+/* Report size is the interrupt IN endpoint's maximum packet size */
+static int maxPacketSize(struct usb_device *dev)
+{
+    struct usb_interface_descriptor *alt;
+    int                              i, size;
+
+    if (!dev->config || !dev->config->interface)
+        return 64;
+    alt = &dev->config->interface[0].altsetting[0];
+    for (i = 0; i < alt->bNumEndpoints; i++) {
+        if (alt->endpoint[i].bEndpointAddress == 0x81) {
+            size = alt->endpoint[i].wMaxPacketSize & 0x7ff;
+            return (size > USB_MAX_REPORT) ? USB_MAX_REPORT : size;
+        }
+    }
+
+    return 64;
+}
+
+static ErrorCode libusbOpen(
   const unsigned short vendorID,
   const unsigned short productID)
 {
@@ -70,6 +90,7 @@ ErrorCode usbOpen(
                     }                        
                 }
 
+                usbReportSize = maxPacketSize(dev);
                 return ERR_NONE;
             }
         }
@@ -79,31 +100,103 @@ ErrorCode usbOpen(
 
 }
 
-ErrorCode usbWrite(
-  const char len,
-  const char read)
+static ErrorCode libusbSend(
+  unsigned char * const buf,
+  const int len,
+  const int timeout)
 {
-    int bytesSent;
-    int bytesRead;
+    int ret = usb_interrupt_write(usbdevice, 0x01, (char *)buf, len, timeout);
 
-    bytesSent = usb_interrupt_write(usbdevice, 0x01, usbBuf, len, 5000);
-    if (bytesSent < 0)
+    if (ret == -ETIMEDOUT)
+        return ERR_USB_TIMEOUT;
+    if (ret < 0)
         return ERR_USB_WRITE;
 
-    if (read) {
+    return ERR_NONE;
+}
 
-        bytesRead = usb_interrupt_read(usbdevice, 0x81, usbBuf, 64, 5000);
-		if (bytesRead < 0)
-			return ERR_USB_READ;
-	}
+static ErrorCode libusbRecv(
+  unsigned char * const buf,
+  const int timeout)
+{
+    int ret = usb_interrupt_read(usbdevice, 0x81, (char *)buf, usbReportSize, timeout);
+
+    if (ret == -ETIMEDOUT)
+        return ERR_USB_TIMEOUT;
+    if (ret < 0)
+        return ERR_USB_READ;
 
     return ERR_NONE;
 }
 
-void usbClose(void)
+static int libusbLocation(
+  int *bus,
+  int *addr)
+{
+    struct usb_device *dev;
+
+    if (!usbdevice || !(dev = usb_device(usbdevice)))
+        return 0;
+
+    *bus  = atoi(dev->bus->dirname);
+    *addr = dev->devnum;
+    return 1;
+}
+
+static int libusbFind(
+  const unsigned short vendorID,
+  const unsigned short productID,
+  const char * const   serial)
+{
+    struct usb_bus    *bus;
+    struct usb_device *dev;
+    usb_dev_handle    *handle;
+    char               str[128];
+    int                found = 0;
+
+    usb_init();
+    usb_find_busses();
+    usb_find_devices();
+
+    for (bus=usb_get_busses(); bus && !found; bus=bus->next) {
+        for (dev=bus->devices; dev && !found; dev=dev->next) {
+            if (dev->descriptor.idVendor != vendorID || dev->descriptor.idProduct != productID)
+                continue;
+            if (!serial) {
+                found = 1;
+            } else if (dev->descriptor.iSerialNumber && (handle = usb_open(dev))) {
+                found = (usb_get_string_simple(handle, dev->descriptor.iSerialNumber, str, sizeof(str)) > 0) &&
+                        !strcmp(str, serial);
+                usb_close(handle);
+            }
+        }
+    }
+
+    return found;
+}
+
+static int libusbSerial(
+  char * const buf,
+  const int    size)
+{
+    struct usb_device *dev;
+
+    if (!usbdevice || !(dev = usb_device(usbdevice)) || !dev->descriptor.iSerialNumber)
+        return 0;
+
+    return usb_get_string_simple(usbdevice, dev->descriptor.iSerialNumber, buf, size) > 0;
+}
+
+static void libusbClose(void)
 {
     if (usbdevice != NULL) {
         usb_release_interface(usbdevice, 0);
         usb_close(usbdevice);
+        usbdevice = NULL;
     }
 }
+
+const Transport transportLibusb = {
+    "libusb", 1, libusbOpen, libusbSend, libusbRecv, libusbLocation,
+    libusbFind, libusbSerial, libusbClose
+};
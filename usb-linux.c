@@ -35,17 +35,35 @@
 
  ****************************************************************************/
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <usb.h>
 #include <hid.h>
 #include "mphidflash.h"
 #include <errno.h>
 
 static HIDInterface *hid = NULL;
-unsigned char        usbBufX[64];
-unsigned char       * usbBuf = usbBufX;
+
+/* Report size is the interrupt IN endpoint's maximum packet size */
+static int maxPacketSize(const struct usb_device *dev)
+{
+	struct usb_interface_descriptor *alt;
+	int                              i,size;
+
+	if(!dev->config || !dev->config->interface) return 64;
+	alt = &dev->config->interface[0].altsetting[0];
+	for(i=0;i<alt->bNumEndpoints;i++) {
+		if(alt->endpoint[i].bEndpointAddress == 0x81) {
+			size = alt->endpoint[i].wMaxPacketSize & 0x7ff;
+			return (size > USB_MAX_REPORT) ? USB_MAX_REPORT : size;
+		}
+	}
+
+	return 64;
+}
 
 /****************************************************************************
- Function    : usbOpen
+ Function    : libhidOpen
  Description : Searches for and opens the first available Bootloader device.
  Parameters  : unsigned short         Vendor ID to search for.
                unsigned short         Product ID to search for.
@@ -62,7 +80,7 @@ unsigned char       * usbBuf = usbBufX;
                search ordering; whatever the default libhid 'matching
                function' decides.
  ****************************************************************************/
-ErrorCode usbOpen(
+static ErrorCode libhidOpen(
   const unsigned short vendorID,
   const unsigned short productID)
 {
@@ -83,6 +101,7 @@ ErrorCode usbOpen(
 		if((hid = hid_new_HIDInterface())) {
 			if(HID_RET_SUCCESS ==
 			  hid_force_open(hid,0,&matcher,3)) {
+				usbReportSize = maxPacketSize(hid->device);
 				return ERR_NONE;
 			}
 			status = ERR_DEVICE_NOT_FOUND;
@@ -95,64 +114,151 @@ ErrorCode usbOpen(
 }
 
 /****************************************************************************
- Function    : usbWrite
- Description : Write data packet to currently-open USB device, optionally
-               followed by a packet read operation.  Data source is always
-               global array usbBuf[].  For read operation, destination is
-               always usbBuf[] also, overwriting contents there.
- Parameters  : char       Size of source data in bytes (max 64).
-               char       If set, read response packet.
- Returns     : ErrorCode  ERR_NONE on success, ERR_USB_WRITE on error.
+ Function    : libhidSend
+ Description : Write data packet to currently-open USB device.
+ Parameters  : char*      Report buffer.
+               int        Size of source data in bytes (max usbReportSize).
+               int        Timeout in milliseconds.
+ Returns     : ErrorCode  ERR_NONE on success, ERR_USB_WRITE on error,
+                          ERR_USB_TIMEOUT if the device didn't accept it.
  Notes       : Device is assumed to have already been successfully opened
                by the time this function is called; no checks performed here.
  ****************************************************************************/
-ErrorCode usbWrite(
-  const char len,
-  const char read)
+static ErrorCode libhidSend(
+  unsigned char * const buf,
+  const int             len,
+  const int             timeout)
 {
-#ifdef DEBUG
-	int i;
-	(void)puts("Sending:");
-	for(i=0;i<8;i++) (void)printf("%02x ",((unsigned char *)usbBuf)[i]);
-	(void)printf(": ");
-	for(;i<64;i++) (void)printf("%02x ",((unsigned char *)usbBuf)[i]);
-	(void)putchar('\n'); fflush(stdout);
-	DEBUGMSG("\nAbout to write");
-#endif
-
-	if(HID_RET_SUCCESS != hid_interrupt_write(hid,0x01,usbBuf,len,0))
-		return ERR_USB_WRITE;
-
-	DEBUGMSG("Done w/write");
-
-	if(read) {
-		DEBUGMSG("About to read");
-		if(HID_RET_SUCCESS != hid_interrupt_read(hid,0x81,usbBuf,64,0))
-			return ERR_USB_READ;
-#ifdef DEBUG
-		(void)puts("Done reading\nReceived:");
-		for(i=0;i<8;i++) (void)printf("%02x ",usbBuf[i]);
-		(void)printf(": ");
-		for(;i<64;i++) (void)printf("%02x ",usbBuf[i]);
-		(void)putchar('\n'); fflush(stdout);
-#endif
-	}
+	hid_return ret = hid_interrupt_write(hid,0x01,(char *)buf,len,timeout);
+
+	if(HID_RET_TIMEOUT == ret) return ERR_USB_TIMEOUT;
+	if(HID_RET_SUCCESS != ret) return ERR_USB_WRITE;
+
+	return ERR_NONE;
+}
+
+/****************************************************************************
+ Function    : libhidRecv
+ Description : Read response packet from currently-open USB device,
+               overwriting the contents of the buffer.
+ Parameters  : char*      Report buffer.
+               int        Timeout in milliseconds.
+ Returns     : ErrorCode  ERR_NONE on success, ERR_USB_READ on error,
+                          ERR_USB_TIMEOUT if no response arrived.
+ Notes       : Device is assumed to have already been successfully opened
+               by the time this function is called; no checks performed here.
+ ****************************************************************************/
+static ErrorCode libhidRecv(
+  unsigned char * const buf,
+  const int             timeout)
+{
+	hid_return ret = hid_interrupt_read(hid,0x81,(char *)buf,usbReportSize,
+	  timeout);
+
+	if(HID_RET_TIMEOUT == ret) return ERR_USB_TIMEOUT;
+	if(HID_RET_SUCCESS != ret) return ERR_USB_READ;
 
 	return ERR_NONE;
 }
 
 /****************************************************************************
- Function    : usbClose
+ Function    : libhidLocation
+ Description : Reports where the open device sits on the USB bus.
+ Parameters  : int*  Receives bus number.
+               int*  Receives device address on that bus.
+ Returns     : int   1 on success, 0 if unknown.
+ ****************************************************************************/
+static int libhidLocation(
+  int *bus,
+  int *addr)
+{
+	if(!hid || !hid->device) return 0;
+
+	*bus  = atoi(hid->device->bus->dirname);
+	*addr = hid->device->devnum;
+	return 1;
+}
+
+/****************************************************************************
+ Function    : libhidFind
+ Description : Looks for a device on any bus, without opening it for I/O.
+ Parameters  : unsigned short  Vendor ID to search for.
+               unsigned short  Product ID to search for.
+               char*           Serial number to match, or NULL for any.
+ Returns     : int             1 if present, 0 if not.
+ Notes       : libhid offers no enumeration of its own; this goes to the
+               libusb underneath it.
+ ****************************************************************************/
+static int libhidFind(
+  const unsigned short vendorID,
+  const unsigned short productID,
+  const char * const   serial)
+{
+	struct usb_bus    *bus;
+	struct usb_device *dev;
+	usb_dev_handle    *handle;
+	char               str[128];
+	int                found = 0;
+
+	usb_init();
+	(void)usb_find_busses();
+	(void)usb_find_devices();
+
+	for(bus=usb_get_busses();bus && !found;bus=bus->next) {
+		for(dev=bus->devices;dev && !found;dev=dev->next) {
+			if((dev->descriptor.idVendor != vendorID) ||
+			   (dev->descriptor.idProduct != productID))
+				continue;
+			if(!serial) {
+				found = 1;
+			} else if(dev->descriptor.iSerialNumber &&
+			  (handle = usb_open(dev))) {
+				found = (usb_get_string_simple(handle,
+				  dev->descriptor.iSerialNumber,str,sizeof(str)) > 0) &&
+				  !strcmp(str,serial);
+				(void)usb_close(handle);
+			}
+		}
+	}
+
+	return found;
+}
+
+/****************************************************************************
+ Function    : libhidSerial
+ Description : Reads the open device's serial number string.
+ Parameters  : char*  Receives the serial number, NUL-terminated.
+               int    Size of buffer.
+ Returns     : int    1 on success, 0 if the device has none.
+ ****************************************************************************/
+static int libhidSerial(
+  char * const buf,
+  const int    size)
+{
+	if(!hid || !hid->device || !hid->device->descriptor.iSerialNumber)
+		return 0;
+
+	return usb_get_string_simple(hid->dev_handle,
+	  hid->device->descriptor.iSerialNumber,buf,size) > 0;
+}
+
+/****************************************************************************
+ Function    : libhidClose
  Description : Closes previously-opened USB device.
  Parameters  : None (void)
  Returns     : Nothing (void)
  Notes       : Device is assumed to have already been successfully opened
                by the time this function is called; no checks performed here.
  ****************************************************************************/
-void usbClose(void)
+static void libhidClose(void)
 {
 	(void)hid_close(hid);
 	hid_delete_HIDInterface(&hid);
 	(void)hid_cleanup();
 	hid = NULL;
 }
+
+const Transport transportLibhid = {
+	"libhid",1,libhidOpen,libhidSend,libhidRecv,libhidLocation,libhidFind,
+	libhidSerial,libhidClose
+};
@@ -32,12 +32,12 @@
  ****************************************************************************/
 
 #include <stdio.h>
+#include <string.h>
 #include <IOKit/hid/IOHIDDevicePlugIn.h>
 #include "mphidflash.h"
 
 static IOHIDDeviceDeviceInterface **device = NULL;
-unsigned char        usbBufX[64];
-unsigned char       * usbBuf = usbBufX;
+static unsigned char  report[USB_MAX_REPORT];  /* Filled by input callback */
 
 /****************************************************************************
  Function    : usbCallback
@@ -61,7 +61,7 @@ static void usbCallback(
 }
 
 /****************************************************************************
- Function    : usbOpen
+ Function    : osxOpen
  Description : Searches for and opens the first available HID USB device.
  Parameters  : unsigned short         Vendor ID to search for.
                unsigned short         Product ID to search for.
@@ -81,7 +81,7 @@ static void usbCallback(
                This code sets no particular preference or sequence in the
                search ordering; whatever IOServiceGetMatchingService decides.
  ****************************************************************************/
-ErrorCode usbOpen(
+static ErrorCode osxOpen(
   const unsigned short vendorID,
   const unsigned short productID)
 {
@@ -126,7 +126,7 @@ ErrorCode usbOpen(
 
           if((kIOReturnSuccess == (*device)->open(device,0))) {
 
-            CFTypeRef eventSource;
+            CFTypeRef eventSource,reportSize = NULL;
 
             status = ERR_USB_INIT2; /* Open OK, phase 2 init awaits */
 
@@ -134,11 +134,20 @@ ErrorCode usbOpen(
             if((kIOReturnSuccess ==
                 (*device)->getAsyncEventSource(device,&eventSource)) &&
                (kIOReturnSuccess == (*device)->setInputReportCallback(device,
-                (unsigned char *)usbBuf,sizeof(usbBufX),usbCallback,NULL,0))) {
+                report,sizeof(report),usbCallback,NULL,0))) {
 
               CFRunLoopAddSource(CFRunLoopGetCurrent(),
                 (CFRunLoopSourceRef)eventSource,kCFRunLoopDefaultMode);
 
+              /* Report size as published by the HID driver */
+              if((kIOReturnSuccess == (*device)->getProperty(device,
+                   CFSTR(kIOHIDMaxInputReportSizeKey),&reportSize)) &&
+                 reportSize &&
+                 CFNumberGetValue((CFNumberRef)reportSize,
+                   kCFNumberIntType,&usbReportSize) &&
+                 (usbReportSize > USB_MAX_REPORT))
+                usbReportSize = USB_MAX_REPORT;
+
               return ERR_NONE;
 
             } /* else cleanup and return error code */
@@ -155,63 +164,149 @@ ErrorCode usbOpen(
 }
 
 /****************************************************************************
- Function    : usbWrite
- Description : Write data packet to currently-open device, optionally
-               followed by a packet read operation.  Data source is always
-               global array usbBuf[].  For read operation, destination is
-               always usbBuf[] also, overwriting contents there.
- Parameters  : char       Size of source data in bytes (max 64).
-               char       If set, read response packet.
+ Function    : osxSend
+ Description : Write data packet to currently-open USB device.
+ Parameters  : char*      Report buffer.
+               int        Size of source data in bytes (max usbReportSize).
+               int        Timeout in milliseconds.
  Returns     : ErrorCode  ERR_NONE on success, ERR_USB_WRITE on error.
  Notes       : Device is assumed to have already been successfully opened
                by the time this function is called; no checks performed here.
  ****************************************************************************/
-ErrorCode usbWrite(
-  const char len,
-  const char read)
+static ErrorCode osxSend(
+  unsigned char * const buf,
+  const int             len,
+  const int             timeout)
 {
-#ifdef DEBUG
-	int i;
-	(void)puts("Sending:");
-	for(i=0;i<8;i++) (void)printf("%02x ",((unsigned char *)usbBuf)[i]);
-	(void)printf(": ");
-	for(;i<64;i++) (void)printf("%02x ",((unsigned char *)usbBuf)[i]);
-	(void)putchar('\n'); fflush(stdout);
-	DEBUGMSG("\nAbout to write");
-#endif
-
 	if(kIOReturnSuccess != (*device)->setReport(device,
-	  kIOHIDReportTypeOutput,0,usbBuf,len,500,NULL,NULL,0))
+	  kIOHIDReportTypeOutput,0,buf,len,timeout,NULL,NULL,0))
 		return ERR_USB_WRITE;
 
-	DEBUGMSG("Done w/write");
-
-	if(read) {
-		DEBUGMSG("About to read");
-		CFRunLoopRun(); /* Read invokes callback when done */
-#ifdef DEBUG
-		(void)puts("Done reading\nReceived:");
-		for(i=0;i<8;i++) (void)printf("%02x ",usbBuf[i]);
-		(void)printf(": ");
-		for(;i<64;i++) (void)printf("%02x ",usbBuf[i]);
-		(void)putchar('\n'); fflush(stdout);
-#endif
-	}
+	return ERR_NONE;
+}
+
+/****************************************************************************
+ Function    : osxRecv
+ Description : Read response packet from currently-open USB device,
+               overwriting the contents of the buffer.
+ Parameters  : char*      Report buffer.
+               int        Timeout in milliseconds.
+ Returns     : ErrorCode  ERR_NONE on success, ERR_USB_TIMEOUT if no
+                          response arrived.
+ Notes       : Device is assumed to have already been successfully opened
+               by the time this function is called; no checks performed here.
+ ****************************************************************************/
+static ErrorCode osxRecv(
+  unsigned char * const buf,
+  const int             timeout)
+{
+	/* Read invokes callback when done, which stops the run loop */
+	if(kCFRunLoopRunTimedOut == CFRunLoopRunInMode(kCFRunLoopDefaultMode,
+	  timeout / 1000.0,false))
+		return ERR_USB_TIMEOUT;
+	memcpy(buf,report,usbReportSize);
 
 	return ERR_NONE;
 }
 
 /****************************************************************************
- Function    : usbClose
+ Function    : osxLocation
+ Description : Reports where the open device sits on the USB bus.
+ Parameters  : int*  Receives bus number.
+               int*  Receives device address on that bus.
+ Returns     : int   0; not supported on OS X.
+ ****************************************************************************/
+static int osxLocation(
+  int *bus,
+  int *addr)
+{
+	return 0;
+}
+
+/****************************************************************************
+ Function    : osxFind
+ Description : Looks for a USB device (of any class) in the I/O Registry,
+               without opening it.
+ Parameters  : unsigned short  Vendor ID to search for.
+               unsigned short  Product ID to search for.
+               char*           Serial number to match, or NULL for any.
+ Returns     : int             1 if present, 0 if not, -1 if the registry
+                               can't be searched.
+ ****************************************************************************/
+static int osxFind(
+  const unsigned short vendorID,
+  const unsigned short productID,
+  const char * const   serial)
+{
+	CFMutableDictionaryRef dict;
+	CFStringRef            str;
+	io_iterator_t          iter;
+	io_service_t           service;
+	char                   buf[128];
+	int                    vid = vendorID,pid = productID,found = 0;
+
+	if(!(dict = IOServiceMatching("IOUSBDevice")))
+		return -1;
+	CFDictionarySetValue(dict,CFSTR("idVendor"),
+	  CFNumberCreate(kCFAllocatorDefault,kCFNumberIntType,&vid));
+	CFDictionarySetValue(dict,CFSTR("idProduct"),
+	  CFNumberCreate(kCFAllocatorDefault,kCFNumberIntType,&pid));
+
+	/* As with IOServiceGetMatchingService(), this consumes dict */
+	if(kIOReturnSuccess !=
+	  IOServiceGetMatchingServices(kIOMasterPortDefault,dict,&iter))
+		return -1;
+
+	while(!found && (service = IOIteratorNext(iter))) {
+		if(!serial) {
+			found = 1;
+		} else if((str = IORegistryEntryCreateCFProperty(service,
+		  CFSTR("USB Serial Number"),kCFAllocatorDefault,0))) {
+			found = CFStringGetCString(str,buf,sizeof(buf),
+			  kCFStringEncodingUTF8) && !strcmp(buf,serial);
+			CFRelease(str);
+		}
+		(void)IOObjectRelease(service);
+	}
+	(void)IOObjectRelease(iter);
+
+	return found;
+}
+
+/****************************************************************************
+ Function    : osxSerial
+ Description : Reads the open device's serial number string.
+ Parameters  : char*  Receives the serial number, NUL-terminated.
+               int    Size of buffer.
+ Returns     : int    1 on success, 0 if the device has none.
+ ****************************************************************************/
+static int osxSerial(
+  char * const buf,
+  const int    size)
+{
+	CFTypeRef str;
+
+	return device && (kIOReturnSuccess == (*device)->getProperty(device,
+	  CFSTR(kIOHIDSerialNumberKey),&str)) && str &&
+	  (CFGetTypeID(str) == CFStringGetTypeID()) &&
+	  CFStringGetCString((CFStringRef)str,buf,size,kCFStringEncodingUTF8);
+}
+
+/****************************************************************************
+ Function    : osxClose
  Description : Closes previously-opened USB device.
  Parameters  : None (void)
  Returns     : Nothing (void)
  Notes       : Device is assumed to have already been successfully opened
                by the time this function is called; no checks performed here.
  ****************************************************************************/
-void usbClose(void)
+static void osxClose(void)
 {
 	(*device)->close(device,0);
 	(*device)->Release(device);
 	device = NULL;
 }
+
+const Transport transportOsx = {
+	"osx",1,osxOpen,osxSend,osxRecv,osxLocation,osxFind,osxSerial,osxClose
+};
@@ -0,0 +1,352 @@
+/****************************************************************************
+ File        : usb-replay.c
+ Description : The "replay" transport, in place of a real device: plays
+               back a session recorded with the --trace option (see
+               trace.c), when chosen with --transport replay or --replay.  Each report
+               the program sends is checked against the recording, and the
+               recorded device-side time of every write and read is waited
+               out again, while host-side time between operations is left
+               to happen live.  A slow session captured on a station can
+               thus be rerun on a development machine with the same device
+               timing, and the summary printed on close shows how the time
+               divides between device and host for each command.
+
+               With --conform the recording is a golden packet stream: the
+               first report that differs from it by a byte, and a session
+               that stops short of it or runs past its end, fail the run,
+               and recorded times are not waited out.  A trace taken with
+               the simulator (or a real device) for a hex file can
+               so show that a change to packetization sends exactly what it
+               did before.  Every replay ends with the session's protocol
+               cost: reports, round trips and PROGRAM_COMPLETEs, in all and
+               per KB programmed.
+
+ License     : This file is part of 'mphidflash' program.
+
+               'mphidflash' is free software: you can redistribute it and/or
+               modify it under the terms of the GNU General Public License
+               as published by the Free Software Foundation, either version
+               3 of the License, or (at your option) any later version.
+
+               'mphidflash' is distributed in the hope that it will be useful,
+               but WITHOUT ANY WARRANTY; without even the implied warranty
+               of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+               See the GNU General Public License for more details.
+
+               You should have received a copy of the GNU General Public
+               License along with 'mphidflash' source code.  If not,
+               see <http://www.gnu.org/licenses/>.
+
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "mphidflash.h"
+
+char          *replayFile = NULL;      /* Set by --replay in main.c */
+char           replayConform = 0;      /* Set by --conform in main.c */
+
+static FILE   *replayFp = NULL;
+
+/* Most recently read trace record */
+static struct {
+	unsigned int  delta;               /* usec since previous record */
+	unsigned int  dur;                 /* usec taken by the operation */
+	unsigned char dir;
+	int           len;
+	unsigned char data[65536];
+} rec;
+
+static unsigned int       prevDur;     /* Recorded duration of prior op  */
+static unsigned long long prevEnd;     /* Live end time of prior op      */
+static unsigned long      reports,diverged;
+static unsigned long      roundTrips,completes,programmed;
+
+/* Per-command time accounting, indexed by command byte */
+#define STAT_CMDS 64
+static struct {
+	unsigned long      count;
+	unsigned long long device;         /* Recorded device time, usec */
+	unsigned long long recHost;        /* Recorded host time, usec   */
+	unsigned long long liveHost;       /* Host time in replay, usec  */
+} stats[STAT_CMDS];
+static int curCmd;
+
+/* Read next record from trace; returns 0 at end of file */
+static int readRecord(void)
+{
+	unsigned char hdr[11];
+
+	if(1 != fread(hdr,sizeof(hdr),1,replayFp))
+		return 0;
+	rec.delta = hdr[0] | (hdr[1] << 8) | (hdr[2] << 16) | (hdr[3] << 24);
+	rec.dur   = hdr[4] | (hdr[5] << 8) | (hdr[6] << 16) | (hdr[7] << 24);
+	rec.dir   = hdr[8];
+	rec.len   = hdr[9] | (hdr[10] << 8);
+
+	return (rec.len == 0) ||
+	  (1 == fread(rec.data,rec.len,1,replayFp));
+}
+
+/* Sleep until the given traceClock() time */
+static void waitUntil(const unsigned long long t)
+{
+	unsigned long long now = traceClock();
+	struct timespec    ts;
+
+	if(now >= t) return;
+	ts.tv_sec  = (t - now) / 1000000000ULL;
+	ts.tv_nsec = (t - now) % 1000000000ULL;
+	(void)nanosleep(&ts,NULL);
+}
+
+/****************************************************************************
+ Function    : replayOpen
+ Description : Opens the trace file named by replayFile in place of a device.
+ Parameters  : unsigned short  Vendor ID (ignored).
+               unsigned short  Product ID (ignored).
+ Returns     : ErrorCode       ERR_NONE on success, ERR_TRACE_OPEN if the
+                               file is missing or not a trace.
+ ****************************************************************************/
+static ErrorCode replayOpen(
+  const unsigned short vendorID,
+  const unsigned short productID)
+{
+	unsigned char hdr[8];
+
+	if(!replayFile || !(replayFp = fopen(replayFile,"rb")))
+		return ERR_TRACE_OPEN;
+
+	if((1 != fread(hdr,sizeof(hdr),1,replayFp)) ||
+	   memcmp(hdr,"MPHT",4) || (hdr[4] != TRACE_VERSION)) {
+		(void)fclose(replayFp);
+		replayFp = NULL;
+		return ERR_TRACE_OPEN;
+	}
+
+	/* Report size is whatever the recorded responses used */
+	while(readRecord()) {
+		if(rec.dir == TRACE_IN) {
+			usbReportSize = (rec.len < USB_MAX_REPORT) ?
+			  rec.len : USB_MAX_REPORT;
+			break;
+		}
+	}
+	(void)fseek(replayFp,sizeof(hdr),SEEK_SET);
+
+	memset(stats,0,sizeof(stats));
+	reports = diverged = prevDur = 0;
+	roundTrips = completes = programmed = 0;
+	prevEnd = traceClock();
+
+	return ERR_NONE;
+}
+
+/****************************************************************************
+ Function    : replaySend
+ Description : Compares the outgoing report against the next recorded one
+               and reproduces the recorded write time.
+ Parameters  : char*      Report buffer.
+               int        Size of source data in bytes (max usbReportSize).
+               int        Timeout in milliseconds (ignored).
+ Returns     : ErrorCode  ERR_NONE on success, ERR_USB_WRITE once the
+                          recording is exhausted.
+ ****************************************************************************/
+static ErrorCode replaySend(
+  unsigned char * const buf,
+  const int             len,
+  const int             timeout)
+{
+	unsigned long long start = traceClock();
+	int                i;
+
+	/* Skip over any reads the program didn't repeat this time */
+	do {
+		if(!readRecord()) {
+			(void)puts("\nReplay: end of recorded session");
+			return replayConform ? ERR_CONFORM : ERR_USB_WRITE;
+		}
+		if(replayConform && (rec.dir != TRACE_OUT)) {
+			(void)printf("\nReplay: report %lu sent without reading the "
+			  "recorded response first\n",reports + 1);
+			return ERR_CONFORM;
+		}
+	} while(rec.dir != TRACE_OUT);
+
+	reports++;
+	if(buf[0] == PROGRAM_DEVICE)   programmed += buf[5];
+	if(buf[0] == PROGRAM_COMPLETE) completes++;
+	if((rec.len != len) || memcmp(rec.data,buf,len)) {
+		if(!diverged++)
+			(void)printf("\nReplay: report %lu differs from recording\n",
+			  reports);
+		if(replayConform) {
+			for(i=0;(i < len) && (i < rec.len) &&
+			  (rec.data[i] == buf[i]);i++);
+			if((i < len) && (i < rec.len))
+				(void)printf("Byte %d: sent %02x (command %02x), recorded "
+				  "%02x (command %02x)\n",i,buf[i],buf[0],
+				  rec.data[i],rec.data[0]);
+			else
+				(void)printf("Sent %d bytes, recorded %d\n",len,rec.len);
+			return ERR_CONFORM;
+		}
+	}
+
+	curCmd = buf[0] % STAT_CMDS;
+	stats[curCmd].count++;
+	stats[curCmd].device   += rec.dur;
+	stats[curCmd].recHost  += (rec.delta > prevDur) ? rec.delta - prevDur : 0;
+	stats[curCmd].liveHost += (start - prevEnd) / 1000;
+
+	if(!replayConform)
+		waitUntil(start + rec.dur * 1000ULL);
+	prevDur = rec.dur;
+	prevEnd = traceClock();
+
+	return ERR_NONE;
+}
+
+/****************************************************************************
+ Function    : replayRecv
+ Description : Returns the recorded response after waiting out the
+               recorded read time.
+ Parameters  : char*      Report buffer.
+               int        Timeout in milliseconds (ignored).
+ Returns     : ErrorCode  ERR_NONE on success, ERR_USB_READ if the recording
+                          has no response at this point.
+ ****************************************************************************/
+static ErrorCode replayRecv(
+  unsigned char * const buf,
+  const int             timeout)
+{
+	unsigned long long start = traceClock();
+
+	if(!readRecord() || (rec.dir != TRACE_IN)) {
+		(void)puts("\nReplay: no recorded response for this report");
+		return ERR_USB_READ;
+	}
+
+	memcpy(buf,rec.data,(rec.len < USB_MAX_REPORT) ? rec.len : USB_MAX_REPORT);
+	stats[curCmd].device += rec.dur;
+	roundTrips++;
+
+	if(!replayConform)
+		waitUntil(start + rec.dur * 1000ULL);
+	prevDur = rec.dur;
+	prevEnd = traceClock();
+
+	return ERR_NONE;
+}
+
+/****************************************************************************
+ Function    : replayLocation
+ Description : Reports where the open device sits on the USB bus.
+ Parameters  : int*  Receives bus number.
+               int*  Receives device address on that bus.
+ Returns     : int   0; a replayed session has no bus location.
+ ****************************************************************************/
+static int replayLocation(
+  int *bus,
+  int *addr)
+{
+	return 0;
+}
+
+/****************************************************************************
+ Function    : replayFind
+ Description : Looks for a device on the bus.
+ Parameters  : unsigned short  Vendor ID (ignored).
+               unsigned short  Product ID (ignored).
+               char*           Serial number (ignored).
+ Returns     : int             -1; a replayed session has no bus.
+ ****************************************************************************/
+static int replayFind(
+  const unsigned short vendorID,
+  const unsigned short productID,
+  const char * const   serial)
+{
+	return -1;
+}
+
+/****************************************************************************
+ Function    : replaySerial
+ Description : Reads the open device's serial number string.
+ Parameters  : char*  Receives the serial number (unused).
+               int    Size of buffer.
+ Returns     : int    0; a trace doesn't record the serial number.
+ ****************************************************************************/
+static int replaySerial(
+  char * const buf,
+  const int    size)
+{
+	return 0;
+}
+
+/****************************************************************************
+ Function    : replayCheck
+ Description : Checks, for --conform, that the session sent everything the
+               recording holds.
+ Parameters  : None (void)
+ Returns     : ErrorCode  ERR_NONE if so (or not checking), else ERR_CONFORM.
+ Notes       : Call once the session is over, before usbClose().  Reads
+               left in the recording after the last report are ignored.
+ ****************************************************************************/
+ErrorCode replayCheck(void)
+{
+	unsigned long more = 0;
+
+	if(!replayConform || !replayFp) return ERR_NONE;
+
+	while(readRecord())
+		if(rec.dir == TRACE_OUT) more++;
+	if(!more) return ERR_NONE;
+
+	(void)printf("Replay: session stopped %lu reports short of recording\n",
+	  more);
+	return ERR_CONFORM;
+}
+
+/****************************************************************************
+ Function    : replayClose
+ Description : Closes trace file and prints where the session's time went.
+ Parameters  : None (void)
+ Returns     : Nothing (void)
+ ****************************************************************************/
+static void replayClose(void)
+{
+	int i;
+
+	if(!replayFp) return;
+	(void)fclose(replayFp);
+	replayFp = NULL;
+
+	(void)printf("Replay: %lu reports, %lu differed from recording\n",
+	  reports,diverged);
+	(void)printf("Protocol: %lu reports, %lu round trips, %lu completes "
+	  "for %lu bytes programmed",reports,roundTrips,completes,programmed);
+	if(programmed)
+		(void)printf("; per KB: %.2f reports, %.2f round trips, "
+		  "%.3f completes",
+		  reports * 1024.0 / programmed,roundTrips * 1024.0 / programmed,
+		  completes * 1024.0 / programmed);
+	(void)putchar('\n');
+	(void)puts("Command            Count   Device ms  Host ms (recorded)"
+	  "  Host ms (replay)");
+	for(i=0;i<STAT_CMDS;i++) {
+		if(!stats[i].count) continue;
+		if(usbCommandName(i))
+			(void)printf("%-16s",usbCommandName(i));
+		else
+			(void)printf("Command 0x%02x    ",i);
+		(void)printf("%8lu %11.1f %19.1f %17.1f\n",stats[i].count,
+		  stats[i].device / 1000.0,stats[i].recHost / 1000.0,
+		  stats[i].liveHost / 1000.0);
+	}
+}
+
+const Transport transportReplay = {
+	"replay",0,replayOpen,replaySend,replayRecv,replayLocation,replayFind,
+	replaySerial,replayClose
+};
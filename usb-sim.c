@@ -0,0 +1,209 @@
+/****************************************************************************
+ File        : usb-sim.c
+ Description : The "sim" transport, in place of a real device: the
+               simulated HID bootloader of bootsim.c, for trying out and
+               testing the tool without a board; with --sim-stock it offers
+               only the stock protocol.  Used only when chosen, with
+               --transport sim (or --sim-flash or --sim-stock).  Timing follows a full-speed link, one 1 ms frame
+               per report, and an erase holds up the next command as on a
+               real device.
+
+               With --sim-flash <file>, memory is loaded from the file when
+               the device is opened and saved back when it is closed, so
+               that one run can check what an earlier run wrote.  The file
+               is locked while open, so that it stands for one device: a
+               second process using it finds no device, as it would find a
+               real one already claimed.
+
+ License     : This file is part of 'mphidflash' program.
+
+               'mphidflash' is free software: you can redistribute it and/or
+               modify it under the terms of the GNU General Public License
+               as published by the Free Software Foundation, either version
+               3 of the License, or (at your option) any later version.
+
+               'mphidflash' is distributed in the hope that it will be useful,
+               but WITHOUT ANY WARRANTY; without even the implied warranty
+               of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+               See the GNU General Public License for more details.
+
+               You should have received a copy of the GNU General Public
+               License along with 'mphidflash' source code.  If not,
+               see <http://www.gnu.org/licenses/>.
+
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include "mphidflash.h"
+
+#define SIM_FRAME_NS   1000000ULL /* One report per full-speed frame     */
+
+char          *simFlash  = NULL;      /* Set by --sim-flash in main.c */
+char           simStock  = 0;         /* Set by --sim-stock in main.c */
+
+static unsigned char      reply[USB_MAX_REPORT];
+static char               replied  = 0;   /* Response waiting in reply[] */
+static unsigned long long busyUntil = 0;  /* End of erase in progress    */
+static int                lockFd    = -1; /* Holds --sim-flash file      */
+
+/* Sleep until the given traceClock() time */
+static void simWait(const unsigned long long t)
+{
+	unsigned long long now = traceClock();
+	struct timespec    ts;
+
+	if(now >= t) return;
+	ts.tv_sec  = (t - now) / 1000000000ULL;
+	ts.tv_nsec = (t - now) % 1000000000ULL;
+	(void)nanosleep(&ts,NULL);
+}
+
+/****************************************************************************
+ Function    : simOpen
+ Description : "Finds" the simulated device, erased or loaded from the
+               --sim-flash file.
+ Parameters  : unsigned short  Vendor ID (ignored).
+               unsigned short  Product ID (ignored).
+ Returns     : ErrorCode       ERR_NONE on success, ERR_DEVICE_NOT_FOUND if
+                               another process has the --sim-flash file,
+                               ERR_USB_OPEN if it can't be opened.
+ ****************************************************************************/
+static ErrorCode simOpen(
+  const unsigned short vendorID,
+  const unsigned short productID)
+{
+	if(simFlash) {
+		if((lockFd = open(simFlash,O_RDWR | O_CREAT,0644)) < 0)
+			return ERR_USB_OPEN;
+		if(flock(lockFd,LOCK_EX | LOCK_NB)) {
+			(void)close(lockFd);
+			lockFd = -1;
+			return ERR_DEVICE_NOT_FOUND;
+		}
+	}
+	bootsimOpen(simFlash,simStock);
+	usbReportSize = 64;
+	replied       = 0;
+	busyUntil     = 0;
+
+	return ERR_NONE;
+}
+
+/****************************************************************************
+ Function    : simSend
+ Description : Carries out one command sent to the simulated bootloader.
+ Parameters  : char*      Report buffer.
+               int        Size of source data in bytes (max usbReportSize).
+               int        Timeout in milliseconds (ignored).
+ Returns     : ErrorCode  ERR_NONE.
+ ****************************************************************************/
+static ErrorCode simSend(
+  unsigned char * const buf,
+  const int             len,
+  const int             timeout)
+{
+	unsigned int busyMs;
+
+	/* A command waits out any erase in progress, then its own frame */
+	simWait(busyUntil);
+	simWait(traceClock() + SIM_FRAME_NS);
+
+	replied = bootsimCommand(buf,reply,usbReportSize,&busyMs);
+	if(busyMs)
+		busyUntil = traceClock() + busyMs * 1000000ULL;
+
+	return ERR_NONE;
+}
+
+/****************************************************************************
+ Function    : simRecv
+ Description : Returns the response to the last command.
+ Parameters  : char*      Report buffer.
+               int        Timeout in milliseconds.
+ Returns     : ErrorCode  ERR_NONE on success, ERR_USB_TIMEOUT (after the
+                          timeout) if the command has no response.
+ ****************************************************************************/
+static ErrorCode simRecv(
+  unsigned char * const buf,
+  const int             timeout)
+{
+	if(!replied) {
+		simWait(traceClock() + timeout * 1000000ULL);
+		return ERR_USB_TIMEOUT;
+	}
+	simWait(busyUntil);
+	simWait(traceClock() + SIM_FRAME_NS);
+	memcpy(buf,reply,usbReportSize);
+	replied = 0;
+
+	return ERR_NONE;
+}
+
+/****************************************************************************
+ Function    : simLocation
+ Description : Reports where the open device sits on the USB bus.
+ Parameters  : int*  Receives bus number.
+               int*  Receives device address on that bus.
+ Returns     : int   0; the simulated device isn't on a bus.
+ ****************************************************************************/
+static int simLocation(
+  int *bus,
+  int *addr)
+{
+	return 0;
+}
+
+/****************************************************************************
+ Function    : simSerial
+ Description : Reads the open device's serial number string.
+ Parameters  : char*  Receives the serial number, NUL-terminated.
+               int    Size of buffer.
+ Returns     : int    1.
+ ****************************************************************************/
+static int simSerial(
+  char * const buf,
+  const int    size)
+{
+	(void)snprintf(buf,size,"%s",bootsimSerial());
+	return 1;
+}
+
+/****************************************************************************
+ Function    : simFind
+ Description : Looks for a device on the bus.
+ Parameters  : unsigned short  Vendor ID (ignored).
+               unsigned short  Product ID (ignored).
+               char*           Serial number (ignored).
+ Returns     : int             -1; the simulated device isn't on a bus.
+ ****************************************************************************/
+static int simFind(
+  const unsigned short vendorID,
+  const unsigned short productID,
+  const char * const   serial)
+{
+	return -1;
+}
+
+/****************************************************************************
+ Function    : simClose
+ Description : Saves memory to the --sim-flash file, if any.
+ Parameters  : None (void)
+ Returns     : Nothing (void)
+ ****************************************************************************/
+static void simClose(void)
+{
+	bootsimClose();
+	if(lockFd >= 0) {
+		(void)close(lockFd);
+		lockFd = -1;
+	}
+}
+
+const Transport transportSim = {
+	"sim",0,simOpen,simSend,simRecv,simLocation,simFind,simSerial,simClose
+};
@@ -29,20 +29,19 @@
  ****************************************************************************/
 
 #include <stdio.h>
+#include <string.h>
 #include <windows.h>
 #include <setupapi.h>
 #include <ddk/hidsdi.h>
 #include <ddk/hidpi.h>
 #include "mphidflash.h"
 
-HANDLE usbdevhandle = INVALID_HANDLE_VALUE; 
-unsigned char        usbBufX[65];
-unsigned char *      usbBuf = &usbBufX[1];
+static HANDLE usbdevhandle = INVALID_HANDLE_VALUE; 
 
 HIDP_CAPS       Capabilities;   
 PHIDP_PREPARSED_DATA        HidParsedData;   
 
-ErrorCode usbOpen(
+static ErrorCode windowsOpen(
   const unsigned short vendorID,
   const unsigned short productID)
 {
@@ -107,6 +106,11 @@ ErrorCode usbOpen(
          /* Free the memory allocated when getting the preparsed data */   
          HidD_FreePreparsedData(HidParsedData);         
 
+		/* report size, less the leading report id byte */
+		usbReportSize = Capabilities.InputReportByteLength - 1;
+		if (usbReportSize > USB_MAX_REPORT)
+			usbReportSize = USB_MAX_REPORT;
+
 		/* okay, here we found our device */
 		status = ERR_NONE;
 		break;
@@ -121,58 +125,98 @@ ErrorCode usbOpen(
 }
 
 
-ErrorCode usbWrite(
-  const char len,
-  const char read)
+static ErrorCode windowsSend(
+  unsigned char * const buf,
+  const int             len,
+  const int             timeout)
 {
-
-	BOOLEAN rval = 0;
 	DWORD   bytesWritten = 0;
-	DWORD   bytesRead = 0;
-
-#ifdef DEBUG
-	int i;
-	(void)puts("Sending:");
-	for(i=0;i<8;i++) (void)printf("%02x ",((unsigned char *)usbBuf)[i]);
-	(void)printf(": ");
-	for(;i<64;i++) (void)printf("%02x ",((unsigned char *)usbBuf)[i]);
-	(void)putchar('\n'); fflush(stdout);
-	DEBUGMSG("\nAbout to write");
-	printf("usbdevhandle: %d, usbBuf: %d, len: %d, %d\n", usbdevhandle, usbBuf, len, Capabilities.OutputReportByteLength);
-#endif
-
 
-	/* report id */
-	usbBufX[0] = 0;
+	/* report id, in the byte before the report */
+	buf[-1] = 0;
 
-	if (WriteFile(usbdevhandle, usbBufX, Capabilities.OutputReportByteLength, &bytesWritten, 0) == 0) {
+	if (WriteFile(usbdevhandle, &buf[-1], Capabilities.OutputReportByteLength, &bytesWritten, 0) == 0) {
 //		printf("usb write failed, Error %u\n", GetLastError());
 
 		return ERR_USB_WRITE;
 	}
 
-	DEBUGMSG("Done w/write");
+	return ERR_NONE;
+}
 
+static ErrorCode windowsRecv(
+  unsigned char * const buf,
+  const int             timeout)
+{
+	DWORD   bytesRead = 0;
 
-	if (read) {
-		if (ReadFile(usbdevhandle, usbBufX, Capabilities.OutputReportByteLength, &bytesRead, 0) == 0) {
-//			printf("usb read failed, Error %u\n", GetLastError());
-			return ERR_USB_READ;
-		}
-	
-#ifdef DEBUG
-		(void)puts("Done reading\nReceived:");
-		for(i=0;i<8;i++) (void)printf("%02x ",usbBuf[i]);
-		(void)printf(": ");
-		for(;i<64;i++) (void)printf("%02x ",usbBuf[i]);
-		(void)putchar('\n'); fflush(stdout);
-#endif
+	if (ReadFile(usbdevhandle, &buf[-1], Capabilities.OutputReportByteLength, &bytesRead, 0) == 0) {
+//		printf("usb read failed, Error %u\n", GetLastError());
+		return ERR_USB_READ;
 	}
 
 	return ERR_NONE;
 }
 
-void usbClose(void)
+static int windowsLocation(
+  int *bus,
+  int *addr)
+{
+	/* Bus topology scheduling is not supported on Windows */
+	return 0;
+}
+
+static int windowsFind(
+  const unsigned short vendorID,
+  const unsigned short productID,
+  const char * const   serial)
+{
+	HDEVINFO        deviceInfoList;
+	SP_DEVINFO_DATA deviceInfo;
+	char            id[256], want[32];
+	int             i, n, found = 0;
+
+	/* Any USB device, not just HID: the application may be any class */
+	deviceInfoList = SetupDiGetClassDevs(NULL, "USB", NULL, DIGCF_ALLCLASSES | DIGCF_PRESENT);
+	if (deviceInfoList == INVALID_HANDLE_VALUE)
+		return -1;
+
+	/* Instance IDs look like USB\VID_04D8&PID_000A\<serial or port> */
+	n = sprintf(want, "USB\\VID_%04X&PID_%04X\\", vendorID, productID);
+	deviceInfo.cbSize = sizeof(deviceInfo);
+
+	for (i = 0; !found && SetupDiEnumDeviceInfo(deviceInfoList, i, &deviceInfo); i++) {
+		if (!SetupDiGetDeviceInstanceId(deviceInfoList, &deviceInfo, id, sizeof(id), NULL))
+			continue;
+		if (strncasecmp(id, want, n))
+			continue;
+		found = !serial || !strcasecmp(&id[n], serial);
+	}
+
+	SetupDiDestroyDeviceInfoList(deviceInfoList);
+
+	return found;
+}
+
+static int windowsSerial(
+  char * const buf,
+  const int    size)
+{
+	wchar_t str[128];
+
+	if (!HidD_GetSerialNumberString(usbdevhandle, str, sizeof(str)))
+		return 0;
+
+	return WideCharToMultiByte(CP_UTF8, 0, str, -1, buf, size, NULL, NULL) > 1;
+}
+
+static void windowsClose(void)
 {
 	CloseHandle(usbdevhandle);
+	usbdevhandle = INVALID_HANDLE_VALUE;
 }
+
+const Transport transportWindows = {
+	"windows", 1, windowsOpen, windowsSend, windowsRecv, windowsLocation,
+	windowsFind, windowsSerial, windowsClose
+};
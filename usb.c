@@ -0,0 +1,466 @@
+/****************************************************************************
+ File        : usb.c
+ Description : Portable half of the USB I/O code.  The usb-*.c sources
+               each provide a transport (see Transport in mphidflash.h),
+               and as many as the platform has are built in together: the
+               one to use is chosen with --transport, or else each that
+               can look for real devices is tried in turn until one opens
+               a device.  The usb*() calls used by the rest of the program
+               go to that transport from here, and usbWrite() is built on
+               them, so that debug dumps and session tracing happen in one
+               place rather than once per transport.
+
+               The report buffer, usbBuf[], lives here rather than in any
+               one transport, with a spare byte in front for those that
+               send a report number first.
+
+ License     : This file is part of 'mphidflash' program.
+
+               'mphidflash' is free software: you can redistribute it and/or
+               modify it under the terms of the GNU General Public License
+               as published by the Free Software Foundation, either version
+               3 of the License, or (at your option) any later version.
+
+               'mphidflash' is distributed in the hope that it will be useful,
+               but WITHOUT ANY WARRANTY; without even the implied warranty
+               of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+               See the GNU General Public License for more details.
+
+               You should have received a copy of the GNU General Public
+               License along with 'mphidflash' source code.  If not,
+               see <http://www.gnu.org/licenses/>.
+
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+
+#ifndef WIN
+#include <unistd.h>
+#else
+#include <windows.h>
+#endif
+
+#include "mphidflash.h"
+
+static unsigned char usbBufX[1 + USB_MAX_REPORT];
+unsigned char       *usbBuf = &usbBufX[1];
+
+/* Size of every report exchanged with the device.  64 bytes for the usual
+   full-speed bootloader; transports replace this from the interrupt
+   endpoint descriptor (wMaxPacketSize) when the device is opened. */
+int usbReportSize = 64;
+
+/* Transports built in; those with probe set are tried in this order */
+static const Transport * const transports[] = {
+#if defined(WIN)
+	&transportWindows,
+#elif defined(__APPLE__)
+	&transportOsx,
+#elif !defined(NO_LIBUSB)
+	&transportLibusb,
+#endif
+#ifdef USE_LIBHID
+	&transportLibhid,
+#endif
+#ifdef __linux__
+	&transportHidraw,
+#endif
+#ifndef WIN
+	&transportSim,
+	&transportReplay,
+#endif
+	NULL
+};
+
+static const Transport *chosen  = NULL,  /* By --transport           */
+                       *current = NULL;  /* Of the device now open   */
+
+/****************************************************************************
+ Function    : usbSelect
+ Description : Chooses the transport to use by name, in place of trying
+               each in turn.
+ Parameters  : char*      Transport name, as listed by --help.
+ Returns     : ErrorCode  ERR_NONE on success, ERR_CMD_ARG if there is no
+                          such transport in this build.
+ ****************************************************************************/
+ErrorCode usbSelect(const char * const name)
+{
+	int i;
+
+	for(i=0;transports[i];i++) {
+		if(!strcmp(name,transports[i]->name)) {
+			chosen = transports[i];
+			return ERR_NONE;
+		}
+	}
+
+	return ERR_CMD_ARG;
+}
+
+/****************************************************************************
+ Function    : usbTransportName
+ Description : Names the transports built in, or the one in use.
+ Parameters  : None (void)
+ Returns     : char*  Name of the open device's transport, else of the one
+                      chosen, else a list of all those built in.
+ ****************************************************************************/
+const char *usbTransportName(void)
+{
+	static char list[80];
+	int         i,n;
+
+	if(current) return current->name;
+	if(chosen)  return chosen->name;
+	for(i=0,n=0;transports[i] && (n < sizeof(list));i++)
+		n += snprintf(&list[n],sizeof(list) - n,"%s%s",i ? "," : "",
+		  transports[i]->name);
+	return list;
+}
+
+/****************************************************************************
+ Function    : usbOpen
+ Description : Opens the first bootloader device found with the given IDs,
+               by the transport chosen, or else by the first of those that
+               probe to find one.
+ Parameters  : unsigned short  Vendor ID.
+               unsigned short  Product ID.
+ Returns     : ErrorCode       ERR_NONE on success, else the chosen (or
+                               last probed) transport's error;
+                               ERR_DEVICE_NOT_FOUND if none found one.
+ ****************************************************************************/
+ErrorCode usbOpen(
+  const unsigned short vendorID,
+  const unsigned short productID)
+{
+	ErrorCode status = ERR_DEVICE_NOT_FOUND,s;
+	int       i;
+
+	current = NULL;
+	if(chosen) {
+		if(ERR_NONE == (status = chosen->open(vendorID,productID)))
+			current = chosen;
+		return status;
+	}
+	for(i=0;transports[i];i++) {
+		if(!transports[i]->probe) continue;
+		if(ERR_NONE == (s = transports[i]->open(vendorID,productID))) {
+			current = transports[i];
+			return ERR_NONE;
+		}
+		if(ERR_DEVICE_NOT_FOUND != s) status = s;
+	}
+
+	return status;
+}
+
+/****************************************************************************
+ Function    : usbSend
+ Description : Sends a report to the open device.
+ Parameters  : unsigned char*  Report, with a byte free before it (see
+                               Transport in mphidflash.h).
+               int             Size of data in bytes (max usbReportSize).
+               int             Timeout in milliseconds.
+ Returns     : ErrorCode  ERR_NONE on success, ERR_USB_WRITE on error,
+                          ERR_USB_TIMEOUT if not accepted in time.
+ ****************************************************************************/
+ErrorCode usbSend(
+  unsigned char * const buf,
+  const int             len,
+  const int             timeout)
+{
+	return current->send(buf,len,timeout);
+}
+
+/****************************************************************************
+ Function    : usbRecv
+ Description : Reads one report from the open device.
+ Parameters  : unsigned char*  Receives the report (usbReportSize bytes).
+               int             Timeout in milliseconds.
+ Returns     : ErrorCode  ERR_NONE on success, ERR_USB_READ on error,
+                          ERR_USB_TIMEOUT if nothing came in time.
+ ****************************************************************************/
+ErrorCode usbRecv(
+  unsigned char * const buf,
+  const int             timeout)
+{
+	return current->recv(buf,timeout);
+}
+
+/****************************************************************************
+ Function    : usbLocation
+ Description : Reports where the open device sits on the USB bus.
+ Parameters  : int*  Receives bus number.
+               int*  Receives device address on that bus.
+ Returns     : int   1 on success, 0 if not known.
+ ****************************************************************************/
+int usbLocation(
+  int *bus,
+  int *addr)
+{
+	return current ? current->location(bus,addr) : 0;
+}
+
+/****************************************************************************
+ Function    : usbFind
+ Description : Looks for a device, without opening it, by the transport
+               chosen or else by each that probes.
+ Parameters  : unsigned short  Vendor ID.
+               unsigned short  Product ID.
+               char*           Serial number, or NULL for any.
+ Returns     : int             1 if found, 0 if not, -1 if no transport
+                               can look.
+ ****************************************************************************/
+int usbFind(
+  const unsigned short vendorID,
+  const unsigned short productID,
+  const char * const   serial)
+{
+	int i,n,found = -1;
+
+	if(chosen)
+		return chosen->find(vendorID,productID,serial);
+	for(i=0;transports[i] && (found < 1);i++)
+		if(transports[i]->probe &&
+		   ((n = transports[i]->find(vendorID,productID,serial)) >= 0))
+			found = n;
+
+	return found;
+}
+
+/****************************************************************************
+ Function    : usbSerial
+ Description : Reads the open device's USB serial number.
+ Parameters  : char*  Receives the serial number.
+               int    Size of buffer.
+ Returns     : int    1 on success, 0 if there is none.
+ ****************************************************************************/
+int usbSerial(
+  char * const buf,
+  const int    size)
+{
+	return current ? current->serial(buf,size) : 0;
+}
+
+/****************************************************************************
+ Function    : usbClose
+ Description : Closes the open device, if any.
+ Parameters  : None (void)
+ Returns     : Nothing (void)
+ ****************************************************************************/
+void usbClose(void)
+{
+	if(current) current->close();
+	current = NULL;
+}
+
+/****************************************************************************
+ Function    : usbCommandName
+ Description : Printable name of a bootloader command.
+ Parameters  : unsigned char  Command byte.
+ Returns     : char*          Name, or NULL if not a known command.
+ ****************************************************************************/
+const char *usbCommandName(const unsigned char cmd)
+{
+	static const char * const name[] = {
+		NULL,NULL,"QUERY_DEVICE","UNLOCK_CONFIG","ERASE_DEVICE",
+		"PROGRAM_DEVICE","PROGRAM_COMPLETE","GET_DATA","RESET_DEVICE",
+		"SIGN_FLASH"
+	}, * const ext[] = {
+		"QUERY_EXTENSIONS","CRC32_RANGE","ERASE_RANGE"
+	};
+
+	if((cmd >= QUERY_EXTENSIONS) && (cmd <= ERASE_RANGE))
+		return ext[cmd - QUERY_EXTENSIONS];
+	return (cmd < sizeof(name) / sizeof(name[0])) ? name[cmd] : NULL;
+}
+
+/* Describe the operation in progress for timeout and watchdog messages */
+static void usbDescribe(
+  char * const       buf,
+  const int          size,
+  const char * const what,
+  const unsigned char cmd,
+  const unsigned int addr)
+{
+	const char *name = usbCommandName(cmd);
+	int         n;
+
+	if(name) n = snprintf(buf,size,"%s %s",what,name);
+	else     n = snprintf(buf,size,"%s command 0x%02x",what,cmd);
+	if(((cmd == PROGRAM_DEVICE) || (cmd == GET_DATA) ||
+	    (cmd == CRC32_RANGE) || (cmd == ERASE_RANGE)) && (n < size))
+		(void)snprintf(&buf[n],size - n," at address %08x",addr);
+}
+
+#ifdef DEBUG
+static void usbDump(
+  const char * const          label,
+  const unsigned char * const buf)
+{
+	int i;
+
+	(void)puts(label);
+	for(i=0;i<8;i++) (void)printf("%02x ",buf[i]);
+	(void)printf(": ");
+	for(;i<usbReportSize;i++) (void)printf("%02x ",buf[i]);
+	(void)putchar('\n'); fflush(stdout);
+}
+#endif
+
+/****************************************************************************
+ Function    : usbWrite
+ Description : Write data packet to currently-open USB device, optionally
+               followed by a packet read operation.  Data source is always
+               global array usbBuf[].  For read operation, destination is
+               always usbBuf[] also, overwriting contents there.
+ Parameters  : int        Size of source data in bytes (max usbReportSize).
+               char       If set, read response packet.
+ Returns     : ErrorCode  As for usbPacket().
+ ****************************************************************************/
+ErrorCode usbWrite(
+  const int  len,
+  const char read)
+{
+	return usbPacket(usbBuf,len,read ? usbBuf : NULL);
+}
+
+/****************************************************************************
+ Function    : usbPacket
+ Description : Write data packet to currently-open USB device, optionally
+               followed by a packet read operation, using the caller's
+               buffers: a packet can be built where its data already is.
+ Parameters  : unsigned char*  Packet to send, with a byte free before it
+                               (see Transport in mphidflash.h).
+               int             Size of packet in bytes (max usbReportSize).
+               unsigned char*  Receives the response packet (usbReportSize
+                               bytes; may be the packet sent), or NULL for
+                               none.
+ Returns     : ErrorCode       ERR_NONE on success, ERR_USB_WRITE or
+                               ERR_USB_READ on error, ERR_USB_TIMEOUT if the
+                               device didn't respond in the time allowed
+                               (see watchdog.c).
+ Notes       : Device is assumed to have already been successfully opened
+               by the time this function is called; no checks performed here.
+ ****************************************************************************/
+ErrorCode usbPacket(
+  unsigned char * const out,
+  const int             len,
+  unsigned char * const in)
+{
+	ErrorCode          status;
+	unsigned long long start,sent;
+	unsigned char      cmd  = out[0];
+	unsigned int       addr = out[1] | (out[2] << 8) |
+	                          (out[3] << 16) | (out[4] << 24);
+	int                ms   = watchdogTimeout();
+	char               what[80];
+
+#ifdef DEBUG
+	usbDump("Sending:",out);
+	DEBUGMSG("\nAbout to write");
+#endif
+
+	EV_BEGIN(usbCommandName(cmd) ? usbCommandName(cmd) : "command",
+	  ((cmd == PROGRAM_DEVICE) || (cmd == GET_DATA)) ? addr : 0);
+	usbDescribe(what,sizeof(what),"write of",cmd,addr);
+	start = sent = traceClock();
+	watchdogArm(ms,what);
+	EV_BEGIN("usbSend",0);
+	status = faultSend(out,len,ms);
+	EV_END();
+	if(watchdogDisarm()) status = ERR_USB_TIMEOUT;
+	if(ERR_NONE != status) {
+		if(ERR_USB_TIMEOUT == status)
+			(void)printf("\nUSB timeout: %s not accepted within %d ms\n",
+			  what,ms);
+		metricsError();
+		EV_END();
+		return status;
+	}
+	tracePacket(TRACE_OUT,out,len,start);
+
+	DEBUGMSG("Done w/write");
+
+	if(in) {
+		DEBUGMSG("About to read");
+		usbDescribe(what,sizeof(what),"response to",cmd,addr);
+		ms    = watchdogTimeout();
+		start = traceClock();
+		watchdogArm(ms,what);
+		EV_BEGIN("usbRecv",0);
+		status = faultRecv(in,ms);
+		EV_END();
+		if(watchdogDisarm()) status = ERR_USB_TIMEOUT;
+		if(ERR_NONE != status) {
+			if(ERR_USB_TIMEOUT == status)
+				(void)printf("\nUSB timeout: no %s within %d ms\n",
+				  what,ms);
+			metricsError();
+			EV_END();
+			return status;
+		}
+		watchdogSample(traceClock() - sent);
+		telemetrySample(traceClock() - sent);
+		metricsSample(traceClock() - sent);
+		tracePacket(TRACE_IN,in,usbReportSize,start);
+#ifdef DEBUG
+		usbDump("Done reading\nReceived:",in);
+#endif
+	}
+	EV_END();
+
+	return ERR_NONE;
+}
+
+/****************************************************************************
+ Function    : usbWaitApp
+ Description : After a reset, waits for the application firmware to
+               enumerate under its own IDs and reports how long it took.
+ Parameters  : unsigned short      Application vendor ID.
+               unsigned short      Application product ID.
+               char*               Application serial number, or NULL.
+               int                 Time allowed, in milliseconds.
+               unsigned long long  traceClock() value when reset was sent.
+ Returns     : ErrorCode           ERR_NONE once the device is seen (or if
+                                   the backend can't look for it),
+                                   ERR_APP_TIMEOUT if it doesn't appear.
+ Notes       : The bootloader device should be closed first.  The IDs must
+               differ from the bootloader's, else the bootloader itself may
+               be found before it has left the bus.
+ ****************************************************************************/
+ErrorCode usbWaitApp(
+  const unsigned short     vendorID,
+  const unsigned short     productID,
+  const char * const       serial,
+  const int                timeout,
+  const unsigned long long resetAt)
+{
+	unsigned long long now;
+	int                found;
+
+	(void)printf("Waiting for application %04x:%04x%s%s...\n",vendorID,
+	  productID,serial ? " serial " : "",serial ? serial : "");
+	(void)fflush(stdout);
+
+	for(;;) {
+		found = usbFind(vendorID,productID,serial);
+		now   = traceClock();
+		if(found < 0) {
+			(void)puts("Can't look for devices with this build; not waiting");
+			return ERR_NONE;
+		}
+		if(found) {
+			(void)printf("Application enumerated %.0f ms after reset\n",
+			  (now - resetAt) / 1e6);
+			return ERR_NONE;
+		}
+		if(now - resetAt > timeout * 1000000ULL)
+			return ERR_APP_TIMEOUT;
+#ifndef WIN
+		(void)usleep(10000);
+#else
+		Sleep(10);
+#endif
+	}
+}
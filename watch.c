@@ -0,0 +1,242 @@
+/****************************************************************************
+ File        : watch.c
+ Description : Watch mode, for the edit-build-flash loop: the device is held
+               open and the hex file watched with inotify, and whenever the
+               build rewrites it the new image is flashed, with nobody
+               having to run mphidflash again.
+
+               The file's directory is watched rather than the file, so
+               that builds which write a new file and rename it over the
+               old one are seen as well as those writing it in place.  A
+               change is acted on once the file has been closed (or
+               renamed into place) and left alone for WATCH_SETTLE ms, or
+               for WATCH_QUIET ms if it is still open.  A file that is
+               still incomplete fails its line checks and is not flashed;
+               the write completing brings another change.  An image
+               identical to the one last programmed isn't flashed again.
+
+               After a reset (-r) the device leaves the bootloader; it is
+               looked for again when the next change comes, and waited for
+               until it returns.  Linux only, as inotify is.
+
+ License     : This file is part of 'mphidflash' program.
+
+               'mphidflash' is free software: you can redistribute it and/or
+               modify it under the terms of the GNU General Public License
+               as published by the Free Software Foundation, either version
+               3 of the License, or (at your option) any later version.
+
+               'mphidflash' is distributed in the hope that it will be useful,
+               but WITHOUT ANY WARRANTY; without even the implied warranty
+               of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+               See the GNU General Public License for more details.
+
+               You should have received a copy of the GNU General Public
+               License along with 'mphidflash' source code.  If not,
+               see <http://www.gnu.org/licenses/>.
+
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include "mphidflash.h"
+
+#ifdef __linux__
+
+#include <limits.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#define WATCH_SETTLE 20   /* ms quiet after file closed or renamed      */
+#define WATCH_QUIET  500  /* ms quiet after writes with file still open */
+#define WATCH_RETRY  250  /* ms between looks for the device            */
+
+static char               deviceOpen = 0;
+static unsigned long long lastHash   = 0;  /* Image last programmed; 0=none */
+
+/* Open the device and query it, unless still open, waiting for it if it
+   isn't there yet (as after a reset, until it's back in the bootloader) */
+static ErrorCode watchDevice(
+  const unsigned short vendorID,
+  const unsigned short productID)
+{
+	ErrorCode status;
+	char      waiting = 0;
+
+	if(deviceOpen) return ERR_NONE;
+
+	while(ERR_NONE != (status = usbOpen(vendorID,productID))) {
+		if(ERR_DEVICE_NOT_FOUND != status) return status;
+		if(!waiting) {
+			(void)puts("Waiting for device...");
+			(void)fflush(stdout);
+			waiting = 1;
+		}
+		(void)usleep(WATCH_RETRY * 1000);
+	}
+	if(ERR_NONE != (status = deviceQuery())) {
+		usbClose();
+		return status;
+	}
+	(void)printf("USB HID device found (%s)\n",usbTransportName());
+	deviceInfo();
+	if(ERR_NONE != (status = tuneLoad(vendorID,productID))) {
+		usbClose();
+		return status;
+	}
+	deviceOpen = 1;
+
+	return ERR_NONE;
+}
+
+/* Flash the hex file if it has changed since last programmed */
+static ErrorCode watchFlash(
+  const char * const        file,
+  const unsigned short      vendorID,
+  const unsigned short      productID,
+  const char                actions,
+  const unsigned long long  changedAt)
+{
+	ErrorCode          status;
+	unsigned long long hash;
+	int                n;
+
+	if(ERR_NONE != (status = watchDevice(vendorID,productID)))
+		return status;
+
+	/* Check every line before touching the device */
+	if(ERR_NONE != (status = hexOpen((char *)file)))
+		return status;
+	if(ERR_NONE != (status = hexRanges(NULL,&n,0,1))) {
+		hexClose();
+		return status;
+	}
+	if((hash = hexGetHash()) == lastHash) {
+		(void)puts("Image unchanged; not flashed");
+		hexClose();
+		return ERR_NONE;
+	}
+
+	/* Whatever is on the device is unknown until this succeeds */
+	lastHash = 0;
+	if(actions & ACTION_UNLOCK)
+		status = deviceUnlock();
+	if(ERR_NONE == status)
+		status = (actions & ACTION_WIPE) ? deviceErase() : deviceEraseImage();
+	if(ERR_NONE == status) {
+		(void)printf("Writing hex file '%s':",file);
+		status = hexWrite((actions & ACTION_VERIFY) != 0);
+		(void)putchar('\n');
+	}
+	hexClose();
+	if((ERR_NONE == status) && (actions & ACTION_SIGN))
+		status = deviceSign();
+	if(ERR_NONE == status)
+		lastHash = hash;
+	if((ERR_NONE == status) && (actions & ACTION_RESET))
+		status = deviceReset();
+
+	/* The device has left the bootloader, or is in an unknown state;
+	   open it afresh for the next change */
+	if((ERR_NONE != status) || (actions & ACTION_RESET)) {
+		usbClose();
+		deviceOpen = 0;
+	}
+
+	if((ERR_NONE == status) && changedAt)
+		(void)printf("Flashed %.1f ms after the file changed\n",
+		  (traceClock() - changedAt) / 1e6);
+
+	return status;
+}
+
+/****************************************************************************
+ Function    : watchRun
+ Description : Flashes a hex file, then again each time it changes, until
+               killed.
+ Parameters  : char*           Hex file.
+               unsigned short  Vendor ID of device.
+               unsigned short  Product ID of device.
+               char            ACTION_ bits: ACTION_UNLOCK, ACTION_WIPE
+                               (erase all of the device, not just the
+                               image's pages), ACTION_VERIFY, ACTION_SIGN
+                               and ACTION_RESET apply to every flash.
+ Returns     : ErrorCode       ERR_WATCH if the file's directory can't be
+                               watched; doesn't return otherwise.
+ Notes       : Errors flashing are reported, and the next change tried.
+ ****************************************************************************/
+ErrorCode watchRun(
+  const char * const   file,
+  const unsigned short vendorID,
+  const unsigned short productID,
+  const char           actions)
+{
+	char                        dir[PATH_MAX];
+	const char                 *base;
+	char                        buf[4096]
+	  __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	struct pollfd               pfd;
+	unsigned long long          now,changedAt,deadline;
+	ErrorCode                   status;
+	int                         n,i,timeout;
+
+	/* Split into directory (watched) and name (looked for in events) */
+	if((base = strrchr(file,'/'))) {
+		if(base - file >= (int)sizeof(dir)) return ERR_WATCH;
+		memcpy(dir,file,base - file);
+		dir[base - file] = 0;
+		if(!dir[0]) (void)strcpy(dir,"/");
+		base++;
+	} else {
+		(void)strcpy(dir,".");
+		base = file;
+	}
+
+	if((pfd.fd = inotify_init1(IN_CLOEXEC)) < 0)
+		return ERR_WATCH;
+	if(inotify_add_watch(pfd.fd,dir,IN_CLOSE_WRITE | IN_MOVED_TO |
+	  IN_MODIFY | IN_CREATE) < 0) {
+		(void)close(pfd.fd);
+		return ERR_WATCH;
+	}
+	pfd.events = POLLIN;
+
+	(void)printf("Watching '%s' for changes\n",file);
+	watchdogResident();
+
+	/* Flash what's there now, then wait for changes */
+	changedAt = 0;
+	deadline  = traceClock();
+	for(;;) {
+		now = traceClock();
+		if(!deadline)            timeout = -1;
+		else if(now >= deadline) timeout = 0;
+		else                     timeout = (deadline - now + 999999) / 1000000;
+
+		if(poll(&pfd,1,timeout) > 0) {
+			if((n = read(pfd.fd,buf,sizeof(buf))) <= 0) continue;
+			now = traceClock();
+			for(i=0;i<n;i += sizeof(struct inotify_event) + ev->len) {
+				ev = (const struct inotify_event *)&buf[i];
+				if(!ev->len || strcmp(ev->name,base)) continue;
+				/* Wait for the file to settle from the latest change */
+				changedAt = now;
+				deadline  = now + 1000000ULL *
+				  ((ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) ?
+				  WATCH_SETTLE : WATCH_QUIET);
+			}
+		} else if(deadline && (traceClock() >= deadline)) {
+			deadline = 0;
+			if(ERR_NONE != (status = watchFlash(file,vendorID,productID,
+			  actions,changedAt)))
+				(void)printf("Not flashed (status %d); waiting for the next "
+				  "change\n",status);
+			metricsEnd(status);
+			(void)fflush(stdout);
+		}
+	}
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,272 @@
+/****************************************************************************
+ File        : watchdog.c
+ Description : Timeouts for USB operations, derived from the round-trip
+               times actually measured on the link instead of one fixed
+               value, plus a watchdog that ends the program if a backend
+               call hangs regardless.  A wedged device then costs a station
+               a fraction of a second rather than seconds per packet (or,
+               with backends that wait forever, the whole fixture slot).
+
+               The timeout follows a smoothed RTT and its mean deviation,
+               as TCP does for retransmission, scaled generously and kept
+               within fixed bounds.  Commands known to keep the device busy
+               are the exception: an erase, and the query that waits on
+               it, get a separate, much longer budget, and a CRC32_RANGE
+               one that grows with the bytes it covers.
+
+ License     : This file is part of 'mphidflash' program.
+
+               'mphidflash' is free software: you can redistribute it and/or
+               modify it under the terms of the GNU General Public License
+               as published by the Free Software Foundation, either version
+               3 of the License, or (at your option) any later version.
+
+               'mphidflash' is distributed in the hope that it will be useful,
+               but WITHOUT ANY WARRANTY; without even the implied warranty
+               of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+               See the GNU General Public License for more details.
+
+               You should have received a copy of the GNU General Public
+               License along with 'mphidflash' source code.  If not,
+               see <http://www.gnu.org/licenses/>.
+
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+
+#ifndef WIN
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/time.h>
+#endif
+
+#include "mphidflash.h"
+
+#define TIMEOUT_INITIAL 1000   /* ms, until the first RTT is measured     */
+#define TIMEOUT_MIN      200   /* ms, floor for the adaptive timeout      */
+#define TIMEOUT_MAX     5000   /* ms, ceiling for the adaptive timeout    */
+#define TIMEOUT_SCALE     10   /* Timeout = SCALE * (srtt + 4 * rttvar)   */
+#define WATCHDOG_GRACE  1000   /* ms the watchdog allows beyond timeout   */
+
+int               eraseTimeout = 10000;  /* ms; set by --erase-timeout */
+
+static int        timeoutFirst = TIMEOUT_INITIAL,  /* ms, may be tuned */
+                  timeoutMin   = TIMEOUT_MIN;
+
+static double     srtt   = 0.0,          /* Smoothed RTT, ns           */
+                  rttvar = 0.0;          /* Mean RTT deviation, ns     */
+static int        budget = 0;            /* ms for a slow command; 0 =
+                                            adaptive                   */
+
+#ifndef WIN
+#define WATCHDOG_ABORT "\nWatchdog: still blocked; aborting\n"
+
+static char       watchdogMsg[160];
+static int        watchdogLen;
+static char       resident = 0;          /* Set by watchdogResident()  */
+static pthread_t  armedBy;               /* Thread in the backend call */
+static volatile sig_atomic_t fired;      /* Call interrupted           */
+
+/* SIGALRM handler.  Any thread may take the signal, and any of them may
+   be inside stdio, so nothing but write() is used here.  A resident
+   program has the call interrupted the first time, failing the job
+   rather than the program; a call still blocked after that won't ever
+   return, and the program ends as any other would. */
+static void watchdogFire(int sig)
+{
+	(void)sig;
+
+	/* The call is interrupted only in the thread making it */
+	if(!pthread_equal(pthread_self(),armedBy)) {
+		(void)pthread_kill(armedBy,SIGALRM);
+		return;
+	}
+	if(resident && !fired) {
+		fired = 1;
+		(void)write(STDOUT_FILENO,watchdogMsg,watchdogLen);
+		return;
+	}
+	if(resident)
+		(void)write(STDOUT_FILENO,WATCHDOG_ABORT,sizeof(WATCHDOG_ABORT) - 1);
+	else
+		(void)write(STDOUT_FILENO,watchdogMsg,watchdogLen);
+	_exit(ERR_USB_TIMEOUT);
+}
+#endif
+
+/****************************************************************************
+ Function    : watchdogSample
+ Description : Feeds one measured write-to-response round trip into the
+               timeout estimate.  Ignored while a slow command has its own
+               budget, since waiting on the device says nothing about the
+               link.
+ Parameters  : unsigned long long  Round-trip time in nanoseconds.
+ Returns     : Nothing (void)
+ ****************************************************************************/
+void watchdogSample(const unsigned long long rtt)
+{
+	double err;
+
+	if(budget) return;
+
+	if(srtt == 0.0) {
+		srtt   = rtt;
+		rttvar = rtt / 2.0;
+	} else {
+		err     = (double)rtt - srtt;
+		srtt   += err / 8.0;
+		rttvar += ((err < 0 ? -err : err) - rttvar) / 4.0;
+	}
+}
+
+/****************************************************************************
+ Function    : watchdogTimeout
+ Description : Time allowed for the next USB write or read.
+ Parameters  : None (void)
+ Returns     : int  Milliseconds.
+ ****************************************************************************/
+int watchdogTimeout(void)
+{
+	int ms;
+
+	if(budget)         return budget;
+	if(srtt == 0.0)    return timeoutFirst;
+
+	ms = (int)(TIMEOUT_SCALE * (srtt + 4.0 * rttvar) / 1e6);
+	if(ms < timeoutMin)  return timeoutMin;
+	if(ms > TIMEOUT_MAX) return TIMEOUT_MAX;
+	return ms;
+}
+
+/****************************************************************************
+ Function    : watchdogFloor
+ Description : Sets the timeout's floor, as tuned for the device (tune.c),
+               in place of the fixed one.  It also serves until the first
+               RTT is measured, so it must cover the slowest command the
+               device is sent without a budget of its own.
+ Parameters  : int  Milliseconds; 0 to go back to the fixed values.
+ Returns     : Nothing (void)
+ ****************************************************************************/
+void watchdogFloor(const int ms)
+{
+	if(!ms) {
+		timeoutFirst = TIMEOUT_INITIAL;
+		timeoutMin   = TIMEOUT_MIN;
+	} else {
+		timeoutFirst = timeoutMin = (ms > TIMEOUT_MAX) ? TIMEOUT_MAX : ms;
+	}
+}
+
+/****************************************************************************
+ Function    : watchdogErase
+ Description : Switches to (or back from) the erase time budget.
+ Parameters  : char  1 before sending ERASE_DEVICE, 0 once the erase is
+                     known to be complete.
+ Returns     : Nothing (void)
+ ****************************************************************************/
+void watchdogErase(const char on)
+{
+	budget = on ? eraseTimeout : 0;
+}
+
+/****************************************************************************
+ Function    : watchdogBudget
+ Description : Sets the time allowed for a command that keeps the device
+               busy for a while, in place of the adaptive timeout, until
+               set back to 0.  Its round trips aren't sampled.
+ Parameters  : int  Milliseconds; 0 to go back to the adaptive timeout.
+ Returns     : Nothing (void)
+ ****************************************************************************/
+void watchdogBudget(const int ms)
+{
+	budget = ms;
+}
+
+/****************************************************************************
+ Function    : watchdogArm
+ Description : Starts the watchdog for one backend call.  If the call has
+               not returned by the time its timeout plus a grace period has
+               passed, the given description of the operation is printed
+               and the program exits with ERR_USB_TIMEOUT; or, for a
+               resident program (watchdogResident()), the call is
+               interrupted, and the program exits only if it is still
+               blocked after a further grace period.
+ Parameters  : int          Timeout given to the backend, ms.
+               char*        Description of the operation.
+ Returns     : Nothing (void)
+ Notes       : Not available on Windows, where the backend's ReadFile()
+               still blocks until the device answers.
+ ****************************************************************************/
+void watchdogArm(
+  const int          ms,
+  const char * const what)
+{
+#ifndef WIN
+	static char      installed = 0;
+	struct sigaction act;
+	struct itimerval timer;
+	int              total = ms + WATCHDOG_GRACE;
+
+	watchdogLen = snprintf(watchdogMsg,sizeof(watchdogMsg),
+	  "\nWatchdog: %s still blocked after %d ms; %s\n",what,total,
+	  resident ? "interrupting" : "aborting");
+	if(watchdogLen >= (int)sizeof(watchdogMsg))
+		watchdogLen = sizeof(watchdogMsg) - 1;
+
+	if(!installed) {
+		/* No SA_RESTART: the blocked call must fail with EINTR */
+		memset(&act,0,sizeof(act));
+		act.sa_handler = watchdogFire;
+		(void)sigemptyset(&act.sa_mask);
+		(void)sigaction(SIGALRM,&act,NULL);
+		installed = 1;
+	}
+	armedBy = pthread_self();
+	fired   = 0;
+	memset(&timer,0,sizeof(timer));
+	timer.it_value.tv_sec  = total / 1000;
+	timer.it_value.tv_usec = (total % 1000) * 1000;
+	if(resident) {
+		timer.it_interval.tv_sec  = WATCHDOG_GRACE / 1000;
+		timer.it_interval.tv_usec = (WATCHDOG_GRACE % 1000) * 1000;
+	}
+	(void)setitimer(ITIMER_REAL,&timer,NULL);
+#endif
+}
+
+/****************************************************************************
+ Function    : watchdogDisarm
+ Description : Stops the watchdog started by watchdogArm().
+ Parameters  : None (void)
+ Returns     : int  1 if it interrupted the call, which must then be taken
+                    as timed out, whatever the backend returned; 0 if not.
+ ****************************************************************************/
+int watchdogDisarm(void)
+{
+#ifndef WIN
+	struct itimerval timer;
+
+	memset(&timer,0,sizeof(timer));
+	(void)setitimer(ITIMER_REAL,&timer,NULL);
+	return fired;
+#else
+	return 0;
+#endif
+}
+
+/****************************************************************************
+ Function    : watchdogResident
+ Description : Keeps the watchdog from ending the program, for those that
+               serve many jobs on one device (--serve, --watch): a hung
+               backend call is interrupted instead, failing that job only.
+ Parameters  : None (void)
+ Returns     : Nothing (void)
+ ****************************************************************************/
+void watchdogResident(void)
+{
+#ifndef WIN
+	resident = 1;
+#endif
+}